@@ -0,0 +1,261 @@
+-module(sdlBenchmark).
+-export([run/1, run/2, compare/2, compare/3, threadScaling/1]).
+
+%The NIF half of the benchmark suite. Runs the same benchmarks as sdlBenchmarkCpp.cpp through the NIF library, so comparing the two
+%shows what going through the NIF costs. Runs headless with SDL's dummy video driver.
+%Sdl is the module the NIF library is loaded into (the one built from erlangFunctionHeaders.txt). For example:
+%	sdlBenchmark:run(sdl, #{out => "nif.csv"}).
+%	./sdlBenchmarkCpp > cpp.csv
+%
+%Every result is one CSV line: side,benchmark,variant,bpp,reps,ops,median_ns,mean_ns,min_ns,max_ns
+%side is nif or cpp. Each repetition times ops operations, and the times are per operation.
+%Save the results of a run and pass them to compare/2 later to catch regressions.
+%To see whether render threads pay off, run with threads => true on a machine with several cores and pass the results to threadScaling/1:
+%	sdlBenchmark:run(sdl, #{threads => true, out => "threads.csv"}), sdlBenchmark:threadScaling("threads.csv").
+
+%Operations timed per repetition. These must match sdlBenchmarkCpp.cpp
+-define(CALL_OPS, 10000).
+-define(PIXEL_OPS, 10000).
+-define(LOAD_OPS, 20).
+-define(FRAME_OPS, 10).
+-define(FRAME_SPRITES, 100).
+-define(SPRITE_SIZE, 32).
+-define(SCREEN_WIDTH, 640).
+-define(SCREEN_HEIGHT, 480).
+-define(BMP_SIZE, 256).
+
+-define(HEADER, "side,benchmark,variant,bpp,reps,ops,median_ns,mean_ns,min_ns,max_ns\n").
+
+run(Sdl) ->
+	run(Sdl, #{}).
+
+run(Sdl, Options) ->
+	%Options: reps (default 10) and warmup (default 3) repetitions, depths to run at (default [32, 16]),
+	%out, a file to write the results to as well as printing them, threads (default false) true to also run the frame/submit
+	%and a large blit_batch at 1, 2, 4 ... render threads up to one per core (see sdl_SetRenderThreads)
+	Opts = maps:merge(#{reps => 10, warmup => 3, depths => [32, 16], threads => false}, Options),
+	%Headless, nothing is shown so the display can't skew the timings
+	os:putenv("SDL_VIDEODRIVER", "dummy"),
+	Sdl:sdl_Init("SDL_INIT_VIDEO"),
+	Screen = Sdl:sdl_CreateSurface(uniqueName("screen")),
+	BmpPath = "sdlBenchmark.bmp",
+	ok = file:write_file(BmpPath, bmp(?BMP_SIZE, ?BMP_SIZE)),
+	io:format(?HEADER),
+	Results = lists:append([runDepth(Sdl, Screen, BmpPath, Depth, Opts) || Depth <- maps:get(depths, Opts)]),
+	file:delete(BmpPath),
+	Sdl:sdl_FreeSurface(Screen),
+	Sdl:sdl_Quit(),
+	case maps:find(out, Opts) of
+		{ok, File} -> ok = file:write_file(File, [?HEADER | Results]);
+		error -> ok
+	end,
+	Results.
+
+runDepth(Sdl, Screen, BmpPath, Depth, Opts) ->
+	0 = Sdl:sdl_SetVideoMode(?SCREEN_WIDTH, ?SCREEN_HEIGHT, Depth, "SDL_SWSURFACE", Screen),
+	Run = fun(Benchmark, Variant, Ops, Body) -> measure(Benchmark, Variant, Depth, Ops, Body, Opts) end,
+	lists:append([benchCalls(Sdl, Screen, Run),
+		      benchBlits(Sdl, Screen, Run),
+		      benchPixels(Sdl, Screen, Run),
+		      benchLoads(Sdl, BmpPath, Run),
+		      benchFrame(Sdl, Screen, Run),
+		      case maps:get(threads, Opts) of
+			      true -> benchThreads(Sdl, Screen, Run);
+			      false -> []
+		      end]).
+
+measure(Benchmark, Variant, Depth, Ops, Body, #{reps := Reps, warmup := Warmup}) ->
+	%Runs Body (which does Ops operations) Warmup times untimed, then Reps times, and prints the time per operation
+	[Body() || _ <- lists:seq(1, Warmup)],
+	Times = lists:sort([timeOnce(Body) / Ops || _ <- lists:seq(1, Reps)]),
+	Median = lists:nth(length(Times) div 2 + 1, Times),
+	Mean = lists:sum(Times) / length(Times),
+	Line = io_lib:format("nif,~s,~s,~B,~B,~B,~.1f,~.1f,~.1f,~.1f~n",
+			     [Benchmark, Variant, Depth, Reps, Ops, float(Median), float(Mean), float(hd(Times)), float(lists:last(Times))]),
+	io:format("~s", [Line]),
+	[Line].
+
+timeOnce(Body) ->
+	Start = erlang:monotonic_time(nanosecond),
+	Body(),
+	erlang:monotonic_time(nanosecond) - Start.
+
+repeat(0, _Fun) ->
+	ok;
+repeat(N, Fun) ->
+	Fun(N),
+	repeat(N - 1, Fun).
+
+uniqueName(Prefix) ->
+	%Surface names must be unique, and a run may be repeated in the same VM
+	Prefix ++ "_bench_" ++ integer_to_list(erlang:unique_integer([positive])).
+
+makeSurface(Sdl, W, H, {R, G, B}) ->
+	%A surface in the screen's format, filled with one colour
+	Surface = Sdl:sdl_CreateSurface(uniqueName("surface")),
+	0 = Sdl:sdl_CreateBlankSurface(W, H, Surface),
+	0 = Sdl:sdl_FillRect(Surface, "NULL", Sdl:sdl_MapRGB(Surface, R, G, B)),
+	Surface.
+
+spritePosition(I) ->
+	%Where sprite I of a frame is drawn. The same positions are used by sdlBenchmarkCpp.cpp
+	{(I * 37) rem (?SCREEN_WIDTH - ?SPRITE_SIZE), (I * 91) rem (?SCREEN_HEIGHT - ?SPRITE_SIZE)}.
+
+bmp(W, H) ->
+	%A 24 bit BMP file of one colour, for the load benchmarks. Rows are padded to 4 bytes
+	RowBytes = (W * 3 + 3) band (bnot 3),
+	Row = <<(binary:copy(<<30, 20, 10>>, W))/binary, 0:((RowBytes - W * 3) * 8)>>,
+	Pixels = binary:copy(Row, H),
+	Offset = 14 + 40,
+	<<"BM", (Offset + byte_size(Pixels)):32/little, 0:32, Offset:32/little,
+	  40:32/little, W:32/little, H:32/little, 1:16/little, 24:16/little, 0:32, (byte_size(Pixels)):32/little,
+	  2835:32/little, 2835:32/little, 0:32, 0:32, Pixels/binary>>.
+
+benchCalls(Sdl, Screen, Run) ->
+	%Per call overhead: the cheapest call there is, mapping a colour
+	Run("call_overhead", "map_rgb", ?CALL_OPS, fun() -> repeat(?CALL_OPS, fun(I) -> Sdl:sdl_MapRGB(Screen, I band 255, 0, 0) end) end).
+
+benchBlits(Sdl, Screen, Run) ->
+	%Blit throughput for square surfaces of several sizes and the whole screen, copied and alpha blended
+	lists:append(
+	  [begin
+		   %Roughly the same number of pixels per repetition whatever the size
+		   Ops = max(1, 4000000 div (W * H)),
+		   Variant = integer_to_list(W) ++ "x" ++ integer_to_list(H),
+		   Source = makeSurface(Sdl, W, H, {200, 100, 50}),
+		   Blit = fun() -> repeat(Ops, fun(_) -> Sdl:sdl_BlitSurface(Source, "NULL", Screen, {0, 0}) end) end,
+		   Copied = Run("blit", Variant, Ops, Blit),
+		   0 = Sdl:sdl_SetBlendMode(Source, "SDL_BLENDMODE_BLEND", 128),
+		   Blended = Run("blit_alpha", Variant, Ops, Blit),
+		   Sdl:sdl_FreeSurface(Source),
+		   Copied ++ Blended
+	   end || {W, H} <- [{16, 16}, {64, 64}, {256, 256}, {?SCREEN_WIDTH, ?SCREEN_HEIGHT}]]).
+
+benchPixels(Sdl, Screen, Run) ->
+	%Single pixel writes with sdl_SetPixel, against one sdl_SetPixels call and whole rows with sdl_SetPixelRow
+	Colour = Sdl:sdl_MapRGB(Screen, 255, 255, 255),
+	Coord = fun(I) -> {I rem ?SCREEN_WIDTH, (I div ?SCREEN_WIDTH) rem ?SCREEN_HEIGHT} end,
+	Single = Run("set_pixels", "set_pixel", ?PIXEL_OPS,
+		     fun() -> repeat(?PIXEL_OPS, fun(N) -> {X, Y} = Coord(?PIXEL_OPS - N), Sdl:sdl_SetPixel(Screen, X, Y, Colour) end) end),
+	%The records are built inside the timing, building them is part of the cost of using sdl_SetPixels
+	Batch = Run("set_pixels", "batch", ?PIXEL_OPS,
+		    fun() ->
+			    Records = << <<X:16/signed-native, Y:16/signed-native, Colour:32/native>> || I <- lists:seq(0, ?PIXEL_OPS - 1), {X, Y} <- [Coord(I)] >>,
+			    Sdl:sdl_SetPixels(Screen, Records)
+		    end),
+	Rows = Run("set_pixels", "row", ?PIXEL_OPS,
+		   fun() ->
+			   [begin
+				    Count = min(?SCREEN_WIDTH, ?PIXEL_OPS - I),
+				    Sdl:sdl_SetPixelRow(Screen, 0, (I div ?SCREEN_WIDTH) rem ?SCREEN_HEIGHT, binary:copy(<<Colour:32/native>>, Count))
+			    end || I <- lists:seq(0, ?PIXEL_OPS - 1, ?SCREEN_WIDTH)]
+		   end),
+	Single ++ Batch ++ Rows.
+
+benchLoads(Sdl, BmpPath, Run) ->
+	%Loading a BMP: cold, with the asset cache turned off so every load decodes the file, and cached
+	Surface = Sdl:sdl_CreateSurface(uniqueName("loaded")),
+	{_, _, Budget, _, _} = Sdl:sdl_AssetCacheStats(),
+	Load = fun() -> repeat(?LOAD_OPS, fun(_) -> 0 = Sdl:sdl_LoadBMP(BmpPath, Surface) end) end,
+	0 = Sdl:sdl_SetAssetCacheBudget(0),
+	Cold = Run("load_bmp", "cold", ?LOAD_OPS, Load),
+	0 = Sdl:sdl_SetAssetCacheBudget(Budget),
+	Cached = Run("load_bmp", "cached", ?LOAD_OPS, Load),
+	Sdl:sdl_FreeSurface(Surface),
+	Cold ++ Cached.
+
+benchFrame(Sdl, Screen, Run) ->
+	%A whole frame: clear the screen, blit the sprites and flip. One call per sprite, one sdl_BlitBatch, and one sdl_Submit per frame
+	Sprite = makeSurface(Sdl, ?SPRITE_SIZE, ?SPRITE_SIZE, {50, 200, 100}),
+	Black = Sdl:sdl_MapRGB(Screen, 0, 0, 0),
+	Positions = [spritePosition(I) || I <- lists:seq(0, ?FRAME_SPRITES - 1)],
+	Calls = Run("frame", "calls", ?FRAME_OPS,
+		    fun() ->
+			    repeat(?FRAME_OPS, fun(_) ->
+						       Sdl:sdl_FillRect(Screen, "NULL", Black),
+						       [Sdl:sdl_BlitSurface(Sprite, "NULL", Screen, At) || At <- Positions],
+						       Sdl:sdl_Flip(Screen)
+					       end)
+		    end),
+	Batch = Run("frame", "batch", ?FRAME_OPS,
+		    fun() ->
+			    repeat(?FRAME_OPS, fun(_) ->
+						       Sdl:sdl_FillRect(Screen, "NULL", Black),
+						       Sprites = << <<(sdlCommandList:sprite({0, 0, ?SPRITE_SIZE, ?SPRITE_SIZE}, At))/binary>> || At <- Positions >>,
+						       Sdl:sdl_BlitBatch(Sprite, Screen, Sprites),
+						       Sdl:sdl_Flip(Screen)
+					       end)
+		    end),
+	Submit = Run("frame", "submit", ?FRAME_OPS, fun() -> submitFrames(Sdl, Sprite, Screen, Black, Positions) end),
+	Sdl:sdl_FreeSurface(Sprite),
+	Calls ++ Batch ++ Submit.
+
+submitFrames(Sdl, Sprite, Screen, Black, Positions) ->
+	%?FRAME_OPS frames of benchFrame's submit variant, the command list built each frame as a game would
+	repeat(?FRAME_OPS, fun(_) ->
+				   Commands = [sdlCommandList:fill(1, Black)] ++
+					   [sdlCommandList:blit(0, 1, At) || At <- Positions] ++
+					   [sdlCommandList:flip(1)],
+				   0 = Sdl:sdl_Submit([Sprite, Screen], Commands)
+			   end).
+
+benchThreads(Sdl, Screen, Run) ->
+	%How drawing scales with render threads: benchFrame's submit variant, and one sdl_BlitBatch ten times the frame's sprites,
+	%at 1, 2, 4 ... threads up to one per core. The variant is the thread count. The pool is turned off again afterwards
+	Cores = Sdl:sdl_SetRenderThreads(0),
+	Sprite = makeSurface(Sdl, ?SPRITE_SIZE, ?SPRITE_SIZE, {50, 200, 100}),
+	Black = Sdl:sdl_MapRGB(Screen, 0, 0, 0),
+	Positions = [spritePosition(I) || I <- lists:seq(0, ?FRAME_SPRITES - 1)],
+	%Built once, only the drawing is being compared
+	Sprites = << <<(sdlCommandList:sprite({0, 0, ?SPRITE_SIZE, ?SPRITE_SIZE}, spritePosition(I)))/binary>> || I <- lists:seq(0, ?FRAME_SPRITES * 10 - 1) >>,
+	Results = lists:append(
+		    [begin
+			     Threads = Sdl:sdl_SetRenderThreads(Count),
+			     Variant = integer_to_list(Threads),
+			     Submit = Run("frame_submit_threads", Variant, ?FRAME_OPS, fun() -> submitFrames(Sdl, Sprite, Screen, Black, Positions) end),
+			     Batch = Run("blit_batch_threads", Variant, ?FRAME_OPS,
+					 fun() -> repeat(?FRAME_OPS, fun(_) -> 0 = Sdl:sdl_BlitBatch(Sprite, Screen, Sprites) end) end),
+			     Submit ++ Batch
+		     end || Count <- threadCounts(1, Cores)]),
+	1 = Sdl:sdl_SetRenderThreads(1),
+	Sdl:sdl_FreeSurface(Sprite),
+	Results.
+
+threadCounts(Count, Cores) when Count >= Cores ->
+	[Cores];
+threadCounts(Count, Cores) ->
+	[Count | threadCounts(Count * 2, Cores)].
+
+compare(Baseline, Results) ->
+	compare(Baseline, Results, 0.1).
+
+compare(Baseline, Results, Tolerance) ->
+	%Compares two results files, e.g. from before and after a change. Returns (and prints) every result whose median is more than
+	%Tolerance (default 10%) slower than in Baseline, as {Side, Benchmark, Variant, Bpp, BaselineNs, NowNs}
+	Old = readResults(Baseline),
+	Slower = [{Side, Benchmark, Variant, Bpp, maps:get(Key, Old), Median}
+		  || {{Side, Benchmark, Variant, Bpp} = Key, Median} <- maps:to_list(readResults(Results)),
+		     maps:is_key(Key, Old), Median > maps:get(Key, Old) * (1 + Tolerance)],
+	[io:format("~s ~s ~s ~Bbpp: ~.1fns -> ~.1fns~n", [S, B, V, D, O, N]) || {S, B, V, D, O, N} <- Slower],
+	Slower.
+
+threadScaling(Results) ->
+	%Prints the time per operation of the threads benchmarks in a results file against the thread count, with the speedup over one
+	%thread. Returns them as {Benchmark, Bpp, Threads, MedianNs, Speedup}
+	All = readResults(Results),
+	Rows = lists:sort([{Benchmark, Bpp, list_to_integer(Variant), Median}
+			   || {{"nif", Benchmark, Variant, Bpp}, Median} <- maps:to_list(All),
+			      lists:member(Benchmark, ["frame_submit_threads", "blit_batch_threads"])]),
+	Scaling = [{Benchmark, Bpp, Threads, Median, maps:get({"nif", Benchmark, "1", Bpp}, All, Median) / Median}
+		   || {Benchmark, Bpp, Threads, Median} <- Rows],
+	[io:format("~s ~Bbpp ~B threads: ~.1fns, ~.2fx~n", [B, D, T, M, S]) || {B, D, T, M, S} <- Scaling],
+	Scaling.
+
+readResults(File) ->
+	%Reads a results file into a map of {Side, Benchmark, Variant, Bpp} => median ns
+	{ok, Data} = file:read_file(File),
+	[_Header | Lines] = string:split(string:trim(binary_to_list(Data)), "\n", all),
+	maps:from_list([begin
+				[Side, Benchmark, Variant, Bpp, _Reps, _Ops, Median | _] = string:split(string:trim(Line), ",", all),
+				{{Side, Benchmark, Variant, list_to_integer(Bpp)}, list_to_float(Median)}
+			end || Line <- Lines, string:trim(Line) =/= ""]).
@@ -0,0 +1,276 @@
+/* sdlBenchmarkCpp.cpp
+The pure C++ half of the benchmark suite. Runs the same benchmarks as sdlBenchmark.erl straight against SDL, so comparing the two shows
+what going through the NIF costs. Runs headless with SDL's dummy video driver, and prints one CSV line per result in the same format as
+sdlBenchmark.erl (see there for the columns).
+g++ -std=c++11 -O2 sdlBenchmarkCpp.cpp -o sdlBenchmarkCpp -lSDL
+./sdlBenchmarkCpp [Reps] [Warmup] > cpp.csv */
+
+#include <SDL/SDL.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+
+/*Operations timed per repetition. These must match sdlBenchmark.erl*/
+#define callOps 10000
+#define pixelOps 10000
+#define loadOps 20
+#define frameOps 10
+#define frameSprites 100
+#define spriteSize 32
+#define screenWidth 640
+#define screenHeight 480
+#define bmpSize 256
+
+/*Global variables
+---------------------------------------------------------------------------------------------------------------------------------------*/
+
+/*Repetitions timed, and untimed repetitions run first to warm up caches*/
+int reps = 10;
+int warmup = 3;
+
+SDL_Surface* screen = NULL;
+
+/*Stops the compiler dropping work whose result is never used*/
+volatile Uint32 sink = 0;
+
+/*Private Functions
+-------------------------------------------------------------------------------------------------------------------------------------------*/
+
+/**
+* Times body, which runs ops operations, warmup times untimed and then reps times, and prints the time per operation as a CSV line:
+* side,benchmark,variant,bpp,reps,ops,median_ns,mean_ns,min_ns,max_ns
+**/
+template<typename Body> void measure(const char* benchmark, const std::string& variant, long ops, Body body){
+	for(int i = 0; i < warmup; i++){
+		body();
+	}
+	std::vector<double> times;
+	for(int i = 0; i < reps; i++){
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		body();
+		double ns = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		times.push_back(ns / ops);
+	}
+	std::sort(times.begin(), times.end());
+	double total = 0;
+	for(size_t i = 0; i < times.size(); i++){
+		total += times[i];
+	}
+	std::printf("cpp,%s,%s,%d,%d,%ld,%.1f,%.1f,%.1f,%.1f\n", benchmark, variant.c_str(), screen->format->BitsPerPixel, reps, ops,
+		times[times.size() / 2], total / times.size(), times.front(), times.back());
+	std::fflush(stdout);
+}
+
+/**
+* Makes a surface in the screen's format, filled with one colour.
+**/
+SDL_Surface* makeSurface(int w, int h, Uint8 r, Uint8 g, Uint8 b){
+	SDL_Surface* made = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+	SDL_Surface* converted = SDL_DisplayFormat(made);
+	SDL_FreeSurface(made);
+	SDL_FillRect(converted, NULL, SDL_MapRGB(converted->format, r, g, b));
+	return converted;
+}
+
+/**
+* Writes one pixel, as sdl_SetPixel does.
+**/
+void putPixel(SDL_Surface* surface, int x, int y, Uint32 colour){
+	int bpp = surface->format->BytesPerPixel;
+	Uint8* pixel = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
+	switch(bpp){
+	case 1:
+		*pixel = (Uint8) colour;
+		break;
+	case 2:
+		*(Uint16 *)pixel = (Uint16) colour;
+		break;
+	case 3:
+		pixel[0] = colour & 0xff;
+		pixel[1] = (colour >> 8) & 0xff;
+		pixel[2] = (colour >> 16) & 0xff;
+		break;
+	case 4:
+		*(Uint32 *)pixel = colour;
+		break;
+	}
+}
+
+/**
+* Where sprite i of a frame is drawn. The same positions are used by sdlBenchmark.erl.
+**/
+void spritePosition(int i, Sint16* x, Sint16* y){
+	*x = (i * 37) % (screenWidth - spriteSize);
+	*y = (i * 91) % (screenHeight - spriteSize);
+}
+
+/**
+* Per call overhead: the cheapest call there is, mapping a colour.
+**/
+void benchCalls(){
+	measure("call_overhead", "map_rgb", callOps, [](){
+		for(int i = 0; i < callOps; i++){
+			sink = SDL_MapRGB(screen->format, i & 255, 0, 0);
+		}
+	});
+}
+
+/**
+* Blit throughput for square surfaces of several sizes and the whole screen, copied and alpha blended.
+**/
+void benchBlits(){
+	const int sizes[][2] = {{16, 16}, {64, 64}, {256, 256}, {screenWidth, screenHeight}};
+	for(int s = 0; s < 4; s++){
+		int w = sizes[s][0], h = sizes[s][1];
+		//Roughly the same number of pixels per repetition whatever the size
+		long ops = std::max(1L, 4000000L / ((long) w * h));
+		std::string variant = std::to_string(w) + "x" + std::to_string(h);
+		SDL_Surface* source = makeSurface(w, h, 200, 100, 50);
+		measure("blit", variant, ops, [&](){
+			for(long i = 0; i < ops; i++){
+				SDL_Rect at = {0, 0, 0, 0};
+				SDL_BlitSurface(source, NULL, screen, &at);
+			}
+		});
+		SDL_SetAlpha(source, SDL_SRCALPHA, 128);
+		measure("blit_alpha", variant, ops, [&](){
+			for(long i = 0; i < ops; i++){
+				SDL_Rect at = {0, 0, 0, 0};
+				SDL_BlitSurface(source, NULL, screen, &at);
+			}
+		});
+		SDL_FreeSurface(source);
+	}
+}
+
+/**
+* Single pixel writes, a batch of pixel records and whole rows of pixels.
+**/
+void benchPixels(){
+	Uint32 colour = SDL_MapRGB(screen->format, 255, 255, 255);
+	measure("set_pixels", "set_pixel", pixelOps, [&](){
+		for(int i = 0; i < pixelOps; i++){
+			putPixel(screen, i % screenWidth, (i / screenWidth) % screenHeight, colour);
+		}
+	});
+	//Records as sdl_SetPixels takes them, built inside the timing as sdlBenchmark.erl builds its binary, so the two sides compare alike
+	measure("set_pixels", "batch", pixelOps, [&](){
+		std::vector<unsigned char> records(pixelOps * 8);
+		for(int i = 0; i < pixelOps; i++){
+			Sint16 xy[2] = {(Sint16) (i % screenWidth), (Sint16) ((i / screenWidth) % screenHeight)};
+			std::memcpy(&records[i * 8], xy, sizeof(xy));
+			std::memcpy(&records[i * 8 + 4], &colour, sizeof(colour));
+		}
+		for(int i = 0; i < pixelOps; i++){
+			Sint16 xy[2];
+			Uint32 value;
+			std::memcpy(xy, &records[i * 8], sizeof(xy));
+			std::memcpy(&value, &records[i * 8 + 4], sizeof(value));
+			putPixel(screen, xy[0], xy[1], value);
+		}
+	});
+	std::vector<Uint32> row(screenWidth, colour);
+	measure("set_pixels", "row", pixelOps, [&](){
+		for(int i = 0; i < pixelOps; i += screenWidth){
+			int y = (i / screenWidth) % screenHeight;
+			for(int x = 0; x < screenWidth && i + x < pixelOps; x++){
+				putPixel(screen, x, y, row[x]);
+			}
+		}
+	});
+}
+
+/**
+* Loading a BMP: decoding it every time, and finding it again in a cache of decoded surfaces as sdl_LoadBMP does.
+**/
+void benchLoads(const char* path){
+	measure("load_bmp", "cold", loadOps, [&](){
+		for(int i = 0; i < loadOps; i++){
+			SDL_Surface* loaded = SDL_LoadBMP(path);
+			SDL_Surface* converted = SDL_DisplayFormat(loaded);
+			SDL_FreeSurface(loaded);
+			SDL_FreeSurface(converted);
+		}
+	});
+	std::unordered_map<std::string, SDL_Surface*> cache;
+	SDL_Surface* loaded = SDL_LoadBMP(path);
+	cache[path] = SDL_DisplayFormat(loaded);
+	SDL_FreeSurface(loaded);
+	measure("load_bmp", "cached", loadOps, [&](){
+		for(int i = 0; i < loadOps; i++){
+			struct stat info;
+			stat(path, &info);
+			SDL_Surface* cached = cache.find(path)->second;
+			cached->refcount++;
+			SDL_FreeSurface(cached);
+		}
+	});
+	SDL_FreeSurface(cache[path]);
+}
+
+/**
+* A whole frame: clear the screen, blit frameSprites sprites and flip.
+**/
+void benchFrame(){
+	SDL_Surface* sprite = makeSurface(spriteSize, spriteSize, 50, 200, 100);
+	Uint32 black = SDL_MapRGB(screen->format, 0, 0, 0);
+	measure("frame", "calls", frameOps, [&](){
+		for(int f = 0; f < frameOps; f++){
+			SDL_FillRect(screen, NULL, black);
+			for(int i = 0; i < frameSprites; i++){
+				SDL_Rect at = {0, 0, 0, 0};
+				spritePosition(i, &at.x, &at.y);
+				SDL_BlitSurface(sprite, NULL, screen, &at);
+			}
+			SDL_Flip(screen);
+		}
+	});
+	SDL_FreeSurface(sprite);
+}
+
+int main (int argc, char* argv[]){
+	if(argc > 1){
+		reps = std::max(1, std::atoi(argv[1]));
+	}
+	if(argc > 2){
+		warmup = std::max(0, std::atoi(argv[2]));
+	}
+	//Headless, nothing is shown so the display can't skew the timings
+	setenv("SDL_VIDEODRIVER", "dummy", 1);
+	if(SDL_Init(SDL_INIT_VIDEO) < 0){
+		std::fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	//The BMP for the load benchmarks, written once up front
+	const char* bmpPath = "sdlBenchmark.bmp";
+	SDL_Surface* image = SDL_CreateRGBSurface(SDL_SWSURFACE, bmpSize, bmpSize, 24, 0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+	SDL_FillRect(image, NULL, SDL_MapRGB(image->format, 10, 20, 30));
+	SDL_SaveBMP(image, bmpPath);
+	SDL_FreeSurface(image);
+
+	std::printf("side,benchmark,variant,bpp,reps,ops,median_ns,mean_ns,min_ns,max_ns\n");
+	const int depths[] = {32, 16};
+	for(int d = 0; d < 2; d++){
+		screen = SDL_SetVideoMode(screenWidth, screenHeight, depths[d], SDL_SWSURFACE);
+		if(screen == NULL){
+			std::fprintf(stderr, "SDL_SetVideoMode failed: %s\n", SDL_GetError());
+			continue;
+		}
+		benchCalls();
+		benchBlits();
+		benchPixels();
+		benchLoads(bmpPath);
+		benchFrame();
+	}
+
+	std::remove(bmpPath);
+	SDL_Quit();
+	return 0;
+}
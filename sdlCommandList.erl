@@ -0,0 +1,71 @@
+-module(sdlCommandList).
+-export([blit/3, blit/4, fill/2, fill/3, set_pixels/2, pixel/3, update_rect/2, flip/1,
+	 blit_batch/3, sprite/2, present/1, tiles/1]).
+
+%Builds command lists for sdl_Submit, so a whole frame can be drawn in one NIF call.
+%Each function returns one encoded command. A frame is a list of them, passed to sdl_Submit along with
+%the list of surfaces that the Src and Dst slot numbers refer to (the first surface in the list is slot 0).
+%For example:
+%	sdl_Submit([Hello, Screen], [sdlCommandList:blit(0, 1, {0,0}), sdlCommandList:flip(1)]).
+
+%Opcodes, these must match SubmitCommand in sdlNifLibrary.cpp
+-define(BLIT, 1).
+-define(FILL, 2).
+-define(SET_PIXELS, 3).
+-define(UPDATE_RECT, 4).
+-define(FLIP, 5).
+-define(BLIT_BATCH, 6).
+-define(PRESENT, 7).
+
+blit(Src, Dst, {X, Y}) ->
+	%Blits the whole of surface Src onto surface Dst at position {X,Y}
+	blit(Src, {0, 0, 0, 0}, Dst, {X, Y}).
+
+blit(Src, {SX, SY, SW, SH}, Dst, {X, Y}) ->
+	%Blits the rectangle {SX,SY,SW,SH} of surface Src onto surface Dst at position {X,Y}
+	%A rectangle with no width and height means the whole surface
+	<<?BLIT:8, Src:16/native, SX:16/signed-native, SY:16/signed-native, SW:16/native, SH:16/native,
+	  Dst:16/native, X:16/signed-native, Y:16/signed-native>>.
+
+fill(Dst, Colour) ->
+	%Fills the whole of surface Dst with pixel value Colour (from sdl_MapRGB/4)
+	fill(Dst, {0, 0, 0, 0}, Colour).
+
+fill(Dst, {X, Y, W, H}, Colour) ->
+	%Fills the rectangle {X,Y,W,H} of surface Dst with pixel value Colour
+	<<?FILL:8, Dst:16/native, X:16/signed-native, Y:16/signed-native, W:16/native, H:16/native, Colour:32/native>>.
+
+set_pixels(Dst, Pixels) when is_binary(Pixels) ->
+	%Sets pixels in surface Dst. Pixels is the same binary sdl_SetPixels takes, build it from pixel/3
+	[<<?SET_PIXELS:8, Dst:16/native, (byte_size(Pixels) div 8):32/native>>, Pixels].
+
+pixel(X, Y, Colour) ->
+	%One pixel record for set_pixels/2 or sdl_SetPixels
+	<<X:16/signed-native, Y:16/signed-native, Colour:32/native>>.
+
+update_rect(Dst, {X, Y, W, H}) ->
+	%Updates the rectangle {X,Y,W,H} of surface Dst on screen
+	<<?UPDATE_RECT:8, Dst:16/native, X:16/signed-native, Y:16/signed-native, W:16/native, H:16/native>>.
+
+flip(Dst) ->
+	%Flips surface Dst
+	<<?FLIP:8, Dst:16/native>>.
+
+present(Dst) ->
+	%Presents the parts of screen surface Dst drawn on since it was last presented, as sdl_Present
+	<<?PRESENT:8, Dst:16/native>>.
+
+blit_batch(Src, Dst, Sprites) when is_binary(Sprites) ->
+	%Blits many rectangles of surface Src onto surface Dst. Sprites is the same binary sdl_BlitBatch takes, build it from sprite/2
+	[<<?BLIT_BATCH:8, Src:16/native, Dst:16/native, (byte_size(Sprites) div 12):32/native>>, Sprites].
+
+sprite({SX, SY, SW, SH}, {X, Y}) ->
+	%One sprite record for blit_batch/3 or sdl_BlitBatch, draws the rectangle {SX,SY,SW,SH} of the source at {X,Y}
+	<<SX:16/signed-native, SY:16/signed-native, SW:16/native, SH:16/native, X:16/signed-native, Y:16/signed-native>>.
+
+tiles(Indices) ->
+	%The tile binary sdl_DrawTilemap takes, from a list of tile indices row by row. none leaves the tile empty
+	<< <<(tile_index(I)):16/native>> || I <- Indices >>.
+
+tile_index(none) -> 16#FFFF;
+tile_index(I) -> I.
@@ -7,589 +7,6947 @@
 #include <cstring>
 #include <fstream>
 #include <iomanip>
+#include <string>
+#include <unordered_map>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+/*Span fills have SSE2 and AVX2 versions on x86, picked at run time by what the CPU supports*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define simdSpans 1
+#include <immintrin.h>
+#endif
 
 #define maxBuffLen 1024
 
+/*Blits, flips and pixel batches touching more pixels than this are moved off the normal schedulers onto a dirty CPU scheduler*/
+#define dirtyPixelThreshold (256*256)
+
+/*Dirty rectangles kept per surface before giving up and treating the whole surface as dirty*/
+#define maxDirtyRects 32
+
+/*Tiles a tiled batch is split into per render thread, more than one so threads that finish early have tiles to steal*/
+#define renderTilesPerThread 4
+
 /*Global variables
 ---------------------------------------------------------------------------------------------------------------------------------------*/
 
-/*Array for storing surfaces in order to access them from an Erlang call.*/
-std::vector<SDL_Surface*> surfaceArray;
+/*Blend modes, set with sdl_SetBlendMode and sdl_SetDrawBlendMode. BLEND_NONE copies, the others combine each colour channel as
+	BLEND_BLEND: src * a + dst * (1 - a)
+	BLEND_ADD: min(src * a + dst, 1)
+	BLEND_MOD: src * dst
+where a is the source pixel's alpha (if it has any) times the constant alpha. The destination's own alpha is left as it was, as SDL does*/
+enum BlendMode{
+	BLEND_NONE = 0,
+	BLEND_BLEND = 1,
+	BLEND_ADD = 2,
+	BLEND_MOD = 3
+};
+
+struct BlendState{
+	Uint8 mode;
+	Uint8 alpha; //Constant alpha, 255 is opaque
+};
+
+/*What sdl_DrawTilemap last drew onto a layer, so the next call only has to redraw the tiles that changed*/
+struct TilemapCache{
+	Uint64 version; //The layer's version once it was drawn, so drawing on it any other way is noticed
+	Uint64 tilesetVersion;
+	BlendState blend;
+	int tileW, tileH;
+	int columns;
+	int viewX, viewY;
+	SDL_Rect clip;
+	std::vector<Uint16> tiles;
+};
+
+/*A surface handle. sdl_CreateSurface returns one of these to Erlang as a resource and every NIF accepts it in place of a surface name.
+The SDL_Surface stays NULL until sdl_SetVideoMode or sdl_LoadBMP gives the handle something to point at.
+Everything in a handle is guarded by its lock, which NIFs hold for as long as they use the handle (see SurfaceLocks), so processes
+drawing on different surfaces never wait for each other*/
+struct SurfaceHandle{
+	ErlNifMutex* lock;
+	SDL_Surface* surface;
+	bool isScreen; //The video surface belongs to SDL and is never freed by us
+	//The areas drawn on since the surface was last presented (or composed as a layer, see sdl_Compose), see markDirty. allDirty means the whole surface
+	SDL_Rect dirtyRects[maxDirtyRects];
+	int dirtyCount;
+	bool allDirty;
+	BlendState blend; //How the surface is blended when it is blitted onto another one
+	BlendState drawBlend; //How shapes and pixels are blended when they are drawn onto the surface
+	TilemapCache* tilemap; //Set while the surface is a tilemap layer, see sdl_DrawTilemap
+	Uint64 version; //Changed whenever the surface is replaced or about to be drawn on, see nextSurfaceVersion
+};
+
+/*Surface versions are handed out from one counter, so no two surfaces (or two states of one surface) ever share a version*/
+std::atomic<Uint64> surfaceVersions(0);
+
+inline Uint64 nextSurfaceVersion(){
+	return ++surfaceVersions;
+}
+
+/*Resource type for surface handles, opened when the library is loaded*/
+static ErlNifResourceType* surfaceResourceType = NULL;
+
+/*Pixels sent to the display by sdl_Present and sdl_Flip, for the last frame and in total, and the number of frames presented*/
+std::atomic<unsigned long> presentedFrames(0);
+std::atomic<unsigned long> lastPresentedPixels(0);
+std::atomic<unsigned long long> totalPresentedPixels(0);
 
-/*Array for storing the names associated with surfaces*/
-std::vector<std::string> surfaceNames;
+/*Names registered through the string based API and the handle each one refers to. The registry keeps a reference on every handle it holds.
+Names are spread over registryShards maps by hash, each with its own lock, so looking up names rarely waits on another scheduler*/
+#define registryShards 16
+struct RegistryShard{
+	std::mutex lock;
+	std::unordered_map<std::string, SurfaceHandle*> names;
+};
+RegistryShard surfaceRegistry[registryShards];
+
+/*The handle currently holding the video surface, if any. Only changed by setHandleSurface, with screenLock held*/
+SurfaceHandle* screenHandle = NULL;
+
+/*Held while handles are given different SDL surfaces, which is when the screen can change hands. Taken before any handle's lock*/
+std::mutex screenLock;
 
 /*Vector for storing palettes. The names will remain the same as for a surface as each surface can have one palette*/
 std::vector<SDL_Palette> surfacePalettes;
 
-/*Vector for RGB Maps*/
-std::vector<Uint32> rgbMaps;
+/*RGB Maps keyed by their names*/
+std::unordered_map<std::string, Uint32> rgbMaps;
+std::mutex rgbMapLock;
+
+/*A timer started by sdl_DelayAsync. The message is built in its own environment so it can be sent from the timer thread*/
+struct PendingTimer{
+	std::chrono::steady_clock::time_point deadline;
+	ErlNifPid pid;
+	ErlNifEnv* msgEnv;
+	ERL_NIF_TERM ref;
+
+	bool operator>(const PendingTimer& other) const{
+		return deadline > other.deadline;
+	}
+};
+
+/*Pending timers, soonest first, and the native thread that fires them. The thread is started by the first sdl_DelayAsync*/
+std::priority_queue<PendingTimer, std::vector<PendingTimer>, std::greater<PendingTimer> > timerQueue;
+std::mutex timerLock;
+std::condition_variable timerWake;
+std::thread timerThread;
+bool timerStopping = false;
+
+/*The frame clock started by sdl_StartFrameClock. Its thread sends a tick to the subscriber once per frame*/
+struct FrameClock{
+	int fps;
+	ErlNifPid subscriber;
+	long frames; //Ticks sent
+	long missed; //Frames skipped because the clock thread woke too late
+};
+FrameClock frameClock;
+std::mutex frameClockLock;
+std::condition_variable frameClockWake;
+std::thread frameClockThread;
+bool frameClockStopping = false;
+std::mutex frameClockControlLock; //Held while starting or stopping the clock thread
+
+/*The event pump started by sdl_StartEventPump. Its thread drains SDL's event queue and sends the events to the subscriber in batches*/
+#define eventPollMs 2 //How often the pump thread looks for new events
+#define eventChunk 64 //Events taken from SDL's queue at a time
+struct EventPump{
+	int fps; //Batches sent per second, at most
+	bool immediateKeys; //Key events are sent as soon as they arrive, along with anything batched before them
+	ErlNifPid subscriber;
+	long batches; //Messages sent
+	long events; //Events sent
+	long merged; //Mouse motion events merged into the one before
+};
+EventPump eventPump;
+std::mutex eventPumpLock;
+std::condition_variable eventPumpWake;
+std::thread eventPumpThread;
+bool eventPumpStopping = false;
+std::mutex eventPumpControlLock; //Held while starting or stopping the pump thread
+
+/*Frame capture started by sdl_StartCapture. Every frame presented to the screen is copied into a ring of buffers, and a writer thread
+converts them and writes them to disk. A frame presented while every buffer is still waiting to be written is dropped, never waited for*/
+enum CaptureFormat{
+	CAPTURE_Y4M = 0,
+	CAPTURE_PPM = 1
+};
+
+struct CaptureSlot{
+	std::vector<Uint8> pixels; //The frame's rows packed together
+	int w, h;
+	SDL_PixelFormat format; //The screen's format when the frame was copied, palette left out
+	SDL_Color palette[256]; //The screen's colours, for 8 bit screens
+	long frameNo;
+};
+
+struct FrameCapture{
+	int format;
+	int fps;
+	std::string path; //The Y4M file, or the start of each PPM file's name
+	std::ofstream file; //The Y4M file
+	std::vector<CaptureSlot> slots;
+	size_t next; //The next slot to write
+	size_t queued; //Slots waiting to be written, from next on
+	int width, height; //Size of the Y4M stream, set by the first frame
+	long frames; //Frames presented while capturing
+	long written;
+	long dropped;
+	bool failed; //A write failed, so every frame after it is dropped
+};
+FrameCapture capture;
+std::atomic<bool> capturing(false); //Checked before taking captureLock, so presenting costs nothing extra when not capturing
+std::mutex captureLock;
+std::condition_variable captureWake;
+std::thread captureThread;
+bool captureStopping = false;
+std::mutex captureControlLock; //Held while starting or stopping the capture
+
+/*A run of tiles, starting with the ones a render thread was given. Threads take tiles from the front of their own run, then from the
+front of the others' runs once theirs is empty. Runs are padded out to a cache line so the threads don't slow each other down*/
+struct TileQueue{
+	std::atomic<int> next;
+	int end;
+	char padding[64 - sizeof(std::atomic<int>) - sizeof(int)];
+};
+
+/*The render thread pool, started by sdl_SetRenderThreads. Large sdl_Submit and sdl_BlitBatch jobs are split into tiles drawn by the
+pool's threads and the calling thread together. With one participant (the default) there is no pool and everything draws on the calling thread*/
+std::vector<std::thread> renderThreads;
+TileQueue* renderQueues = NULL; //One run per participant, the calling thread's is first
+//The pool's threads plus the calling thread. Only changed with renderJobLock held, but read without it to decide whether a job is worth tiling
+std::atomic<int> renderParticipants(1);
+void (*renderDrawTile)(void* context, int tile); //The job being drawn
+void* renderContext;
+unsigned long renderGeneration = 0; //Counts jobs, a change wakes the threads
+int renderBusy = 0; //Threads still drawing the current job
+bool renderStopping = false;
+std::mutex renderLock;
+std::condition_variable renderWake;
+std::condition_variable renderDone;
+std::mutex renderJobLock; //Held while a job is on the pool, or the pool is being resized. Anyone else draws on their own thread
+
+/*Guards the reference counts of SDL surfaces. Surfaces are shared between handles and the asset cache, and a handle's surface is only
+copied before drawing on it if its count says someone else holds it too*/
+std::mutex surfaceRefLock;
+
+/*A decoded BMP held by the asset cache, along with the file details it was decoded from*/
+struct CachedAsset{
+	time_t mtime;
+	off_t fileSize;
+	SDL_Surface* surface; //The cache's own reference
+	size_t bytes;
+	std::list<std::string>::iterator lru;
+};
+
+/*The asset cache used by sdl_LoadBMP, keyed by path. An entry is used again as long as the file's modification time and size haven't changed.
+Entries are evicted least recently used first once the decoded pixels go over assetCacheBudget bytes*/
+std::unordered_map<std::string, CachedAsset> assetCache;
+std::list<std::string> assetLru; //Most recently used first
+size_t assetCacheBytes = 0;
+size_t assetCacheBudget = 64 * 1024 * 1024;
+unsigned long assetCacheHits = 0;
+unsigned long assetCacheMisses = 0;
+std::mutex assetCacheLock;
+
+/*Sampling filters for sdl_BlitTransformed*/
+enum TransformFilter{
+	FILTER_NEAREST = 0,
+	FILTER_BILINEAR = 1
+};
+
+/*A scaled and rotated image made by sdl_BlitTransformed, kept so the same transform of the same pixels is only worked out once.
+source and version say which surface, in which state, it was made from*/
+struct TransformEntry{
+	SDL_Surface* source;
+	Uint64 version;
+	SDL_Rect srcRect;
+	int w, h;
+	double angle;
+	int filter;
+	bool keepAlpha;
+	Uint8 surfaceAlpha;
+	int offsetX, offsetY; //Where the image's top left corner goes, relative to the destination rectangle's
+	SDL_Surface* image; //The cache's own reference
+	size_t bytes;
+};
+
+/*The transform cache, most recently used first. Entries are evicted from the back once their pixels go over transformCacheBudget bytes*/
+std::list<TransformEntry> transformCache;
+size_t transformCacheBytes = 0;
+size_t transformCacheBudget = 16 * 1024 * 1024;
+unsigned long transformCacheHits = 0;
+unsigned long transformCacheMisses = 0;
+std::mutex transformCacheLock;
+
+/*How a layer looked when sdl_Compose last drew it. If any of it changes, the layer is composed again where it was and where it is now*/
+struct LayerLook{
+	SDL_Surface* surface; //NULL if nothing was drawn
+	SDL_Rect area; //Where on the target it was drawn
+	int z;
+	BlendState blend; //As layerBlend works it out
+	Uint32 surfaceFlags; //The surface's SDL_SRCCOLORKEY and SDL_SRCALPHA flags
+	Uint32 colorKey;
+	Uint8 surfaceAlpha;
+	bool background; //Drawn into the compositor's cached background
+};
+
+/*A layer of the tree composed by sdl_Compose, set with sdl_SetLayer. Holds a reference on its surface handle*/
+struct Layer{
+	int id;
+	SurfaceHandle* handle;
+	int x, y, z;
+	Uint8 opacity;
+	bool visible;
+	bool isStatic; //Expected to change rarely, so it can be kept in the cached background
+	LayerLook drawn;
+};
+
+/*The layer tree. Layers are kept bottom first, by z and then in the order they were added. The static layers at the bottom are composed
+once into background, in the target's format, and the layers above them are drawn over a copy of it. dirtyRects are the areas of the target
+to compose again and backgroundRects those of background, kept as markDirty keeps a surface's. target is the surface last composed onto,
+and targetVersion its version afterwards: if anything else draws on it, all of it is composed again*/
+struct Compositor{
+	std::vector<Layer> layers;
+	SDL_Surface* background;
+	SurfaceHandle* target;
+	Uint64 targetVersion;
+	int width, height;
+	SDL_Rect dirtyRects[maxDirtyRects];
+	int dirtyCount;
+	bool allDirty;
+	SDL_Rect backgroundRects[maxDirtyRects];
+	int backgroundCount;
+	bool allBackground;
+	unsigned long composes;
+	unsigned long lastPixels;
+	unsigned long long totalPixels;
+	unsigned long long backgroundPixels;
+};
+Compositor compositor;
+std::mutex compositorLock; //Taken before any handle's lock
+
+/*An asset pack opened by sdl_OpenAssetPack, a file mapped into memory read only. BMPs are decoded straight out of the mapping by offset.
+Returned to Erlang as a resource, the file is unmapped when the last reference goes away*/
+struct AssetPack{
+	void* data;
+	size_t size;
+};
+
+/*Resource type for asset packs, opened when the library is loaded*/
+static ErlNifResourceType* assetPackResourceType = NULL;
+
+/*A row of pixels of a glyph, from x0 up to (not including) x1, all equally covered. coverage is 255 where the glyph is solid and less
+on the soft edges of anti-aliased fonts*/
+struct GlyphSpan{
+	Sint16 y, x0, x1;
+	Uint8 coverage;
+};
+
+/*A glyph of a bitmap font. It is drawn xOffset, yOffset from the pen, which then moves advance to the right.
+Its pixels are spanCount spans starting at firstSpan in the font's spans*/
+struct Glyph{
+	int xOffset, yOffset, advance;
+	int w, h;
+	size_t firstSpan, spanCount;
+};
+
+/*A bitmap font made by sdl_LoadFont. Glyphs are cut out of the atlas once, as spans, so drawing text doesn't touch the atlas at all and
+draws in any colour on any surface. Characters are found through ascii, or others for the rest of Unicode*/
+struct BitmapFont{
+	int lineHeight;
+	int fallback; //The glyph drawn for characters the font doesn't have, -1 for none
+	int ascii[128]; //Index of the glyph for each ASCII character, -1 for none
+	std::unordered_map<Uint32, int> others;
+	std::vector<Glyph> glyphs;
+	std::vector<GlyphSpan> spans;
+	long maxArea; //The largest glyph's pixels, for guessing how long drawing text will take
+};
+
+/*Returned to Erlang by sdl_LoadFont as a resource, the font is freed when the last reference goes away*/
+struct FontHandle{
+	BitmapFont* font;
+};
+
+/*Resource type for fonts, opened when the library is loaded*/
+static ErlNifResourceType* fontResourceType = NULL;
 
-/*Vector for RGB Map names*/
-std::vector<std::string> mapNames;
+/*A surface's pixels lent out to Erlang by sdl_GetPixels. Holds a reference on the surface so the binary stays valid after the handle
+moves on or is freed. Because the surface is then shared, anything that draws on it through a handle draws on a copy instead, so the
+binary is a snapshot that never changes under the reader*/
+struct PixelSnapshot{
+	SDL_Surface* surface;
+};
+
+/*Resource type for pixel snapshots, opened when the library is loaded*/
+static ErlNifResourceType* pixelSnapshotResourceType = NULL;
+
+/*A pixel buffer handed out by the surface pool. Buffers are bucketed by pitch and height, which between them fix the width and
+bytes per pixel, so a buffer only ever goes back to surfaces of the same size and depth*/
+struct PoolBuffer{
+	Uint64 bucket;
+	size_t bytes;
+	bool arena; //Carved out of an arena made by sdl_ReserveSurfaces, never given back to the system
+};
+
+/*The surface pool. Pixels of surfaces the library makes itself (scratch surfaces and copies made before drawing on shared surfaces) come
+from here, and go back on the free list of their bucket when the surface is freed, so surfaces made and freed every frame don't go through
+the system allocator. Free buffers over poolBudget bytes are given back to the system, so memory stays flat however long the session runs*/
+std::unordered_map<Uint64, std::vector<void*> > poolFree;
+std::unordered_map<void*, PoolBuffer> poolBuffers; //Every buffer the pool owns, free or in use
+size_t poolBytesInUse = 0;
+size_t poolHighWater = 0;
+size_t poolFreeBytes = 0;
+size_t poolArenaBytes = 0;
+size_t poolBudget = 32 * 1024 * 1024;
+unsigned long poolHits = 0;
+unsigned long poolMisses = 0;
+std::mutex poolLock;
+
+/*Buckets in a latency histogram. Times are in nanoseconds, bucketed HDR style: 4 buckets per power of two, so every bucket is within
+25% of the times in it, up to 2^41ns (about 36 minutes). Longer times all go in the last bucket*/
+#define histogramBuckets 160
+
+/*A histogram of times, updated without locks so many schedulers can record into it at once*/
+struct LatencyHistogram{
+	std::atomic<unsigned long long> counts[histogramBuckets];
+	std::atomic<unsigned long long> total;
+	std::atomic<unsigned long long> max;
+};
+
+/*Instrumentation for one NIF. Every NIF keeps one of these as a static, registered in nifStats the first time the NIF is called*/
+struct NifStats{
+	const char* name;
+	int arity;
+	LatencyHistogram latency;
+
+	NifStats(const char* name, int arity);
+};
+
+/*Every NIF's instrumentation, read by sdl_Stats*/
+std::vector<NifStats*> nifStats;
+std::mutex nifStatsLock;
+
+/*Times between frames presented by sdl_Flip and sdl_Present, and when the last one was presented (in steady_clock nanoseconds, 0 for none yet)*/
+LatencyHistogram frameTimes;
+std::atomic<long long> lastFrameTime(0);
+
+/*Bytes copied by blits and pixels written by the pixel and shape functions, in total*/
+std::atomic<unsigned long long> bytesBlitted(0);
+std::atomic<unsigned long long> pixelsWritten(0);
 
 /*Private Functions
 -------------------------------------------------------------------------------------------------------------------------------------------*/
 /**
-* Looks up surface index
-* @param surface name (string)
-* @return Index int if found, or -1 if not found.
+* The surface pool bucket for buffers of the given pitch and height.
 **/
-int surfaceIndex(std::string surfaceName){
-	//Returns the index of a surfaceName in surfaceNames
-	int i = 0;
-	while(i<surfaceNames.size()){
-		//If the surfaceName exists in surfaceNames return the index
-		const char* surfaceNamesValue = surfaceNames[i].c_str();
-		const char* surfaceNameValue = surfaceName.c_str();
-		if(std::strcmp(surfaceNamesValue,surfaceNameValue)==0){
-			return i;
+inline Uint64 poolBucket(int pitch, int h){
+	return ((Uint64) (Uint32) pitch << 32) | (Uint32) h;
+}
+
+/**
+* Takes a pixel buffer from the surface pool, allocating one if its bucket has none free.
+* @return The buffer, or NULL if it couldn't be allocated.
+**/
+void* takePixels(int pitch, int h){
+	Uint64 bucket = poolBucket(pitch, h);
+	size_t bytes = (size_t) pitch * h;
+	void* pixels = NULL;
+	{
+		std::lock_guard<std::mutex> lock(poolLock);
+		std::unordered_map<Uint64, std::vector<void*> >::iterator it = poolFree.find(bucket);
+		if(it != poolFree.end() && !it->second.empty()){
+			pixels = it->second.back();
+			it->second.pop_back();
+			poolFreeBytes -= bytes;
+			poolHits++;
 		}
-		i++;
+		else{
+			poolMisses++;
+		}
+	}
+	//Allocate without holding the lock
+	if(pixels == NULL){
+		pixels = std::malloc(bytes);
+		if(pixels == NULL){
+			return NULL;
+		}
+	}
+	std::lock_guard<std::mutex> lock(poolLock);
+	PoolBuffer& buffer = poolBuffers[pixels];
+	if(buffer.bytes == 0){
+		buffer.bucket = bucket;
+		buffer.bytes = bytes;
+		buffer.arena = false;
 	}
-	//If surface not found return -1
-	return (-1);
+	poolBytesInUse += bytes;
+	poolHighWater = std::max(poolHighWater, poolBytesInUse);
+	return pixels;
 }
 
 /**
-* Looks up map index
+* Gives back free buffers that aren't part of an arena until the pool's free buffers fit its budget. Must be called with poolLock held.
 **/
-int mapIndex(std::string mapName){
-	//Returns the index of a surfaceName in surfaceNames
-	int i = 0;
-	while(i<mapNames.size()){
-		//If the mapName exists in surfaceNames return the index
-		const char* mapNamesValue = mapNames[i].c_str();
-		const char* mapNameValue = mapName.c_str();
-		if(std::strcmp(mapNamesValue,mapNameValue)==0){
-			return i;
+void trimPool(){
+	std::unordered_map<Uint64, std::vector<void*> >::iterator it = poolFree.begin();
+	while(poolFreeBytes > poolBudget && it != poolFree.end()){
+		std::vector<void*>& buffers = it->second;
+		for(size_t i = 0; i < buffers.size() && poolFreeBytes > poolBudget; ){
+			std::unordered_map<void*, PoolBuffer>::iterator buffer = poolBuffers.find(buffers[i]);
+			if(buffer->second.arena){
+				i++;
+				continue;
+			}
+			poolFreeBytes -= buffer->second.bytes;
+			std::free(buffers[i]);
+			poolBuffers.erase(buffer);
+			buffers[i] = buffers.back();
+			buffers.pop_back();
 		}
-		i++;
+		it++;
 	}
-	//If surface not found return -1
-	return (-1);
 }
 
-/*NIF FUNCTIONS 
--------------------------------------------------------------------------------------------------------------------------------------------*/
+/**
+* Puts a pixel buffer back on its bucket's free list, ready for the next surface of the same size. Buffers over the pool's budget are
+* given back to the system instead.
+* @return false if the buffer didn't come from the pool.
+**/
+bool givePixels(void* pixels){
+	std::lock_guard<std::mutex> lock(poolLock);
+	std::unordered_map<void*, PoolBuffer>::iterator it = poolBuffers.find(pixels);
+	if(it == poolBuffers.end()){
+		return false;
+	}
+	poolBytesInUse -= it->second.bytes;
+	if(!it->second.arena && poolFreeBytes + it->second.bytes > poolBudget){
+		std::free(pixels);
+		poolBuffers.erase(it);
+		return true;
+	}
+	poolFree[it->second.bucket].push_back(pixels);
+	poolFreeBytes += it->second.bytes;
+	return true;
+}
 
 /**
-*	Wrapped SDL_Init function.
-*	@params Requires a flag (char*). Is passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, or 0 on success
+* Works out the pitch of a surface, rows are padded to 4 bytes as SDL does.
+* @return The pitch, or 0 if the surface would be too big for SDL.
 **/
-static ERL_NIF_TERM sdl_Init (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char initFlag[maxBuffLen];
-	enif_get_string(env, argv[0], initFlag, maxBuffLen, ERL_NIF_LATIN1); //Gets the string passed by the function call and puts it in initFlag.
-	if (std::strcmp(initFlag, "SDL_INIT_VIDEO") == 0){
-		SDL_Init(SDL_INIT_VIDEO);
-		return enif_make_int(env,0); /*exit code, process terminated correctly*/
+int surfacePitch(int w, int h, const SDL_PixelFormat* format){
+	if(w <= 0 || h <= 0 || w > 16384 || h > 16384){
+		return 0;
+	}
+	int pitch = (w * format->BytesPerPixel + 3) & ~3;
+	//SDL keeps the pitch in 16 bits
+	return pitch > 0xffff ? 0 : pitch;
+}
+
+/**
+* Makes a surface with its pixels from the surface pool. SDL leaves preallocated pixels alone when the surface is freed,
+* releaseSurface gives them back to the pool. The pixels are not cleared.
+* @param format The pixel format to use, its palette (if any) is copied
+* @return The surface, or NULL if it couldn't be made.
+**/
+SDL_Surface* pooledSurface(int w, int h, const SDL_PixelFormat* format){
+	int pitch = surfacePitch(w, h, format);
+	if(pitch == 0){
+		return NULL;
+	}
+	void* pixels = takePixels(pitch, h);
+	if(pixels == NULL){
+		return NULL;
+	}
+	SDL_Surface* surface = SDL_CreateRGBSurfaceFrom(pixels, w, h, format->BitsPerPixel, pitch, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+	if(surface == NULL){
+		givePixels(pixels);
+		return NULL;
+	}
+	if(format->palette != NULL){
+		SDL_SetColors(surface, format->palette->colors, 0, format->palette->ncolors);
+	}
+	return surface;
+}
+
+/**
+* Copies a surface into a pooled surface of the same size and format, along with its colour key and alpha.
+* RLE encoded surfaces are left to SDL_ConvertSurface, their pixels can't be copied as they are.
+* @return The copy, or NULL if it couldn't be made.
+**/
+SDL_Surface* copySurface(SDL_Surface* surface){
+	if(surface->flags & SDL_RLEACCEL){
+		return SDL_ConvertSurface(surface, surface->format, surface->flags);
+	}
+	SDL_Surface* copy = pooledSurface(surface->w, surface->h, surface->format);
+	if(copy == NULL){
+		return NULL;
+	}
+	if(copy->pitch == surface->pitch){
+		std::memcpy(copy->pixels, surface->pixels, (size_t) surface->pitch * surface->h);
 	}
 	else{
-		/* Flag not recognised, process not terminated correctly*/
-		return enif_make_string(env, "Init Flag not recognised, Init terminated" , ERL_NIF_LATIN1);
+		size_t row = (size_t) surface->w * surface->format->BytesPerPixel;
+		for(int y = 0; y < surface->h; y++){
+			std::memcpy((Uint8*) copy->pixels + (size_t) y * copy->pitch, (Uint8*) surface->pixels + (size_t) y * surface->pitch, row);
+		}
 	}
+	SDL_SetColorKey(copy, surface->flags & SDL_SRCCOLORKEY, surface->format->colorkey);
+	SDL_SetAlpha(copy, surface->flags & SDL_SRCALPHA, surface->format->alpha);
+	return copy;
 }
 
 /**
-*	Wrapped SDL_Quit function.
-*	@params None.
-*	@Return ERL_NIF_TERM 0 on success
+* The pixel format for surfaces made by the library: the screen's once a video mode is set, 32 bit RGB before that.
+* @param fallback Filled in and returned when there is no screen
 **/
-static ERL_NIF_TERM sdl_Quit (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	SDL_Quit();
-	return enif_make_int(env,0); /*exit code*/
+const SDL_PixelFormat* scratchFormat(SDL_PixelFormat* fallback){
+	SDL_Surface* screen = SDL_GetVideoSurface();
+	if(screen != NULL){
+		return screen->format;
+	}
+	std::memset(fallback, 0, sizeof(SDL_PixelFormat));
+	fallback->BitsPerPixel = 32;
+	fallback->BytesPerPixel = 4;
+	fallback->Rmask = 0x00ff0000;
+	fallback->Gmask = 0x0000ff00;
+	fallback->Bmask = 0x000000ff;
+	fallback->Rshift = 16;
+	fallback->Gshift = 8;
+	fallback->alpha = 255;
+	return fallback;
 }
 
 /**
-*	Wrapped SDL_CreateSurface function.
-*	@params Requires a surface name (char*). Is passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, an error if the surface already exists, or 0 on success
+* Finds the histogram bucket for a time.
 **/
-static ERL_NIF_TERM sdl_CreateSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
-		return enif_make_badarg(env);
+inline int histogramBucket(unsigned long long ns){
+	if(ns < 4){
+		return (int) ns;
 	}
-	std::string surfaceString(surfaceName);
-	//If the surfaceName already exists throw a wobbly
-	int i = surfaceIndex(surfaceString);
-	if(i>=0){
-		return enif_make_string(env, "The surface name specified already exists, new surface not created" , ERL_NIF_LATIN1);
+	//Position of the highest bit set
+	int top;
+#if defined(__GNUC__)
+	top = 63 - __builtin_clzll(ns);
+#else
+	top = 0;
+	while((ns >> top) > 1){
+		top++;
 	}
-	surfaceNames.push_back(surfaceString);
-	SDL_Surface* newSurface = new SDL_Surface();
-	surfaceArray.push_back(newSurface);
-	
-	return enif_make_int(env,0); /*exit code*/
+#endif
+	int bucket = (top - 1) * 4 + (int) ((ns >> (top - 2)) & 3);
+	return std::min(bucket, histogramBuckets - 1);
 }
 
 /**
-*	Wrapped SDL_SetVideoMode function.
-*	@params Requires integer values (width, height, bits-per-pixel), a flag (char*) and a surface. Passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, Surface not found error, or 0 on success
+* The shortest time that goes in a histogram bucket.
 **/
-static ERL_NIF_TERM sdl_SetVideoMode (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	int width, height, bits;
-	char flag[maxBuffLen];
-	char surfaceName [maxBuffLen];
-	//If width, height and bits passed are not integers throw an error
-	if (!enif_get_int(env, argv[0], &width) || !enif_get_int(env, argv[1], &height) || !enif_get_int(env, argv[2], &bits))
+unsigned long long histogramBucketStart(int bucket){
+	if(bucket < 4){
+		return bucket;
+	}
+	return (4ULL + bucket % 4) << (bucket / 4 - 1);
+}
+
+/**
+* Adds a time to a histogram.
+**/
+void recordTime(LatencyHistogram* histogram, unsigned long long ns){
+	histogram->counts[histogramBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	histogram->total.fetch_add(ns, std::memory_order_relaxed);
+	unsigned long long max = histogram->max.load(std::memory_order_relaxed);
+	while(ns > max && !histogram->max.compare_exchange_weak(max, ns, std::memory_order_relaxed)){
+	}
+}
+
+/**
+* Empties a histogram. Times recorded while it is being reset may be kept or lost.
+**/
+void resetHistogram(LatencyHistogram* histogram){
+	for(int i = 0; i < histogramBuckets; i++){
+		histogram->counts[i].store(0, std::memory_order_relaxed);
+	}
+	histogram->total.store(0, std::memory_order_relaxed);
+	histogram->max.store(0, std::memory_order_relaxed);
+}
+
+NifStats::NifStats(const char* name, int arity) : name(name), arity(arity){
+	resetHistogram(&latency);
+	std::lock_guard<std::mutex> lock(nifStatsLock);
+	nifStats.push_back(this);
+}
+
+/*Times a NIF call, adding it to the NIF's stats when the NIF returns. A call that moves itself onto a dirty scheduler with reschedule
+isn't counted, the call it moves to is*/
+class NifTimer{
+public:
+	NifTimer(NifStats& stats) : stats(stats), start(std::chrono::steady_clock::now()), handedOff(false){
+	}
+
+	~NifTimer(){
+		if(!handedOff){
+			recordTime(&stats.latency, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		}
+	}
+
+	/*enif_schedule_nif, for a NIF carrying on on a dirty CPU scheduler*/
+	ERL_NIF_TERM reschedule(ErlNifEnv* env, const char* name, ERL_NIF_TERM (*nif)(ErlNifEnv*, int, const ERL_NIF_TERM[]), int argc, const ERL_NIF_TERM argv[]){
+		handedOff = true;
+		return enif_schedule_nif(env, name, ERL_NIF_DIRTY_JOB_CPU_BOUND, nif, argc, argv);
+	}
+
+private:
+	NifStats& stats;
+	std::chrono::steady_clock::time_point start;
+	bool handedOff;
+};
+
+/**
+* Builds an Erlang map describing a histogram: #{count, total_ns, mean_ns, p50_ns, p90_ns, p99_ns, max_ns, histogram}.
+* Percentiles are the end of the bucket they fall in, the histogram is a list of {StartNs, Count} for the buckets that aren't empty.
+**/
+ERL_NIF_TERM histogramMap(ErlNifEnv* env, const LatencyHistogram* histogram){
+	unsigned long long counts[histogramBuckets];
+	unsigned long long count = 0;
+	for(int i = 0; i < histogramBuckets; i++){
+		counts[i] = histogram->counts[i].load(std::memory_order_relaxed);
+		count += counts[i];
+	}
+	unsigned long long total = histogram->total.load(std::memory_order_relaxed);
+	unsigned long long max = histogram->max.load(std::memory_order_relaxed);
+
+	const char* names[] = {"p50_ns", "p90_ns", "p99_ns"};
+	const double fractions[] = {0.5, 0.9, 0.99};
+	ERL_NIF_TERM map = enif_make_new_map(env);
+	for(int p = 0; p < 3; p++){
+		unsigned long long rank = (unsigned long long) std::ceil(fractions[p] * count);
+		unsigned long long seen = 0;
+		unsigned long long value = 0;
+		for(int i = 0; i < histogramBuckets && count > 0; i++){
+			seen += counts[i];
+			if(seen >= rank){
+				value = std::min(histogramBucketStart(i + 1) - 1, max);
+				break;
+			}
+		}
+		enif_make_map_put(env, map, enif_make_atom(env, names[p]), enif_make_uint64(env, value), &map);
+	}
+	ERL_NIF_TERM buckets = enif_make_list(env, 0);
+	for(int i = histogramBuckets - 1; i >= 0; i--){
+		if(counts[i] > 0){
+			ERL_NIF_TERM bucket = enif_make_tuple2(env, enif_make_uint64(env, histogramBucketStart(i)), enif_make_uint64(env, counts[i]));
+			buckets = enif_make_list_cell(env, bucket, buckets);
+		}
+	}
+	enif_make_map_put(env, map, enif_make_atom(env, "count"), enif_make_uint64(env, count), &map);
+	enif_make_map_put(env, map, enif_make_atom(env, "total_ns"), enif_make_uint64(env, total), &map);
+	enif_make_map_put(env, map, enif_make_atom(env, "mean_ns"), enif_make_uint64(env, count > 0 ? total / count : 0), &map);
+	enif_make_map_put(env, map, enif_make_atom(env, "max_ns"), enif_make_uint64(env, max), &map);
+	enif_make_map_put(env, map, enif_make_atom(env, "histogram"), buckets, &map);
+	return map;
+}
+
+/**
+* Takes another reference on a surface, SDL_FreeSurface won't free it until every reference has been released.
+**/
+void retainSurface(SDL_Surface* surface){
+	std::lock_guard<std::mutex> lock(surfaceRefLock);
+	surface->refcount++;
+}
+
+/**
+* Releases a reference on a surface, freeing it with the last one.
+**/
+void releaseSurface(SDL_Surface* surface){
+	std::lock_guard<std::mutex> lock(surfaceRefLock);
+	//Pooled pixels outlive the surface, they go back to the pool with the last reference
+	void* pooled = (surface->refcount == 1 && (surface->flags & SDL_PREALLOC)) ? surface->pixels : NULL;
+	SDL_FreeSurface(surface);
+	if(pooled != NULL){
+		givePixels(pooled);
+	}
+}
+
+/**
+* Checks whether anyone other than the caller holds a reference on a surface.
+**/
+bool surfaceShared(SDL_Surface* surface){
+	std::lock_guard<std::mutex> lock(surfaceRefLock);
+	return surface->refcount > 1;
+}
+
+/**
+* Releases whatever SDL surface a handle is holding. The video surface is left for SDL_Quit to free.
+* @param handle The surface handle to empty
+**/
+void releaseHandleSurface(SurfaceHandle* handle){
+	if(handle->surface != NULL && !handle->isScreen){
+		releaseSurface(handle->surface);
+	}
+	handle->surface = NULL;
+	handle->isScreen = false;
+}
+
+/**
+* Gives a handle a new SDL surface, freeing the one it held before. Must be called with screenLock and the handle's lock held.
+* @param handle The surface handle, surface The new surface (may be NULL), isScreen True if surface is the video surface
+**/
+void setHandleSurface(SurfaceHandle* handle, SDL_Surface* surface, bool isScreen){
+	if(handle->surface == surface){
+		handle->isScreen = isScreen;
+		return;
+	}
+	releaseHandleSurface(handle);
+	handle->surface = surface;
+	handle->isScreen = isScreen;
+	handle->version = nextSurfaceVersion();
+	handle->dirtyCount = 0;
+	handle->allDirty = true;
+	if(isScreen){
+		screenHandle = handle;
+	}
+	else if(screenHandle == handle){
+		screenHandle = NULL;
+	}
+}
+
+/**
+* Destructor for surface handle resources, called once neither Erlang nor the name registry refers to the handle.
+**/
+static void surfaceHandleDtor(ErlNifEnv* env, void* obj){
+	SurfaceHandle* handle = (SurfaceHandle*) obj;
 	{
-		return enif_make_badarg(env);
+		std::lock_guard<std::mutex> lock(screenLock);
+		releaseHandleSurface(handle);
+		if(screenHandle == handle){
+			screenHandle = NULL;
+		}
 	}
-	//If flag passed is not a string throw an error
-	if(!enif_get_string(env, argv[3], flag, maxBuffLen, ERL_NIF_LATIN1)){
-		//If fileName passed is not a string throw an error
+	delete handle->tilemap;
+	enif_mutex_destroy(handle->lock);
+}
+
+/*Locks on surface handles, held until the end of the NIF call that took them. Handles are always locked in address order, so two calls
+locking some of the same handles can't deadlock. A handle is only locked once however many times it's given*/
+class SurfaceLocks{
+public:
+	~SurfaceLocks(){
+		for(size_t i = 0; i < held.size(); i++){
+			enif_mutex_unlock(held[i]->lock);
+		}
+	}
+
+	/*Locks handles, NULLs are skipped. Must only be called once per SurfaceLocks*/
+	void lock(std::vector<SurfaceHandle*> handles){
+		handles.erase(std::remove(handles.begin(), handles.end(), (SurfaceHandle*) NULL), handles.end());
+		std::sort(handles.begin(), handles.end());
+		handles.erase(std::unique(handles.begin(), handles.end()), handles.end());
+		for(size_t i = 0; i < handles.size(); i++){
+			enif_mutex_lock(handles[i]->lock);
+		}
+		held.swap(handles);
+	}
+
+	void lock(SurfaceHandle* first, SurfaceHandle* second = NULL){
+		std::vector<SurfaceHandle*> handles;
+		handles.push_back(first);
+		handles.push_back(second);
+		lock(handles);
+	}
+
+private:
+	std::vector<SurfaceHandle*> held;
+};
+
+/**
+* Gives a handle a new SDL surface (or none), as setHandleSurface, taking the locks it needs. The handle stops being the screen if it was.
+**/
+void replaceHandleSurface(SurfaceHandle* handle, SDL_Surface* surface){
+	std::lock_guard<std::mutex> screen(screenLock);
+	SurfaceLocks locks;
+	locks.lock(handle);
+	setHandleSurface(handle, surface, false);
+}
+
+/**
+* Finds the registry shard a surface name lives in.
+**/
+RegistryShard& registryShard(const std::string& name){
+	return surfaceRegistry[std::hash<std::string>()(name) % registryShards];
+}
+
+/**
+* Looks up a surface handle. A handle found by name is kept alive until the calling NIF returns, even if the name is freed meanwhile.
+* @param term Either a surface handle returned by sdl_CreateSurface or a surface name (string),
+*	locks If given, the handle is locked in it. Calls needing more than one handle look them all up first and lock them together
+* @return 1 if found, 0 if the name is not registered, or -1 if term is neither a handle nor a string.
+**/
+int surfaceLookup(ErlNifEnv* env, ERL_NIF_TERM term, SurfaceHandle** handle, SurfaceLocks* locks = NULL){
+	//Handles are used directly, no lookup required
+	if(!enif_get_resource(env, term, surfaceResourceType, (void**) handle)){
+		char surfaceName[maxBuffLen];
+		if(!enif_get_string(env, term, surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+			return (-1);
+		}
+		std::string name(surfaceName);
+		RegistryShard& shard = registryShard(name);
+		std::lock_guard<std::mutex> lock(shard.lock);
+		std::unordered_map<std::string, SurfaceHandle*>::iterator it = shard.names.find(name);
+		if(it == shard.names.end()){
+			return 0;
+		}
+		*handle = it->second;
+		//A term for the handle holds a reference on it for as long as env lives
+		enif_make_resource(env, *handle);
+	}
+	if(locks != NULL){
+		locks->lock(*handle);
+	}
+	return 1;
+}
+
+/**
+* Looks up an SDL surface that has been given a surface to point at
+* @param term Either a surface handle or a surface name (string), locks The handle is locked in it, as surfaceLookup
+* @return As surfaceLookup, except 0 is also returned if the handle has no SDL surface yet.
+**/
+int surfaceLookup(ErlNifEnv* env, ERL_NIF_TERM term, SDL_Surface** surface, SurfaceLocks* locks){
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, term, &handle, locks);
+	if(found <= 0){
+		return found;
+	}
+	if(handle->surface == NULL){
+		return 0;
+	}
+	*surface = handle->surface;
+	return 1;
+}
+
+/**
+* Gets a handle's surface ready to be drawn on. A surface shared with the asset cache or another handle is copied first,
+* so drawing never changes pixels that someone else is using. The handle gets a new version, so anything made from the old pixels
+* (see transformCache) is no longer used.
+* @return The surface to draw on, or NULL if the handle has no surface or the copy failed.
+**/
+SDL_Surface* writableSurface(SurfaceHandle* handle){
+	SDL_Surface* surface = handle->surface;
+	handle->version = nextSurfaceVersion();
+	if(surface == NULL || handle->isScreen || !surfaceShared(surface)){
+		return surface;
+	}
+	SDL_Surface* copy = copySurface(surface);
+	if(copy == NULL){
+		return NULL;
+	}
+	releaseSurface(surface);
+	handle->surface = copy;
+	return copy;
+}
+
+/**
+* Works out how many pixels writableSurface would copy to make a handle's surface writable. Drawing NIFs add this to their work when
+* deciding whether to move to a dirty scheduler, and only call writableSurface (or readyCanvas) once they know they are staying where
+* they are, so a shared surface is never copied on a normal scheduler only to be copied again after rescheduling.
+* @return The surface's pixels if it is shared, otherwise 0.
+**/
+long copyCost(SurfaceHandle* handle){
+	SDL_Surface* surface = handle->surface;
+	if(surface == NULL || handle->isScreen || !surfaceShared(surface)){
+		return 0;
+	}
+	return (long) surface->w * surface->h;
+}
+
+/**
+* Adds an area to a list of dirty rectangles on a width by height surface, as markDirty describes. all is set instead once the list
+* is full or covers most of the surface.
+**/
+void addDirtyRect(SDL_Rect* rects, int& count, bool& all, int width, int height, int x, int y, int w, int h){
+	if(all){
+		return;
+	}
+	int x0 = x < 0 ? 0 : x;
+	int y0 = y < 0 ? 0 : y;
+	int x1 = x + w > width ? width : x + w;
+	int y1 = y + h > height ? height : y + h;
+	if(x1 <= x0 || y1 <= y0){
+		return;
+	}
+	//Merging two rectangles can make the result touch another one, so keep going until nothing merges
+	for(int i = 0; i < count; i++){
+		const SDL_Rect& r = rects[i];
+		if(r.x <= x1 && x0 <= r.x + r.w && r.y <= y1 && y0 <= r.y + r.h){
+			if(r.x < x0) x0 = r.x;
+			if(r.y < y0) y0 = r.y;
+			if(r.x + r.w > x1) x1 = r.x + r.w;
+			if(r.y + r.h > y1) y1 = r.y + r.h;
+			rects[i] = rects[--count];
+			i = -1;
+		}
+	}
+	long area = (long) (x1 - x0) * (y1 - y0);
+	for(int i = 0; i < count; i++){
+		area += (long) rects[i].w * rects[i].h;
+	}
+	if(count == maxDirtyRects || area * 4 > (long) width * height * 3){
+		count = 0;
+		all = true;
+		return;
+	}
+	SDL_Rect& rect = rects[count++];
+	rect.x = x0;
+	rect.y = y0;
+	rect.w = x1 - x0;
+	rect.h = y1 - y0;
+}
+
+/**
+* Records that an area of a handle's surface has been drawn on, so sdl_Present knows to send it to the display.
+* The area is clipped to the surface and merged with any dirty rectangle it overlaps or touches. Once there are more than maxDirtyRects
+* rectangles, or they cover most of the surface, the whole surface is marked dirty instead, one flip is cheaper than that many updates.
+**/
+void markDirty(SurfaceHandle* handle, int x, int y, int w, int h){
+	SDL_Surface* surface = handle->surface;
+	if(surface == NULL){
+		return;
+	}
+	addDirtyRect(handle->dirtyRects, handle->dirtyCount, handle->allDirty, surface->w, surface->h, x, y, w, h);
+}
+
+/**
+* Copies a frame about to be presented into the capture ring, if a capture is running. Called with the screen's lock held, just before
+* it is flipped, as a flip can swap in a different buffer. Drops the frame if the ring is full.
+**/
+void captureFrame(SDL_Surface* surface){
+	if(!capturing.load(std::memory_order_relaxed)){
+		return;
+	}
+	std::lock_guard<std::mutex> lock(captureLock);
+	if(!capturing){
+		return;
+	}
+	capture.frames++;
+	if(capture.width == 0){
+		capture.width = surface->w;
+		capture.height = surface->h;
+	}
+	//A Y4M stream can't change size part way through
+	bool resized = capture.format == CAPTURE_Y4M && (surface->w != capture.width || surface->h != capture.height);
+	if(capture.failed || resized || capture.queued == capture.slots.size()){
+		capture.dropped++;
+		return;
+	}
+	if(SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0){
+		capture.dropped++;
+		return;
+	}
+	CaptureSlot& slot = capture.slots[(capture.next + capture.queued) % capture.slots.size()];
+	size_t rowBytes = (size_t) surface->w * surface->format->BytesPerPixel;
+	//Only allocates the first time a slot is used at this size, sdl_StartCapture sizes the slots for the screen there was then
+	slot.pixels.resize(rowBytes * surface->h);
+	for(int y = 0; y < surface->h; y++){
+		std::memcpy(&slot.pixels[y * rowBytes], (Uint8 *)surface->pixels + y * surface->pitch, rowBytes);
+	}
+	if(SDL_MUSTLOCK(surface)){
+		SDL_UnlockSurface(surface);
+	}
+	slot.w = surface->w;
+	slot.h = surface->h;
+	slot.format = *surface->format;
+	slot.format.palette = NULL;
+	if(surface->format->palette != NULL){
+		int colours = std::min(surface->format->palette->ncolors, 256);
+		std::memcpy(slot.palette, surface->format->palette->colors, colours * sizeof(SDL_Color));
+	}
+	slot.frameNo = capture.frames;
+	capture.queued++;
+	captureWake.notify_one();
+}
+
+/**
+* Forgets a handle's dirty areas once they've been presented, and counts the pixels that were sent to the display.
+**/
+void presented(SurfaceHandle* handle, unsigned long pixels){
+	handle->dirtyCount = 0;
+	handle->allDirty = false;
+	presentedFrames++;
+	lastPresentedPixels = pixels;
+	totalPresentedPixels += pixels;
+	long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	long long last = lastFrameTime.exchange(now);
+	if(last != 0 && now > last){
+		recordTime(&frameTimes, now - last);
+	}
+}
+
+/**
+* Works out how many pixels presenting a handle's surface will send to the display.
+**/
+unsigned long dirtyPixels(SurfaceHandle* handle){
+	SDL_Surface* surface = handle->surface;
+	//Double buffered screens can only be presented with a flip
+	if(handle->allDirty || (surface->flags & SDL_DOUBLEBUF)){
+		return (unsigned long) surface->w * surface->h;
+	}
+	unsigned long pixels = 0;
+	for(int i = 0; i < handle->dirtyCount; i++){
+		pixels += (unsigned long) handle->dirtyRects[i].w * handle->dirtyRects[i].h;
+	}
+	return pixels;
+}
+
+/**
+* Presents the parts of the screen drawn on since it was last presented: with one SDL_UpdateRects call, or SDL_Flip if it is all dirty.
+* @return 0 on success, -1 if the flip failed.
+**/
+int presentDirty(SurfaceHandle* handle){
+	SDL_Surface* surface = handle->surface;
+	unsigned long pixels = dirtyPixels(handle);
+	captureFrame(surface);
+	if(handle->allDirty || (surface->flags & SDL_DOUBLEBUF)){
+		if(SDL_Flip(surface) < 0){
+			return (-1);
+		}
+	}
+	else if(handle->dirtyCount > 0){
+		SDL_UpdateRects(surface, handle->dirtyCount, handle->dirtyRects);
+	}
+	presented(handle, pixels);
+	return 0;
+}
+
+/**
+* Looks up a colour
+* @param term Either an integer pixel value (as returned by sdl_MapRGB/4) or the name of a map made by sdl_MapRGB/5
+* @return 1 if found, 0 if the map name doesn't exist, or -1 if term is neither an integer nor a string.
+**/
+int colourLookup(ErlNifEnv* env, ERL_NIF_TERM term, Uint32* colour){
+	unsigned int value;
+	if(enif_get_uint(env, term, &value)){
+		*colour = (Uint32) value;
+		return 1;
+	}
+	char mapName[maxBuffLen];
+	if(!enif_get_string(env, term, mapName, maxBuffLen, ERL_NIF_LATIN1)){
+		return (-1);
+	}
+	std::lock_guard<std::mutex> lock(rgbMapLock);
+	std::unordered_map<std::string, Uint32>::iterator it = rgbMaps.find(mapName);
+	if(it == rgbMaps.end()){
+		return 0;
+	}
+	*colour = it->second;
+	return 1;
+}
+
+/**
+* Checks whether a surface needs converting to match the screen, which lets SDL use its fast same-format blitters.
+* @return true if a video mode is set and the surface's pixel format differs from it.
+**/
+bool needsDisplayFormat(SDL_Surface* surface){
+	SDL_Surface* screen = SDL_GetVideoSurface();
+	if(screen == NULL){
+		return false;
+	}
+	SDL_PixelFormat* a = surface->format;
+	SDL_PixelFormat* b = screen->format;
+	return a->BitsPerPixel != b->BitsPerPixel || a->Rmask != b->Rmask || a->Gmask != b->Gmask || a->Bmask != b->Bmask || a->Amask != b->Amask;
+}
+
+/**
+* Converts a surface to the screen's pixel format, releasing the original. If conversion isn't possible the original is returned as it was.
+**/
+SDL_Surface* toDisplayFormat(SDL_Surface* surface){
+	if(!needsDisplayFormat(surface)){
+		return surface;
+	}
+	SDL_Surface* converted = SDL_DisplayFormat(surface);
+	if(converted == NULL){
+		return surface;
+	}
+	releaseSurface(surface);
+	return converted;
+}
+
+/**
+* Drops an asset cache entry. Handles still using its surface keep it alive. Must be called with assetCacheLock held.
+**/
+void dropAsset(std::unordered_map<std::string, CachedAsset>::iterator it){
+	assetCacheBytes -= it->second.bytes;
+	assetLru.erase(it->second.lru);
+	releaseSurface(it->second.surface);
+	assetCache.erase(it);
+}
+
+/**
+* Evicts least recently used assets until the cache fits its budget. Must be called with assetCacheLock held.
+**/
+void evictAssets(){
+	while(assetCacheBytes > assetCacheBudget && !assetLru.empty()){
+		dropAsset(assetCache.find(assetLru.back()));
+	}
+}
+
+/**
+* Loads a BMP through the asset cache. A file that was loaded before, and hasn't changed since, isn't read or decoded again.
+* Decoded surfaces are converted to the screen's pixel format when a video mode is set.
+* @param fileName Path of the BMP
+* @return The surface, with a reference taken for the caller, or NULL if the file couldn't be loaded.
+**/
+SDL_Surface* loadCachedBMP(const char* fileName){
+	struct stat info;
+	if(stat(fileName, &info) != 0){
+		return NULL;
+	}
+	std::string key(fileName);
+	{
+		std::lock_guard<std::mutex> lock(assetCacheLock);
+		std::unordered_map<std::string, CachedAsset>::iterator it = assetCache.find(key);
+		if(it != assetCache.end()){
+			if(it->second.mtime == info.st_mtime && it->second.fileSize == info.st_size){
+				CachedAsset& asset = it->second;
+				//Decoded before the video mode was set (or changed), convert it now
+				if(needsDisplayFormat(asset.surface)){
+					assetCacheBytes -= asset.bytes;
+					asset.surface = toDisplayFormat(asset.surface);
+					asset.bytes = (size_t) asset.surface->pitch * asset.surface->h;
+					assetCacheBytes += asset.bytes;
+				}
+				assetLru.splice(assetLru.begin(), assetLru, asset.lru);
+				assetCacheHits++;
+				retainSurface(asset.surface);
+				return asset.surface;
+			}
+			//The file has changed on disk since it was cached
+			dropAsset(it);
+		}
+		assetCacheMisses++;
+	}
+
+	//Decode without holding the lock, other loads can carry on meanwhile
+	SDL_Surface* surface = SDL_LoadBMP(fileName);
+	if(surface == NULL){
+		return NULL;
+	}
+	surface = toDisplayFormat(surface);
+
+	std::lock_guard<std::mutex> lock(assetCacheLock);
+	std::unordered_map<std::string, CachedAsset>::iterator it = assetCache.find(key);
+	if(it != assetCache.end()){
+		//Someone else loaded the same file while we were decoding it
+		dropAsset(it);
+	}
+	assetLru.push_front(key);
+	CachedAsset& asset = assetCache[key];
+	asset.mtime = info.st_mtime;
+	asset.fileSize = info.st_size;
+	asset.surface = surface;
+	asset.bytes = (size_t) surface->pitch * surface->h;
+	asset.lru = assetLru.begin();
+	assetCacheBytes += asset.bytes;
+	//One reference for the cache, one for the caller
+	retainSurface(surface);
+	evictAssets();
+	return surface;
+}
+
+/**
+* Empties the asset cache. Handles still using cached surfaces keep them alive.
+**/
+void clearAssetCache(){
+	std::lock_guard<std::mutex> lock(assetCacheLock);
+	while(!assetCache.empty()){
+		dropAsset(assetCache.begin());
+	}
+}
+
+/**
+* Decodes a BMP held in memory, without copying it, and converts it to the display format.
+* @return The surface, or NULL if the bytes aren't a BMP SDL can read
+**/
+SDL_Surface* loadBMPFromMemory(const void* data, size_t size){
+	if(size > 0x7fffffff){
+		return NULL;
+	}
+	SDL_RWops* rw = SDL_RWFromConstMem(data, (int) size);
+	if(rw == NULL){
+		return NULL;
+	}
+	SDL_Surface* surface = SDL_LoadBMP_RW(rw, 1);
+	if(surface == NULL){
+		return NULL;
+	}
+	return toDisplayFormat(surface);
+}
+
+/**
+* Called by the VM when an asset pack resource is garbage collected. Unmaps the file.
+**/
+static void assetPackDtor(ErlNifEnv* env, void* obj){
+	AssetPack* pack = (AssetPack*) obj;
+	if(pack->data != NULL){
+		munmap(pack->data, pack->size);
+	}
+}
+
+/**
+* Called by the VM when a font resource is garbage collected. Frees the font.
+**/
+static void fontDtor(ErlNifEnv* env, void* obj){
+	FontHandle* handle = (FontHandle*) obj;
+	delete handle->font;
+}
+
+/**
+* Called by the VM when the last binary made from a pixel snapshot is garbage collected. Releases the snapshot's reference on the surface.
+**/
+static void pixelSnapshotDtor(ErlNifEnv* env, void* obj){
+	PixelSnapshot* snapshot = (PixelSnapshot*) obj;
+	if(snapshot->surface != NULL){
+		releaseSurface(snapshot->surface);
+	}
+}
+
+/**
+* Reads a rectangle passed from Erlang as {X, Y, W, H}. SDL_Rect holds X and Y in 16 signed bits and W and H in 16 unsigned bits,
+* so anything that wouldn't fit is refused rather than wrapped.
+* @return true if term is a tuple of four integers, with X and Y in -32768..32767 and W and H in 0..65535.
+**/
+bool rectLookup(ErlNifEnv* env, ERL_NIF_TERM term, SDL_Rect* rect){
+	int arity;
+	const ERL_NIF_TERM* fields;
+	int x, y, w, h;
+	if(!enif_get_tuple(env, term, &arity, &fields) || arity != 4){
+		return false;
+	}
+	if(!enif_get_int(env, fields[0], &x) || !enif_get_int(env, fields[1], &y) || !enif_get_int(env, fields[2], &w) || !enif_get_int(env, fields[3], &h)){
+		return false;
+	}
+	if(x < -32768 || x > 32767 || y < -32768 || y > 32767 || w < 0 || w > 65535 || h < 0 || h > 65535){
+		return false;
+	}
+	rect->x = x;
+	rect->y = y;
+	rect->w = w;
+	rect->h = h;
+	return true;
+}
+
+/*Writes one pixel value at the given address. There is one of these for each bytes-per-pixel size so the size check happens once per call, not once per pixel*/
+typedef void (*PixelWriter)(Uint8* pixel, Uint32 colour);
+
+void writePixel1(Uint8* pixel, Uint32 colour){
+	*pixel = colour;
+}
+
+void writePixel2(Uint8* pixel, Uint32 colour){
+	*(Uint16 *)pixel = colour;
+}
+
+void writePixel3(Uint8* pixel, Uint32 colour){
+	//For a bits per pixel size of 3 the order of pixels may be reversed
+	if(SDL_BYTEORDER == SDL_BIG_ENDIAN) {
+		pixel[0] = (colour >> 16) & 0xff;
+		pixel[1] = (colour >> 8) & 0xff;
+		pixel[2] = colour & 0xff;
+	} else {
+		pixel[0] = colour & 0xff;
+		pixel[1] = (colour >> 8) & 0xff;
+		pixel[2] = (colour >> 16) & 0xff;
+	}
+}
+
+void writePixel4(Uint8* pixel, Uint32 colour){
+	*(Uint32 *)pixel = colour;
+}
+
+/**
+* Picks the pixel writer for a surface format
+* @param bpp Bytes per pixel of the surface
+* @return The writer, or NULL if bpp is out of range.
+**/
+PixelWriter pixelWriter(int bpp){
+	switch(bpp){
+		case 1: return writePixel1;
+		case 2: return writePixel2;
+		case 3: return writePixel3;
+		case 4: return writePixel4;
+	}
+	return NULL;
+}
+
+/**
+* Checks a co-ordinate against a clip rectangle, usually the surface's own
+* @return true if the pixel at (x,y) may be drawn to.
+**/
+inline bool insideClip(const SDL_Rect& clip, int x, int y){
+	return x >= clip.x && y >= clip.y && x < clip.x + clip.w && y < clip.y + clip.h;
+}
+
+/*Fills a run of pixels along a row with one pixel value. Like PixelWriter there is one for each bytes-per-pixel size,
+and the 2 and 4 byte sizes also have vector versions. Every version writes exactly the same pixels*/
+typedef void (*SpanFiller)(Uint8* pixel, int count, Uint32 colour);
+
+void fillSpan1(Uint8* pixel, int count, Uint32 colour){
+	std::memset(pixel, colour & 0xff, count);
+}
+
+void fillSpan2(Uint8* pixel, int count, Uint32 colour){
+	Uint16* out = (Uint16 *)pixel;
+	for(int i = 0; i < count; i++){
+		out[i] = colour;
+	}
+}
+
+void fillSpan3(Uint8* pixel, int count, Uint32 colour){
+	Uint8 bytes[3];
+	writePixel3(bytes, colour);
+	for(int i = 0; i < count; i++, pixel += 3){
+		pixel[0] = bytes[0];
+		pixel[1] = bytes[1];
+		pixel[2] = bytes[2];
+	}
+}
+
+void fillSpan4(Uint8* pixel, int count, Uint32 colour){
+	Uint32* out = (Uint32 *)pixel;
+	for(int i = 0; i < count; i++){
+		out[i] = colour;
+	}
+}
+
+#ifdef simdSpans
+/*The vector versions write single pixels up to a vector boundary, then whole aligned vectors, then the pixels left over*/
+__attribute__((target("sse2"))) void fillSpan2SSE2(Uint8* pixel, int count, Uint32 colour){
+	Uint16* out = (Uint16 *)pixel;
+	for(; count > 0 && ((uintptr_t) out & 15); count--){
+		*out++ = colour;
+	}
+	__m128i value = _mm_set1_epi16((short) colour);
+	for(; count >= 8; count -= 8, out += 8){
+		_mm_store_si128((__m128i *)out, value);
+	}
+	fillSpan2((Uint8 *)out, count, colour);
+}
+
+__attribute__((target("sse2"))) void fillSpan4SSE2(Uint8* pixel, int count, Uint32 colour){
+	Uint32* out = (Uint32 *)pixel;
+	for(; count > 0 && ((uintptr_t) out & 15); count--){
+		*out++ = colour;
+	}
+	__m128i value = _mm_set1_epi32((int) colour);
+	for(; count >= 4; count -= 4, out += 4){
+		_mm_store_si128((__m128i *)out, value);
+	}
+	fillSpan4((Uint8 *)out, count, colour);
+}
+
+__attribute__((target("avx2"))) void fillSpan2AVX2(Uint8* pixel, int count, Uint32 colour){
+	Uint16* out = (Uint16 *)pixel;
+	for(; count > 0 && ((uintptr_t) out & 31); count--){
+		*out++ = colour;
+	}
+	__m256i value = _mm256_set1_epi16((short) colour);
+	for(; count >= 16; count -= 16, out += 16){
+		_mm256_store_si256((__m256i *)out, value);
+	}
+	fillSpan2((Uint8 *)out, count, colour);
+}
+
+__attribute__((target("avx2"))) void fillSpan4AVX2(Uint8* pixel, int count, Uint32 colour){
+	Uint32* out = (Uint32 *)pixel;
+	for(; count > 0 && ((uintptr_t) out & 31); count--){
+		*out++ = colour;
+	}
+	__m256i value = _mm256_set1_epi32((int) colour);
+	for(; count >= 8; count -= 8, out += 8){
+		_mm256_store_si256((__m256i *)out, value);
+	}
+	fillSpan4((Uint8 *)out, count, colour);
+}
+#endif
+
+/*Vector instructions the CPU supports: 0 none, 1 SSE2, 2 AVX2. Checked once when the library is loaded*/
+enum SimdLevel{
+	SIMD_NONE = 0,
+	SIMD_SSE2 = 1,
+	SIMD_AVX2 = 2
+};
+
+SimdLevel detectSimd(){
+#ifdef simdSpans
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		return SIMD_AVX2;
+	}
+	if(__builtin_cpu_supports("sse2")){
+		return SIMD_SSE2;
+	}
+#endif
+	return SIMD_NONE;
+}
+
+static SimdLevel simdLevel = detectSimd();
+
+/**
+* Picks the span filler for a surface format, the fastest one the CPU can run.
+* @param bpp Bytes per pixel of the surface
+* @return The filler, or NULL if bpp is out of range.
+**/
+SpanFiller spanFiller(int bpp){
+	switch(bpp){
+		case 1: return fillSpan1;
+		case 3: return fillSpan3;
+#ifdef simdSpans
+		case 2: return simdLevel == SIMD_AVX2 ? fillSpan2AVX2 : simdLevel == SIMD_SSE2 ? fillSpan2SSE2 : fillSpan2;
+		case 4: return simdLevel == SIMD_AVX2 ? fillSpan4AVX2 : simdLevel == SIMD_SSE2 ? fillSpan4SSE2 : fillSpan4;
+#else
+		case 2: return fillSpan2;
+		case 4: return fillSpan4;
+#endif
+	}
+	return NULL;
+}
+
+/*Blend kernels
+Each kernel blends one row of pixels. They are templates over the blend mode and the source and destination pixel formats, so the
+mode and format checks are made once per call when the kernel is chosen, not once per pixel. Common formats get their own instances
+with the masks and shifts known at compile time, anything else goes through RuntimeFormat, which reads them from the SDL_PixelFormat.
+32 bit formats with a byte per channel also have SSE2 kernels. All the kernels for a format give exactly the same pixels.*/
+
+/*x / 255, rounded down, for 0 <= x <= 255 * 255. Used by the vector kernels too, so the results match*/
+inline Uint32 div255(Uint32 x){
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+constexpr int maskShift(Uint32 mask){
+	return mask == 0 ? 0 : (mask & 1) ? 0 : 1 + maskShift(mask >> 1);
+}
+
+constexpr int maskBits(Uint32 mask){
+	return mask == 0 ? 0 : (int) (mask & 1) + maskBits(mask >> 1);
+}
+
+/*Widens a channel of fewer than 8 bits to 0..255 the same way SDL_GetRGBA does, so full intensity stays full*/
+inline Uint8 expandChannel(Uint32 value, int loss){
+	return loss == 0 ? value : loss <= 4 ? (value << loss) + (value >> (8 - (loss << 1))) : value << loss;
+}
+
+template<int Bpp> inline Uint32 loadPixel(const Uint8* pixel);
+template<> inline Uint32 loadPixel<1>(const Uint8* pixel){
+	return *pixel;
+}
+template<> inline Uint32 loadPixel<2>(const Uint8* pixel){
+	return *(const Uint16 *)pixel;
+}
+template<> inline Uint32 loadPixel<3>(const Uint8* pixel){
+	if(SDL_BYTEORDER == SDL_BIG_ENDIAN){
+		return pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+	}
+	return pixel[0] | pixel[1] << 8 | pixel[2] << 16;
+}
+template<> inline Uint32 loadPixel<4>(const Uint8* pixel){
+	return *(const Uint32 *)pixel;
+}
+
+/*A pixel format known at compile time*/
+template<int Bpp, Uint32 Rmask, Uint32 Gmask, Uint32 Bmask, Uint32 Amask>
+struct FixedFormat{
+	static const int bpp = Bpp;
+
+	FixedFormat(const SDL_PixelFormat* format){}
+
+	Uint32 load(const Uint8* pixel) const{
+		return loadPixel<Bpp>(pixel);
+	}
+
+	void store(Uint8* pixel, Uint32 value) const{
+		pixelWriter(Bpp)(pixel, value);
+	}
+
+	void unpack(Uint32 pixel, Uint8* rgba) const{
+		rgba[0] = expandChannel((pixel & Rmask) >> maskShift(Rmask), 8 - maskBits(Rmask));
+		rgba[1] = expandChannel((pixel & Gmask) >> maskShift(Gmask), 8 - maskBits(Gmask));
+		rgba[2] = expandChannel((pixel & Bmask) >> maskShift(Bmask), 8 - maskBits(Bmask));
+		rgba[3] = Amask ? expandChannel((pixel & Amask) >> maskShift(Amask), 8 - maskBits(Amask)) : 255;
+	}
+
+	/*Packs red, green and blue into a pixel, keeping the rest of old (alpha and unused bits)*/
+	Uint32 pack(const Uint8* rgb, Uint32 old) const{
+		return (old & ~(Rmask | Gmask | Bmask)) | ((Uint32) (rgb[0] >> (8 - maskBits(Rmask))) << maskShift(Rmask))
+			| ((Uint32) (rgb[1] >> (8 - maskBits(Gmask))) << maskShift(Gmask)) | ((Uint32) (rgb[2] >> (8 - maskBits(Bmask))) << maskShift(Bmask));
+	}
+
+	static bool matches(const SDL_PixelFormat* format){
+		return format->BytesPerPixel == Bpp && format->palette == NULL && format->Rmask == Rmask && format->Gmask == Gmask
+			&& format->Bmask == Bmask && format->Amask == Amask;
+	}
+};
+
+typedef FixedFormat<4, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000> FormatARGB8888;
+typedef FixedFormat<4, 0x00FF0000, 0x0000FF00, 0x000000FF, 0> FormatXRGB8888;
+typedef FixedFormat<2, 0xF800, 0x07E0, 0x001F, 0> FormatRGB565;
+typedef FixedFormat<2, 0x7C00, 0x03E0, 0x001F, 0> FormatRGB555;
+
+/*Any other pixel format, read from its SDL_PixelFormat. Palettes are looked up, and blended colours matched back with SDL_MapRGB*/
+struct RuntimeFormat{
+	const SDL_PixelFormat* format;
+	int bpp;
+
+	RuntimeFormat(const SDL_PixelFormat* format) : format(format), bpp(format->BytesPerPixel){}
+
+	Uint32 load(const Uint8* pixel) const{
+		switch(bpp){
+			case 1: return loadPixel<1>(pixel);
+			case 2: return loadPixel<2>(pixel);
+			case 3: return loadPixel<3>(pixel);
+		}
+		return loadPixel<4>(pixel);
+	}
+
+	void store(Uint8* pixel, Uint32 value) const{
+		pixelWriter(bpp)(pixel, value);
+	}
+
+	void unpack(Uint32 pixel, Uint8* rgba) const{
+		if(format->palette != NULL){
+			const SDL_Color& colour = format->palette->colors[pixel & 0xff];
+			rgba[0] = colour.r;
+			rgba[1] = colour.g;
+			rgba[2] = colour.b;
+			rgba[3] = 255;
+			return;
+		}
+		rgba[0] = expandChannel((pixel & format->Rmask) >> format->Rshift, format->Rloss);
+		rgba[1] = expandChannel((pixel & format->Gmask) >> format->Gshift, format->Gloss);
+		rgba[2] = expandChannel((pixel & format->Bmask) >> format->Bshift, format->Bloss);
+		rgba[3] = format->Amask ? expandChannel((pixel & format->Amask) >> format->Ashift, format->Aloss) : 255;
+	}
+
+	Uint32 pack(const Uint8* rgb, Uint32 old) const{
+		if(format->palette != NULL){
+			return SDL_MapRGB((SDL_PixelFormat *)format, rgb[0], rgb[1], rgb[2]);
+		}
+		return (old & ~(format->Rmask | format->Gmask | format->Bmask)) | ((Uint32) (rgb[0] >> format->Rloss) << format->Rshift)
+			| ((Uint32) (rgb[1] >> format->Gloss) << format->Gshift) | ((Uint32) (rgb[2] >> format->Bloss) << format->Bshift);
+	}
+};
+
+/*Blends the red, green and blue of s into d with alpha a*/
+template<int Mode> inline void blendRGB(const Uint8* s, Uint32 a, Uint8* d){
+	for(int c = 0; c < 3; c++){
+		if(Mode == BLEND_BLEND){
+			d[c] = div255(s[c] * a + d[c] * (255 - a));
+		}
+		else if(Mode == BLEND_ADD){
+			Uint32 sum = d[c] + div255(s[c] * a);
+			d[c] = sum > 255 ? 255 : sum;
+		}
+		else{
+			d[c] = div255(s[c] * d[c]);
+		}
+	}
+}
+
+/*Blends a row of count source pixels onto the destination, alpha is the constant alpha*/
+typedef void (*BlendBlitRow)(const SDL_PixelFormat* srcFormat, const SDL_PixelFormat* dstFormat, const Uint8* src, Uint8* dst, int count, Uint8 alpha);
+
+/*Blends one colour onto a row of count destination pixels, rgba is the colour with its alpha already multiplied by the constant alpha*/
+typedef void (*BlendFillRow)(const SDL_PixelFormat* dstFormat, Uint8* dst, int count, const Uint8* rgba);
+
+template<int Mode, class SrcFormat, class DstFormat>
+void blendBlitRow(const SDL_PixelFormat* srcFormat, const SDL_PixelFormat* dstFormat, const Uint8* src, Uint8* dst, int count, Uint8 alpha){
+	SrcFormat in(srcFormat);
+	DstFormat out(dstFormat);
+	for(int i = 0; i < count; i++, src += in.bpp, dst += out.bpp){
+		Uint8 s[4], d[4];
+		Uint32 old = out.load(dst);
+		in.unpack(in.load(src), s);
+		out.unpack(old, d);
+		blendRGB<Mode>(s, div255(s[3] * alpha), d);
+		out.store(dst, out.pack(d, old));
+	}
+}
+
+template<int Mode, class DstFormat>
+void blendFillRow(const SDL_PixelFormat* dstFormat, Uint8* dst, int count, const Uint8* rgba){
+	DstFormat out(dstFormat);
+	for(int i = 0; i < count; i++, dst += out.bpp){
+		Uint8 d[4];
+		Uint32 old = out.load(dst);
+		out.unpack(old, d);
+		blendRGB<Mode>(rgba, rgba[3], d);
+		out.store(dst, out.pack(d, old));
+	}
+}
+
+#ifdef simdSpans
+/*SSE2 kernels for 32 bit pixels with a byte per channel, where the source and destination have their red, green and blue in the
+same bytes. Four pixels are blended at a time, with the channels widened to 16 bits. AlphaByte is the byte holding the source's alpha,
+-1 if it has none. Solid blends the one source pixel onto every destination pixel, for fills. keepMask is the destination bits to leave alone*/
+template<int Mode, int AlphaByte>
+__attribute__((target("sse2"))) inline __m128i blendHalfSSE2(__m128i s, __m128i d, __m128i constAlpha){
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i full = _mm_set1_epi16(255);
+	__m128i result;
+	__m128i a = constAlpha;
+	if(AlphaByte >= 0){
+		a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(AlphaByte, AlphaByte, AlphaByte, AlphaByte)), _MM_SHUFFLE(AlphaByte, AlphaByte, AlphaByte, AlphaByte));
+		a = _mm_mullo_epi16(a, constAlpha);
+		a = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(a, one), _mm_srli_epi16(a, 8)), 8);
+	}
+	if(Mode == BLEND_BLEND){
+		result = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, _mm_sub_epi16(full, a)));
+	}
+	else if(Mode == BLEND_ADD){
+		result = _mm_mullo_epi16(s, a);
+	}
+	else{
+		result = _mm_mullo_epi16(s, d);
+	}
+	result = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(result, one), _mm_srli_epi16(result, 8)), 8);
+	if(Mode == BLEND_ADD){
+		//Saturated to 255 when packed back to bytes
+		result = _mm_add_epi16(result, d);
+	}
+	return result;
+}
+
+template<int Mode, int AlphaByte, bool Solid>
+__attribute__((target("sse2"))) void blendRow32SSE2(const Uint8* src, Uint8* dst, int count, Uint8 alpha, Uint32 keepMask){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i keep = _mm_set1_epi32((int) keepMask);
+	const __m128i constAlpha = _mm_set1_epi16(alpha);
+	int i = 0;
+	for(; i + 4 <= count; i += 4){
+		__m128i s = Solid ? _mm_set1_epi32(*(const int *)src) : _mm_loadu_si128((const __m128i *)(src + i * 4));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i * 4));
+		__m128i low = blendHalfSSE2<Mode, AlphaByte>(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), constAlpha);
+		__m128i high = blendHalfSSE2<Mode, AlphaByte>(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), constAlpha);
+		__m128i result = _mm_packus_epi16(low, high);
+		result = _mm_or_si128(_mm_and_si128(d, keep), _mm_andnot_si128(keep, result));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), result);
+	}
+	//The last few pixels, with the same sums one byte at a time
+	for(; i < count; i++){
+		const Uint8* s = Solid ? src : src + i * 4;
+		Uint8* d = dst + i * 4;
+		Uint32 a = AlphaByte >= 0 ? div255(s[AlphaByte] * alpha) : alpha;
+		Uint32 old = *(Uint32 *)d;
+		Uint8 blended[4];
+		for(int c = 0; c < 4; c++){
+			if(Mode == BLEND_BLEND){
+				blended[c] = div255(s[c] * a + d[c] * (255 - a));
+			}
+			else if(Mode == BLEND_ADD){
+				Uint32 sum = d[c] + div255(s[c] * a);
+				blended[c] = sum > 255 ? 255 : sum;
+			}
+			else{
+				blended[c] = div255(s[c] * d[c]);
+			}
+		}
+		Uint32 result;
+		std::memcpy(&result, blended, 4);
+		*(Uint32 *)d = (old & keepMask) | (result & ~keepMask);
+	}
+}
+
+template<int Mode, int AlphaByte>
+void blendBlitRowSSE2(const SDL_PixelFormat* srcFormat, const SDL_PixelFormat* dstFormat, const Uint8* src, Uint8* dst, int count, Uint8 alpha){
+	blendRow32SSE2<Mode, AlphaByte, false>(src, dst, count, alpha, ~(dstFormat->Rmask | dstFormat->Gmask | dstFormat->Bmask));
+}
+
+template<int Mode>
+void blendFillRowSSE2(const SDL_PixelFormat* dstFormat, Uint8* dst, int count, const Uint8* rgba){
+	Uint32 colour = ((Uint32) rgba[0] << dstFormat->Rshift) | ((Uint32) rgba[1] << dstFormat->Gshift) | ((Uint32) rgba[2] << dstFormat->Bshift);
+	blendRow32SSE2<Mode, -1, true>((const Uint8 *)&colour, dst, count, rgba[3], ~(dstFormat->Rmask | dstFormat->Gmask | dstFormat->Bmask));
+}
+
+/**
+* Checks whether a format is 32 bit with each channel in a whole byte, as the SSE2 kernels need.
+**/
+bool byteChannels32(const SDL_PixelFormat* format){
+	Uint32 masks[4] = {format->Rmask, format->Gmask, format->Bmask, format->Amask};
+	if(format->BytesPerPixel != 4 || format->palette != NULL){
+		return false;
+	}
+	for(int i = 0; i < 4; i++){
+		if(masks[i] != 0 && masks[i] != 0xFFu << maskShift(masks[i])){
+			return false;
+		}
+		if(i < 3 && masks[i] == 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+/*The byte of a 32 bit pixel holding a channel, given its shift. Bytes are numbered in memory order*/
+inline int channelByte(int shift){
+	return SDL_BYTEORDER == SDL_BIG_ENDIAN ? 3 - shift / 8 : shift / 8;
+}
+#endif
+
+/**
+* Picks the kernel for blitting between two formats.
+* @return The kernel, or NULL for BLEND_NONE (a plain SDL blit).
+**/
+template<int Mode> BlendBlitRow pickBlitKernel(const SDL_PixelFormat* src, const SDL_PixelFormat* dst){
+#ifdef simdSpans
+	if(simdLevel >= SIMD_SSE2 && byteChannels32(src) && byteChannels32(dst) && src->Rmask == dst->Rmask && src->Gmask == dst->Gmask && src->Bmask == dst->Bmask){
+		switch(src->Amask ? channelByte(src->Ashift) : -1){
+			case 0: return blendBlitRowSSE2<Mode, 0>;
+			case 1: return blendBlitRowSSE2<Mode, 1>;
+			case 2: return blendBlitRowSSE2<Mode, 2>;
+			case 3: return blendBlitRowSSE2<Mode, 3>;
+		}
+		return blendBlitRowSSE2<Mode, -1>;
+	}
+#endif
+	if(FormatARGB8888::matches(src) && FormatARGB8888::matches(dst)) return blendBlitRow<Mode, FormatARGB8888, FormatARGB8888>;
+	if(FormatARGB8888::matches(src) && FormatXRGB8888::matches(dst)) return blendBlitRow<Mode, FormatARGB8888, FormatXRGB8888>;
+	if(FormatXRGB8888::matches(src) && FormatXRGB8888::matches(dst)) return blendBlitRow<Mode, FormatXRGB8888, FormatXRGB8888>;
+	if(FormatRGB565::matches(src) && FormatRGB565::matches(dst)) return blendBlitRow<Mode, FormatRGB565, FormatRGB565>;
+	if(FormatRGB555::matches(src) && FormatRGB555::matches(dst)) return blendBlitRow<Mode, FormatRGB555, FormatRGB555>;
+	return blendBlitRow<Mode, RuntimeFormat, RuntimeFormat>;
+}
+
+BlendBlitRow blendBlitKernel(int mode, const SDL_PixelFormat* src, const SDL_PixelFormat* dst){
+	switch(mode){
+		case BLEND_BLEND: return pickBlitKernel<BLEND_BLEND>(src, dst);
+		case BLEND_ADD: return pickBlitKernel<BLEND_ADD>(src, dst);
+		case BLEND_MOD: return pickBlitKernel<BLEND_MOD>(src, dst);
+	}
+	return NULL;
+}
+
+/**
+* Picks the kernel for blending a colour onto a format.
+* @return The kernel, or NULL for BLEND_NONE (a plain fill).
+**/
+template<int Mode> BlendFillRow pickFillKernel(const SDL_PixelFormat* dst){
+#ifdef simdSpans
+	if(simdLevel >= SIMD_SSE2 && byteChannels32(dst)){
+		return blendFillRowSSE2<Mode>;
+	}
+#endif
+	if(FormatARGB8888::matches(dst)) return blendFillRow<Mode, FormatARGB8888>;
+	if(FormatXRGB8888::matches(dst)) return blendFillRow<Mode, FormatXRGB8888>;
+	if(FormatRGB565::matches(dst)) return blendFillRow<Mode, FormatRGB565>;
+	if(FormatRGB555::matches(dst)) return blendFillRow<Mode, FormatRGB555>;
+	return blendFillRow<Mode, RuntimeFormat>;
+}
+
+BlendFillRow blendFillKernel(int mode, const SDL_PixelFormat* dst){
+	switch(mode){
+		case BLEND_BLEND: return pickFillKernel<BLEND_BLEND>(dst);
+		case BLEND_ADD: return pickFillKernel<BLEND_ADD>(dst);
+		case BLEND_MOD: return pickFillKernel<BLEND_MOD>(dst);
+	}
+	return NULL;
+}
+
+/*Writes single pixels blended by a surface's draw blend mode, in place of a PixelWriter. Set up once per call with the kernel for the surface*/
+struct BlendedPixelWriter{
+	BlendFillRow kernel;
+	const SDL_PixelFormat* format;
+	Uint8 alpha;
+
+	/*Sets the writer up for a handle, kernel is left NULL if the handle doesn't blend*/
+	BlendedPixelWriter(SurfaceHandle* handle, SDL_Surface* surface) : format(surface->format), alpha(handle->drawBlend.alpha){
+		kernel = blendFillKernel(handle->drawBlend.mode, surface->format);
+	}
+
+	void write(Uint8* pixel, Uint32 colour) const{
+		Uint8 rgba[4];
+		RuntimeFormat(format).unpack(colour, rgba);
+		rgba[3] = div255(rgba[3] * alpha);
+		kernel(format, pixel, 1, rgba);
+	}
+};
+
+/**
+* Writes packed pixel records to a surface, skipping any outside its clip rectangle. Shared by sdl_SetPixels and sdl_Submit.
+* @param records count records of <<X:16/signed-native, Y:16/signed-native, Colour:32/native>>, handle The surface's handle, marked dirty,
+*	clip The rectangle to draw inside, NULL for the surface's clip rectangle
+* @return 0 on success, -1 if the surface's bytes per pixel is invalid, -2 if it couldn't be locked.
+**/
+int setPixelRecords(SDL_Surface* surface, const unsigned char* records, size_t count, SurfaceHandle* handle, const SDL_Rect* clip = NULL){
+	int bpp = surface->format->BytesPerPixel;
+	PixelWriter write = pixelWriter(bpp);
+	if(write == NULL){
+		return (-1);
+	}
+
+	if(SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0){
+		return (-2);
+	}
+	BlendedPixelWriter blended(handle, surface);
+	Uint8* base = (Uint8 *)surface->pixels;
+	int pitch = surface->pitch;
+	//The bounding box of the pixels written, marked dirty as one rectangle
+	int x0 = surface->w, y0 = surface->h, x1 = 0, y1 = 0;
+	unsigned long long written = 0;
+	for(size_t i = 0; i < count; i++){
+		//Records are copied out rather than cast, the binary need not be aligned
+		Sint16 xy[2];
+		Uint32 colour;
+		std::memcpy(xy, records + i * 8, sizeof(xy));
+		std::memcpy(&colour, records + i * 8 + 4, sizeof(colour));
+		if(insideClip(clip ? *clip : surface->clip_rect, xy[0], xy[1])){
+			if(blended.kernel != NULL){
+				blended.write(base + xy[1] * pitch + xy[0] * bpp, colour);
+			}
+			else{
+				write(base + xy[1] * pitch + xy[0] * bpp, colour);
+			}
+			written++;
+			if(xy[0] < x0) x0 = xy[0];
+			if(xy[1] < y0) y0 = xy[1];
+			if(xy[0] >= x1) x1 = xy[0] + 1;
+			if(xy[1] >= y1) y1 = xy[1] + 1;
+		}
+	}
+	if(SDL_MUSTLOCK(surface)){
+		SDL_UnlockSurface(surface);
+	}
+	markDirty(handle, x0, y0, x1 - x0, y1 - y0);
+	pixelsWritten.fetch_add(written, std::memory_order_relaxed);
+	return 0;
+}
+
+/**
+* Locks the source and destination of a blended blit, if they need locking.
+* @return 0 on success, -1 if a surface couldn't be locked, in which case neither is left locked.
+**/
+int lockBlendSurfaces(SDL_Surface* source, SDL_Surface* destination){
+	if(SDL_MUSTLOCK(source) && SDL_LockSurface(source) < 0){
+		return (-1);
+	}
+	if(SDL_MUSTLOCK(destination) && SDL_LockSurface(destination) < 0){
+		if(SDL_MUSTLOCK(source)){
+			SDL_UnlockSurface(source);
+		}
+		return (-1);
+	}
+	return 0;
+}
+
+void unlockBlendSurfaces(SDL_Surface* source, SDL_Surface* destination){
+	if(SDL_MUSTLOCK(destination)){
+		SDL_UnlockSurface(destination);
+	}
+	if(SDL_MUSTLOCK(source)){
+		SDL_UnlockSurface(source);
+	}
+}
+
+/**
+* Blends a rectangle of one locked surface onto another. The rectangle must already be clipped to both. Pixels of a colour keyed
+* source's key are left out, as a plain blit leaves them out, so the blend mode doesn't change which pixels are drawn.
+* @param kernel From blendBlitKernel, alpha The source's constant alpha
+**/
+void blendRows(SDL_Surface* source, int sx, int sy, SDL_Surface* destination, int dx, int dy, int w, int h, BlendBlitRow kernel, Uint8 alpha){
+	int srcBpp = source->format->BytesPerPixel;
+	int dstBpp = destination->format->BytesPerPixel;
+	bool keyed = (source->flags & SDL_SRCCOLORKEY) != 0;
+	Uint32 key = source->format->colorkey;
+	RuntimeFormat in(source->format);
+	for(int row = 0; row < h; row++){
+		const Uint8* src = (const Uint8 *)source->pixels + (sy + row) * source->pitch + sx * srcBpp;
+		Uint8* dst = (Uint8 *)destination->pixels + (dy + row) * destination->pitch + dx * dstBpp;
+		if(!keyed){
+			kernel(source->format, destination->format, src, dst, w, alpha);
+			continue;
+		}
+		//Each run of pixels between keyed ones is blended in one go
+		int x = 0;
+		while(x < w){
+			while(x < w && in.load(src + x * srcBpp) == key){
+				x++;
+			}
+			int start = x;
+			while(x < w && in.load(src + x * srcBpp) != key){
+				x++;
+			}
+			if(x > start){
+				kernel(source->format, destination->format, src + start * srcBpp, dst + start * dstBpp, x - start, alpha);
+			}
+		}
+	}
+}
+
+/**
+* Clips a blit the way SDL does: to the edges of the source, then to a clip rectangle on the destination (normally its own).
+* @return false if nothing is left to draw.
+**/
+bool clipBlit(SDL_Surface* source, const SDL_Rect& clip, int& sx, int& sy, int& w, int& h, int& dx, int& dy){
+	const int clipX0 = clip.x;
+	const int clipY0 = clip.y;
+	const int clipX1 = clipX0 + clip.w;
+	const int clipY1 = clipY0 + clip.h;
+	//Clip to the source surface
+	if(sx < 0){ w += sx; dx -= sx; sx = 0; }
+	if(sy < 0){ h += sy; dy -= sy; sy = 0; }
+	if(sx + w > source->w){ w = source->w - sx; }
+	if(sy + h > source->h){ h = source->h - sy; }
+	//Clip to the destination's clip rectangle
+	if(dx < clipX0){ w -= clipX0 - dx; sx += clipX0 - dx; dx = clipX0; }
+	if(dy < clipY0){ h -= clipY0 - dy; sy += clipY0 - dy; dy = clipY0; }
+	if(dx + w > clipX1){ w = clipX1 - dx; }
+	if(dy + h > clipY1){ h = clipY1 - dy; }
+	return w > 0 && h > 0;
+}
+
+/**
+* Blits like SDL_BlitSurface, blended as blend says (normally the source handle's blend mode). Clipping is done here rather than by SDL so that
+* a tile of the destination can be drawn on its own, unblended blits go straight to SDL_LowerBlit.
+* @param srcRect The area of the source to blit, NULL for all of it, dstRect Where to blit it to. Set to the area drawn on, as SDL does,
+*	clip The rectangle of the destination to draw inside, normally its clip rectangle
+* @return 0 on success, negative on failure.
+**/
+int blendedBlit(const BlendState& blend, SDL_Surface* source, SDL_Rect* srcRect, SDL_Surface* destination, SDL_Rect* dstRect, const SDL_Rect& clip){
+	BlendBlitRow kernel = blendBlitKernel(blend.mode, source->format, destination->format);
+	int sx = srcRect ? srcRect->x : 0;
+	int sy = srcRect ? srcRect->y : 0;
+	int w = srcRect ? srcRect->w : source->w;
+	int h = srcRect ? srcRect->h : source->h;
+	int dx = dstRect->x;
+	int dy = dstRect->y;
+	dstRect->w = 0;
+	dstRect->h = 0;
+	if(!clipBlit(source, clip, sx, sy, w, h, dx, dy)){
+		return 0;
+	}
+	dstRect->x = dx;
+	dstRect->y = dy;
+	dstRect->w = w;
+	dstRect->h = h;
+	bytesBlitted.fetch_add((unsigned long long) w * h * destination->format->BytesPerPixel, std::memory_order_relaxed);
+	if(kernel == NULL){
+		SDL_Rect clipped;
+		clipped.x = sx;
+		clipped.y = sy;
+		clipped.w = w;
+		clipped.h = h;
+		return SDL_LowerBlit(source, &clipped, destination, dstRect);
+	}
+	if(lockBlendSurfaces(source, destination) < 0){
+		return (-1);
+	}
+	blendRows(source, sx, sy, destination, dx, dy, w, h, kernel, blend.alpha);
+	unlockBlendSurfaces(source, destination);
+	return 0;
+}
+
+/*Transparent white, written wherever a transformed image has nothing. Transparent so blended blits leave the destination alone, and
+white so BLEND_MOD, which ignores alpha, leaves it alone too*/
+#define transformClear 0x00FFFFFF
+
+/**
+* Converts a rectangle of a locked surface to 32 bit ARGB for sampling, with a one pixel border around it so the bilinear filter can
+* read past the edges. Colour keyed pixels become transparent.
+* @param keepAlpha Use the source's alpha, otherwise every pixel is opaque, surfaceAlpha Multiplied into every pixel's alpha,
+*	premultiply Multiply the colours by alpha, so filtering doesn't bleed the colour of transparent pixels into their neighbours,
+*	clampEdges Repeat the edge pixels in the border, so a scaled but unturned image has hard edges. Otherwise the border is transparent
+*	and the edges of a turned image are smoothed
+**/
+void transformTexture(SDL_Surface* source, const SDL_Rect& rect, bool keepAlpha, Uint8 surfaceAlpha, bool premultiply, bool clampEdges, std::vector<Uint32>& texture){
+	RuntimeFormat in(source->format);
+	bool keyed = (source->flags & SDL_SRCCOLORKEY) != 0;
+	int stride = rect.w + 2;
+	texture.assign((size_t) stride * (rect.h + 2), 0);
+	for(int y = 0; y < rect.h; y++){
+		const Uint8* pixel = (const Uint8 *)source->pixels + (size_t) (rect.y + y) * source->pitch + (size_t) rect.x * in.bpp;
+		Uint32* out = &texture[(size_t) (y + 1) * stride + 1];
+		for(int x = 0; x < rect.w; x++, pixel += in.bpp){
+			Uint32 value = in.load(pixel);
+			if(keyed && value == source->format->colorkey){
+				continue;
+			}
+			Uint8 rgba[4];
+			in.unpack(value, rgba);
+			Uint32 a = div255((keepAlpha ? rgba[3] : 255) * surfaceAlpha);
+			if(premultiply){
+				for(int c = 0; c < 3; c++){
+					rgba[c] = div255(rgba[c] * a);
+				}
+			}
+			out[x] = a << 24 | (Uint32) rgba[0] << 16 | (Uint32) rgba[1] << 8 | rgba[2];
+		}
+	}
+	if(clampEdges){
+		for(int y = 1; y <= rect.h; y++){
+			texture[(size_t) y * stride] = texture[(size_t) y * stride + 1];
+			texture[(size_t) y * stride + rect.w + 1] = texture[(size_t) y * stride + rect.w];
+		}
+		std::copy(&texture[stride], &texture[2 * stride], &texture[0]);
+		std::copy(&texture[(size_t) rect.h * stride], &texture[(size_t) (rect.h + 1) * stride], &texture[(size_t) (rect.h + 1) * stride]);
+	}
+}
+
+/**
+* Filters the four texels around a sample point of a premultiplied texture, weighted by fx and fy (0..127, how far the point is
+* towards the right hand and lower texels). Down the two columns first, then across, each step keeping 7 bits.
+**/
+inline Uint32 bilinearSample(const Uint32* top, const Uint32* bottom, int fx, int fy){
+	Uint32 result = 0;
+	for(int shift = 0; shift < 32; shift += 8){
+		Uint32 left = (((top[0] >> shift) & 0xff) * (128 - fy) + ((bottom[0] >> shift) & 0xff) * fy) >> 7;
+		Uint32 right = (((top[1] >> shift) & 0xff) * (128 - fy) + ((bottom[1] >> shift) & 0xff) * fy) >> 7;
+		result |= ((left * (128 - fx) + right * fx) >> 7) << shift;
+	}
+	return result;
+}
+
+#ifdef simdSpans
+/*SSE2 version of bilinearSample, giving the same results. The two texels of each row are loaded together, and all four channels of
+both columns are weighted at once in 16 bit lanes*/
+__attribute__((target("sse2"))) inline Uint32 bilinearSampleSSE2(const Uint32* top, const Uint32* bottom, int fx, int fy){
+	const __m128i zero = _mm_setzero_si128();
+	__m128i upper = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)top), zero);
+	__m128i lower = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)bottom), zero);
+	__m128i columns = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(upper, _mm_set1_epi16(128 - fy)), _mm_mullo_epi16(lower, _mm_set1_epi16(fy))), 7);
+	__m128i weighted = _mm_mullo_epi16(columns, _mm_set_epi16(fx, fx, fx, fx, 128 - fx, 128 - fx, 128 - fx, 128 - fx));
+	__m128i sum = _mm_srli_epi16(_mm_add_epi16(weighted, _mm_srli_si128(weighted, 8)), 7);
+	return _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+}
+#endif
+
+/**
+* Turns a premultiplied ARGB pixel back into a straight one for blitting.
+**/
+inline Uint32 unpremultiply(Uint32 pixel){
+	Uint32 a = pixel >> 24;
+	if(a == 0){
+		return transformClear;
+	}
+	if(a == 255){
+		return pixel;
+	}
+	Uint32 r = std::min(255u, (((pixel >> 16) & 0xff) * 255 + a / 2) / a);
+	Uint32 g = std::min(255u, (((pixel >> 8) & 0xff) * 255 + a / 2) / a);
+	Uint32 b = std::min(255u, ((pixel & 0xff) * 255 + a / 2) / a);
+	return a << 24 | r << 16 | g << 8 | b;
+}
+
+/**
+* Samples one row of a transformed image. u and v are the source position of the first pixel's centre in 16.16 fixed point,
+* relative to the texture's top left texel, and step by du and dv per pixel.
+* @param w, h The size of the source rectangle the texture holds
+**/
+void transformRow(const std::vector<Uint32>& texture, int w, int h, int filter, Sint64 u, Sint64 v, Sint64 du, Sint64 dv, Uint32* out, int count){
+	const int stride = w + 2;
+	const Uint32* base = texture.data();
+	if(filter == FILTER_NEAREST){
+		for(int i = 0; i < count; i++, u += du, v += dv){
+			Sint64 x = u >> 16;
+			Sint64 y = v >> 16;
+			Uint32 texel = x >= 0 && x < w && y >= 0 && y < h ? base[(y + 1) * stride + x + 1] : 0;
+			out[i] = texel >> 24 ? texel : transformClear;
+		}
+		return;
+	}
+	//Texel centres are half a texel in, so the four texels around a point start half a texel up and left of it
+	u -= 0x8000;
+	v -= 0x8000;
+#ifdef simdSpans
+	const bool sse2 = simdLevel >= SIMD_SSE2;
+#endif
+	for(int i = 0; i < count; i++, u += du, v += dv){
+		Sint64 x = u >> 16;
+		Sint64 y = v >> 16;
+		if(x < -1 || x >= w || y < -1 || y >= h){
+			out[i] = transformClear;
+			continue;
+		}
+		const Uint32* top = base + (y + 1) * stride + x + 1;
+		int fx = (int) (u >> 9) & 127;
+		int fy = (int) (v >> 9) & 127;
+#ifdef simdSpans
+		if(sse2){
+			out[i] = unpremultiply(bilinearSampleSSE2(top, top + stride, fx, fy));
+			continue;
+		}
+#endif
+		out[i] = unpremultiply(bilinearSample(top, top + stride, fx, fy));
+	}
+}
+
+/**
+* Makes the scaled and rotated image of a source rectangle: stretched to w by h, then turned angle degrees clockwise about its centre.
+* The image is the bounding box of the result, in 32 bit ARGB, transparent outside the turned rectangle.
+* @param offsetX, offsetY Set to where the image's top left corner goes, relative to the top left of the unturned w by h rectangle
+* @return The image (a pooled surface), or NULL if it couldn't be made.
+**/
+SDL_Surface* transformImage(const std::vector<Uint32>& texture, const SDL_Rect& srcRect, int w, int h, double angle, int filter, int* offsetX, int* offsetY){
+	const double radians = angle * std::acos(-1.0) / 180;
+	const double c = std::cos(radians);
+	const double s = std::sin(radians);
+	const double halfW = w / 2.0;
+	const double halfH = h / 2.0;
+	//Half the size of the turned rectangle's bounding box. The slack keeps rounding error from adding a row of nothing at 90 degrees
+	const double extentX = std::fabs(halfW * c) + std::fabs(halfH * s);
+	const double extentY = std::fabs(halfW * s) + std::fabs(halfH * c);
+	int x0 = (int) std::floor(halfW - extentX + 1e-6);
+	int y0 = (int) std::floor(halfH - extentY + 1e-6);
+	int x1 = (int) std::ceil(halfW + extentX - 1e-6);
+	int y1 = (int) std::ceil(halfH + extentY - 1e-6);
+
+	SDL_PixelFormat argb;
+	std::memset(&argb, 0, sizeof(SDL_PixelFormat));
+	argb.BitsPerPixel = 32;
+	argb.BytesPerPixel = 4;
+	argb.Amask = 0xff000000;
+	argb.Rmask = 0x00ff0000;
+	argb.Gmask = 0x0000ff00;
+	argb.Bmask = 0x000000ff;
+	SDL_Surface* image = pooledSurface(x1 - x0, y1 - y0, &argb);
+	if(image == NULL){
+		return NULL;
+	}
+	SDL_SetAlpha(image, SDL_SRCALPHA, 255);
+	*offsetX = x0;
+	*offsetY = y0;
+
+	//Each destination pixel centre is turned back the other way about the centre, then scaled into the source rectangle
+	const double scaleX = (double) srcRect.w / w * 65536;
+	const double scaleY = (double) srcRect.h / h * 65536;
+	const Sint64 du = (Sint64) std::llround(c * scaleX);
+	const Sint64 dv = (Sint64) std::llround(-s * scaleY);
+	for(int row = 0; row < image->h; row++){
+		double qx = x0 + 0.5 - halfW;
+		double qy = y0 + row + 0.5 - halfH;
+		Sint64 u = (Sint64) std::llround((qx * c + qy * s + halfW) * scaleX);
+		Sint64 v = (Sint64) std::llround((qy * c - qx * s + halfH) * scaleY);
+		transformRow(texture, srcRect.w, srcRect.h, filter, u, v, du, dv, (Uint32 *)((Uint8 *)image->pixels + (size_t) row * image->pitch), image->w);
+	}
+	return image;
+}
+
+/**
+* Drops the least recently used transformed images until the cache is within its budget. Must be called with transformCacheLock held.
+**/
+void evictTransforms(){
+	while(transformCacheBytes > transformCacheBudget && !transformCache.empty()){
+		transformCacheBytes -= transformCache.back().bytes;
+		releaseSurface(transformCache.back().image);
+		transformCache.pop_back();
+	}
+}
+
+/**
+* Marks an area of the compositor's target to be composed again, and of its cached background too if a background layer was or is there.
+* Must be called with compositorLock held.
+**/
+void composeAgain(int x, int y, int w, int h, bool background){
+	addDirtyRect(compositor.dirtyRects, compositor.dirtyCount, compositor.allDirty, compositor.width, compositor.height, x, y, w, h);
+	if(background){
+		addDirtyRect(compositor.backgroundRects, compositor.backgroundCount, compositor.allBackground, compositor.width, compositor.height, x, y, w, h);
+	}
+}
+
+void composeAgain(const SDL_Rect& area, bool background){
+	composeAgain(area.x, area.y, area.w, area.h, background);
+}
+
+/**
+* Works out the blend a layer is drawn with: its surface's blend mode, with the layer's opacity multiplied into the constant alpha.
+* A layer whose surface isn't blended is blended as BLEND_BLEND below full opacity, its colour key still left out (see blendRows).
+**/
+BlendState layerBlend(const Layer& layer){
+	BlendState blend = layer.handle->blend;
+	if(layer.opacity < 255){
+		if(blend.mode == BLEND_NONE){
+			blend.mode = BLEND_BLEND;
+			blend.alpha = layer.opacity;
+		}
+		else{
+			blend.alpha = div255(blend.alpha * layer.opacity);
+		}
+	}
+	return blend;
+}
+
+/**
+* Works out how a layer looks now. Must be called with the layer's handle locked.
+* @param background True if the layer is part of the cached background
+**/
+LayerLook layerLook(const Layer& layer, bool background){
+	LayerLook look;
+	SDL_Surface* surface = layer.handle->surface;
+	bool shown = layer.visible && layer.opacity > 0 && surface != NULL;
+	look.surface = shown ? surface : NULL;
+	look.area.x = shown ? layer.x : 0;
+	look.area.y = shown ? layer.y : 0;
+	look.area.w = shown ? surface->w : 0;
+	look.area.h = shown ? surface->h : 0;
+	look.z = layer.z;
+	look.blend = layerBlend(layer);
+	look.surfaceFlags = shown ? surface->flags & (SDL_SRCCOLORKEY | SDL_SRCALPHA) : 0;
+	look.colorKey = shown ? surface->format->colorkey : 0;
+	look.surfaceAlpha = shown ? surface->format->alpha : 0;
+	look.background = background;
+	return look;
+}
+
+bool sameLook(const LayerLook& a, const LayerLook& b){
+	return a.surface == b.surface && a.area.x == b.area.x && a.area.y == b.area.y && a.area.w == b.area.w && a.area.h == b.area.h &&
+		a.z == b.z && a.blend.mode == b.blend.mode && a.blend.alpha == b.blend.alpha && a.surfaceFlags == b.surfaceFlags &&
+		a.colorKey == b.colorKey && a.surfaceAlpha == b.surfaceAlpha && a.background == b.background;
+}
+
+/**
+* Orders layers bottom first, for a stable sort so layers with the same z stay in the order they were added.
+**/
+bool layerBelow(const Layer& a, const Layer& b){
+	return a.z < b.z;
+}
+
+/**
+* Counts the pixels in a list of dirty rectangles on a width by height surface, all of them if all is set.
+**/
+unsigned long regionPixels(const SDL_Rect* rects, int count, bool all, int width, int height){
+	if(all){
+		return (unsigned long) width * height;
+	}
+	unsigned long pixels = 0;
+	for(int i = 0; i < count; i++){
+		pixels += (unsigned long) rects[i].w * rects[i].h;
+	}
+	return pixels;
+}
+
+/**
+* Brings the compositor up to date with its target and layers, marking where each layer that changed since it was last composed
+* was and is now, and where its surface has been drawn on. The layers' surfaces then start collecting dirty areas afresh.
+* Must be called with compositorLock, the target's lock and every layer's lock held.
+* @return The number of layers at the bottom making up the cached background.
+**/
+size_t collectLayerChanges(SurfaceHandle* target){
+	SDL_Surface* surface = target->surface;
+	if(target != compositor.target || target->version != compositor.targetVersion){
+		compositor.target = target;
+		compositor.targetVersion = target->version;
+		compositor.width = surface->w;
+		compositor.height = surface->h;
+		compositor.dirtyCount = 0;
+		compositor.allDirty = true;
+	}
+	//Hidden layers draw nothing, so they don't stop the layers above them being part of the background
+	std::vector<Layer>& layers = compositor.layers;
+	size_t backgroundLayers = 0;
+	while(backgroundLayers < layers.size() && (layers[backgroundLayers].isStatic || !layers[backgroundLayers].visible)){
+		backgroundLayers++;
+	}
+	SDL_Surface* background = compositor.background;
+	if(background != NULL && (backgroundLayers == 0 || background->w != surface->w || background->h != surface->h ||
+		background->format->BitsPerPixel != surface->format->BitsPerPixel || background->format->Rmask != surface->format->Rmask ||
+		background->format->Gmask != surface->format->Gmask || background->format->Bmask != surface->format->Bmask)){
+		releaseSurface(background);
+		compositor.background = NULL;
+	}
+	if(compositor.background == NULL && backgroundLayers > 0){
+		compositor.background = pooledSurface(surface->w, surface->h, surface->format);
+		compositor.backgroundCount = 0;
+		compositor.allBackground = true;
+		//Without a background every layer is drawn straight onto the target
+		if(compositor.background == NULL){
+			backgroundLayers = 0;
+		}
+		else{
+			//Copied onto the target as it is, even in a format with alpha
+			SDL_SetAlpha(compositor.background, 0, 255);
+		}
+	}
+	for(size_t i = 0; i < layers.size(); i++){
+		Layer& layer = layers[i];
+		LayerLook look = layerLook(layer, i < backgroundLayers);
+		if(!sameLook(look, layer.drawn)){
+			composeAgain(layer.drawn.area, layer.drawn.background);
+			composeAgain(look.area, look.background);
+		}
+		else if(look.surface != NULL && layer.handle->allDirty){
+			composeAgain(look.area, look.background);
+		}
+		else if(look.surface != NULL){
+			for(int r = 0; r < layer.handle->dirtyCount; r++){
+				const SDL_Rect& area = layer.handle->dirtyRects[r];
+				composeAgain(layer.x + area.x, layer.y + area.y, area.w, area.h, look.background);
+			}
+		}
+		layer.drawn = look;
+	}
+	//Only now, a surface can be shown by more than one layer
+	for(size_t i = 0; i < layers.size(); i++){
+		layers[i].handle->dirtyCount = 0;
+		layers[i].handle->allDirty = false;
+	}
+	return backgroundLayers;
+}
+
+/**
+* Draws the layers from first up to (not including) last onto a surface, clipped to an area of it.
+**/
+void composeLayers(size_t first, size_t last, SDL_Surface* destination, const SDL_Rect& clip){
+	for(size_t i = first; i < last; i++){
+		const Layer& layer = compositor.layers[i];
+		if(layer.drawn.surface != NULL){
+			SDL_Rect at;
+			at.x = layer.x;
+			at.y = layer.y;
+			blendedBlit(layer.drawn.blend, layer.drawn.surface, NULL, destination, &at, clip);
+		}
+	}
+}
+
+/**
+* Composes the areas collectLayerChanges marked: the background's from the background layers, then the target's from the background
+* and the layers above it. What is composed on the target is marked dirty on its handle, ready to present. Must be called with the
+* same locks held.
+* @return The number of pixels of the target composed.
+**/
+unsigned long composeDirty(SurfaceHandle* target, SDL_Surface* surface, size_t backgroundLayers){
+	SDL_Rect whole;
+	whole.x = 0;
+	whole.y = 0;
+	whole.w = surface->w;
+	whole.h = surface->h;
+	SDL_Surface* background = compositor.background;
+	if(background != NULL){
+		const SDL_Rect* rects = compositor.allBackground ? &whole : compositor.backgroundRects;
+		int count = compositor.allBackground ? 1 : compositor.backgroundCount;
+		for(int i = 0; i < count; i++){
+			SDL_Rect area = rects[i];
+			SDL_FillRect(background, &area, 0);
+			composeLayers(0, backgroundLayers, background, rects[i]);
+			compositor.backgroundPixels += (unsigned long) rects[i].w * rects[i].h;
+		}
+	}
+	compositor.backgroundCount = 0;
+	compositor.allBackground = false;
+	const SDL_Rect* rects = compositor.allDirty ? &whole : compositor.dirtyRects;
+	int count = compositor.allDirty ? 1 : compositor.dirtyCount;
+	unsigned long pixels = 0;
+	for(int i = 0; i < count; i++){
+		SDL_Rect area = rects[i];
+		if(background != NULL){
+			SDL_Rect from = rects[i];
+			SDL_LowerBlit(background, &from, surface, &area);
+		}
+		else{
+			SDL_FillRect(surface, &area, 0);
+		}
+		composeLayers(backgroundLayers, compositor.layers.size(), surface, rects[i]);
+		markDirty(target, rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+		pixels += (unsigned long) rects[i].w * rects[i].h;
+	}
+	compositor.dirtyCount = 0;
+	compositor.allDirty = false;
+	return pixels;
+}
+
+/*A surface being drawn on by the shape primitives. Shapes are broken into horizontal spans, each clipped to the surface's clip
+rectangle and filled with the span filler for its format. The bounding box of everything drawn is marked dirty at the end*/
+struct SpanCanvas{
+	SurfaceHandle* handle;
+	SDL_Surface* surface;
+	SpanFiller fill;
+	BlendFillRow blendFill; //Used in place of fill when the surface's draw blend mode isn't BLEND_NONE
+	BlendFillRow coverFill; //Used for partly covered spans, see coverSpan. Blends even when the draw blend mode is BLEND_NONE
+	Uint32 colour;
+	Uint8 rgba[4]; //colour unpacked for blendFill, its alpha times the constant alpha
+	int bpp;
+	int clipX0, clipY0, clipX1, clipY1;
+	int drawnX0, drawnY0, drawnX1, drawnY1;
+	unsigned long long filled; //Pixels filled, added to pixelsWritten by endCanvas
+	long copyPixels; //Pixels readyCanvas will copy to make the surface writable, see copyCost
+
+	/*Clips a span to the clip rectangle, false if nothing is left of it*/
+	bool clipSpan(int y, int& xa, int& xb) const{
+		if(y < clipY0 || y >= clipY1){
+			return false;
+		}
+		if(xa < clipX0) xa = clipX0;
+		if(xb > clipX1) xb = clipX1;
+		return xa < xb;
+	}
+
+	/*Adds a clipped span to what has been drawn*/
+	void drew(int y, int xa, int xb){
+		filled += xb - xa;
+		if(xa < drawnX0) drawnX0 = xa;
+		if(xb > drawnX1) drawnX1 = xb;
+		if(y < drawnY0) drawnY0 = y;
+		if(y >= drawnY1) drawnY1 = y + 1;
+	}
+
+	/*Fills the pixels from xa up to but not including xb on row y*/
+	void span(int y, int xa, int xb){
+		if(!clipSpan(y, xa, xb)){
+			return;
+		}
+		if(blendFill != NULL){
+			blendFill(surface->format, (Uint8 *)surface->pixels + y * surface->pitch + xa * bpp, xb - xa, rgba);
+		}
+		else{
+			fill((Uint8 *)surface->pixels + y * surface->pitch + xa * bpp, xb - xa, colour);
+		}
+		drew(y, xa, xb);
+	}
+
+	/*Fills a span with the colour at coverage/255 of its strength, for the soft edges of anti-aliased glyphs*/
+	void coverSpan(int y, int xa, int xb, Uint8 coverage){
+		if(coverage == 255){
+			span(y, xa, xb);
+			return;
+		}
+		if(!clipSpan(y, xa, xb)){
+			return;
+		}
+		Uint8 faded[4] = {rgba[0], rgba[1], rgba[2], (Uint8) div255(rgba[3] * coverage)};
+		coverFill(surface->format, (Uint8 *)surface->pixels + y * surface->pitch + xa * bpp, xb - xa, faded);
+		drew(y, xa, xb);
+	}
+
+	void pixel(int x, int y){
+		span(y, x, x + 1);
+	}
+};
+
+/**
+* Changes the colour a canvas draws with.
+**/
+void canvasColour(SpanCanvas* canvas, Uint32 colour){
+	canvas->colour = colour;
+	RuntimeFormat(canvas->surface->format).unpack(colour, canvas->rgba);
+	canvas->rgba[3] = div255(canvas->rgba[3] * canvas->handle->drawBlend.alpha);
+}
+
+/**
+* Gets a surface ready to be drawn on by the shape primitives, locking it if it needs locking. The blend kernel for the handle's
+* draw blend mode is picked here, once for the whole shape.
+* @param clip The rectangle to draw inside, NULL for the surface's clip rectangle
+* @return 0 on success, -1 if the surface's bytes per pixel is invalid, -2 if it couldn't be locked.
+**/
+int beginCanvas(SpanCanvas* canvas, SurfaceHandle* handle, SDL_Surface* surface, Uint32 colour, const SDL_Rect* clip = NULL){
+	canvas->fill = spanFiller(surface->format->BytesPerPixel);
+	if(canvas->fill == NULL){
+		return (-1);
+	}
+	if(SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0){
+		return (-2);
+	}
+	canvas->handle = handle;
+	canvas->surface = surface;
+	canvas->blendFill = blendFillKernel(handle->drawBlend.mode, surface->format);
+	canvas->coverFill = canvas->blendFill != NULL ? canvas->blendFill : blendFillKernel(BLEND_BLEND, surface->format);
+	canvasColour(canvas, colour);
+	canvas->bpp = surface->format->BytesPerPixel;
+	if(clip == NULL){
+		clip = &surface->clip_rect;
+	}
+	canvas->clipX0 = clip->x;
+	canvas->clipY0 = clip->y;
+	canvas->clipX1 = clip->x + clip->w;
+	canvas->clipY1 = clip->y + clip->h;
+	canvas->drawnX0 = canvas->clipX1;
+	canvas->drawnY0 = canvas->clipY1;
+	canvas->drawnX1 = canvas->clipX0;
+	canvas->drawnY1 = canvas->clipY0;
+	canvas->filled = 0;
+	return 0;
+}
+
+/**
+* Finishes drawing on a surface, unlocking it and marking what was drawn dirty.
+**/
+void endCanvas(SpanCanvas* canvas){
+	if(SDL_MUSTLOCK(canvas->surface)){
+		SDL_UnlockSurface(canvas->surface);
+	}
+	markDirty(canvas->handle, canvas->drawnX0, canvas->drawnY0, canvas->drawnX1 - canvas->drawnX0, canvas->drawnY1 - canvas->drawnY0);
+	pixelsWritten.fetch_add(canvas->filled, std::memory_order_relaxed);
+}
+
+/**
+* Counts the pixels of a rectangle that fall inside the canvas's clip rectangle, to decide whether drawing it needs a dirty scheduler.
+**/
+long clippedArea(const SpanCanvas* canvas, long x0, long y0, long x1, long y1){
+	x0 = std::max(x0, (long) canvas->clipX0);
+	y0 = std::max(y0, (long) canvas->clipY0);
+	x1 = std::min(x1, (long) canvas->clipX1);
+	y1 = std::min(y1, (long) canvas->clipY1);
+	return x1 > x0 && y1 > y0 ? (x1 - x0) * (y1 - y0) : 0;
+}
+
+void canvasFillRect(SpanCanvas* canvas, int x, int y, int w, int h){
+	int y0 = std::max(y, canvas->clipY0);
+	int y1 = std::min(y + h, canvas->clipY1);
+	for(int row = y0; row < y1; row++){
+		canvas->span(row, x, x + w);
+	}
+}
+
+/**
+* Draws a one pixel wide line from (x1,y1) to (x2,y2), both ends included, with Bresenham's algorithm.
+**/
+void canvasLine(SpanCanvas* canvas, int x1, int y1, int x2, int y2){
+	int dx = std::abs(x2 - x1);
+	int dy = -std::abs(y2 - y1);
+	int stepX = x1 < x2 ? 1 : -1;
+	int stepY = y1 < y2 ? 1 : -1;
+	int error = dx + dy;
+	while(true){
+		canvas->pixel(x1, y1);
+		if(x1 == x2 && y1 == y2){
+			break;
+		}
+		int error2 = 2 * error;
+		if(error2 >= dy){
+			error += dy;
+			x1 += stepX;
+		}
+		if(error2 <= dx){
+			error += dx;
+			y1 += stepY;
+		}
+	}
+}
+
+/**
+* Integer square root, rounded down.
+**/
+long long isqrt(long long value){
+	long long root = (long long) std::sqrt((double) value);
+	while(root * root > value){
+		root--;
+	}
+	while((root + 1) * (root + 1) <= value){
+		root++;
+	}
+	return root;
+}
+
+/**
+* Fills the ellipse centred on (cx,cy) with radii rx and ry: every pixel (x,y) with (x-cx)^2/rx^2 + (y-cy)^2/ry^2 <= 1.
+* Only integer maths is used, so a circle is exactly symmetrical.
+**/
+void canvasFillEllipse(SpanCanvas* canvas, int cx, int cy, int rx, int ry){
+	if(rx == 0 || ry == 0){
+		canvasFillRect(canvas, cx - rx, cy - ry, 2 * rx + 1, 2 * ry + 1);
+		return;
+	}
+	long long rx2 = (long long) rx * rx;
+	long long ry2 = (long long) ry * ry;
+	int top = std::max(-ry, canvas->clipY0 - cy);
+	int bottom = std::min(ry, canvas->clipY1 - 1 - cy);
+	for(int dy = top; dy <= bottom; dy++){
+		int dx = (int) (isqrt(rx2 * (ry2 - (long long) dy * dy)) / ry);
+		canvas->span(cy + dy, cx - dx, cx + dx + 1);
+	}
+}
+
+/**
+* Fills a polygon with the even-odd rule. A pixel is filled if its centre is inside, so polygons sharing an edge don't overlap.
+* @param xs, ys The corners in order, the last one joins back to the first
+**/
+void canvasFillPolygon(SpanCanvas* canvas, const std::vector<int>& xs, const std::vector<int>& ys){
+	size_t corners = xs.size();
+	if(corners < 3){
+		return;
+	}
+	int top = *std::min_element(ys.begin(), ys.end());
+	int bottom = *std::max_element(ys.begin(), ys.end());
+	top = std::max(top, canvas->clipY0);
+	bottom = std::min(bottom, canvas->clipY1);
+	std::vector<double> crossings;
+	for(int y = top; y < bottom; y++){
+		double centre = y + 0.5;
+		crossings.clear();
+		for(size_t i = 0, j = corners - 1; i < corners; j = i++){
+			double ya = ys[j], yb = ys[i];
+			if((ya <= centre && centre < yb) || (yb <= centre && centre < ya)){
+				crossings.push_back(xs[j] + (centre - ya) * (xs[i] - xs[j]) / (yb - ya));
+			}
+		}
+		std::sort(crossings.begin(), crossings.end());
+		for(size_t i = 0; i + 1 < crossings.size(); i += 2){
+			//Pixels whose centres lie between the two crossings
+			canvas->span(y, (int) std::ceil(crossings[i] - 0.5), (int) std::ceil(crossings[i + 1] - 0.5));
+		}
+	}
+}
+
+/**
+* Reads a co-ordinate or size passed from Erlang. SDL co-ordinates are 16 bit, so anything outside that range is refused.
+* @return true if term is an integer in range.
+**/
+bool coordLookup(ErlNifEnv* env, ERL_NIF_TERM term, int* value){
+	return enif_get_int(env, term, value) && *value >= -32768 && *value <= 32767;
+}
+
+/**
+* Reads a point passed from Erlang as {X, Y}.
+* @return true if term is a tuple of two co-ordinates.
+**/
+bool pointLookup(ErlNifEnv* env, ERL_NIF_TERM term, int* x, int* y){
+	int arity;
+	const ERL_NIF_TERM* fields;
+	return enif_get_tuple(env, term, &arity, &fields) && arity == 2 && coordLookup(env, fields[0], x) && coordLookup(env, fields[1], y);
+}
+
+/**
+* Looks up the surface and colour a shape primitive was given. Nothing is drawn or copied yet: the canvas's clip rectangle and copyPixels
+* are set so the NIF can decide whether to move to a dirty scheduler, then readyCanvas gets the surface ready to draw on.
+* @param nifName The calling NIF, for the error strings, locks The surface's handle is locked in it for as long as the canvas is used
+* @return true on success, otherwise false with error set to what the NIF should return.
+**/
+bool openCanvas(ErlNifEnv* env, ERL_NIF_TERM surfaceTerm, ERL_NIF_TERM colourTerm, const char* nifName, SpanCanvas* canvas, SurfaceLocks* locks, ERL_NIF_TERM* error){
+	Uint32 colour;
+	int mFound = colourLookup(env, colourTerm, &colour);
+	if(mFound<0){
+		*error = enif_make_badarg(env);
+		return false;
+	}
+	if(mFound==0){
+		*error = enif_make_string(env, ("Map not found in " + std::string(nifName)).c_str(), ERL_NIF_LATIN1);
+		return false;
+	}
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, surfaceTerm, &handle, locks);
+	if(found<0){
+		*error = enif_make_badarg(env);
+		return false;
+	}
+	if(found==0 || handle->surface==NULL){
+		*error = enif_make_string(env, ("Surface not found in " + std::string(nifName)).c_str(), ERL_NIF_LATIN1);
+		return false;
+	}
+	const SDL_Rect& clip = handle->surface->clip_rect;
+	canvas->handle = handle;
+	canvas->surface = handle->surface;
+	canvas->colour = colour;
+	canvas->clipX0 = clip.x;
+	canvas->clipY0 = clip.y;
+	canvas->clipX1 = clip.x + clip.w;
+	canvas->clipY1 = clip.y + clip.h;
+	canvas->copyPixels = copyCost(handle);
+	return true;
+}
+
+/**
+* Gets the surface of a canvas from openCanvas ready to draw on, making it writable, see beginCanvas. Called once the NIF knows it
+* isn't moving to a dirty scheduler, see copyCost.
+* @return true on success, otherwise false with error set to what the NIF should return.
+**/
+bool readyCanvas(ErlNifEnv* env, SpanCanvas* canvas, const char* nifName, ERL_NIF_TERM* error){
+	SDL_Surface* surface = writableSurface(canvas->handle);
+	if(surface==NULL){
+		*error = enif_make_string(env, ("Surface not found in " + std::string(nifName)).c_str(), ERL_NIF_LATIN1);
+		return false;
+	}
+	int result = beginCanvas(canvas, canvas->handle, surface, canvas->colour);
+	if(result == -1){
+		*error = enif_make_string(env, ("Bytes per pixel found to be of an invalid range in " + std::string(nifName)).c_str(), ERL_NIF_LATIN1);
+		return false;
+	}
+	if(result == -2){
+		*error = enif_make_string(env, ("Surface couldn't be locked in " + std::string(nifName)).c_str(), ERL_NIF_LATIN1);
+		return false;
+	}
+	return true;
+}
+
+/**
+* Cuts a glyph out of a locked font atlas as spans of equally covered pixels, added to the end of spans. Colour keyed pixels aren't
+* covered, the rest are covered as much as their alpha if the atlas has an alpha channel, fully if it is colour keyed, and otherwise
+* as much as their brightest channel, so white on black atlases work as they are.
+**/
+void glyphSpans(SDL_Surface* atlas, const SDL_Rect& rect, std::vector<GlyphSpan>& spans){
+	RuntimeFormat in(atlas->format);
+	bool keyed = (atlas->flags & SDL_SRCCOLORKEY) != 0;
+	bool hasAlpha = atlas->format->Amask != 0;
+	for(int y = 0; y < rect.h; y++){
+		const Uint8* row = (const Uint8 *)atlas->pixels + (size_t) (rect.y + y) * atlas->pitch + (size_t) rect.x * in.bpp;
+		int start = 0;
+		Uint8 covered = 0;
+		//One past the end is uncovered, to finish the last span
+		for(int x = 0; x <= rect.w; x++){
+			Uint8 coverage = 0;
+			if(x < rect.w){
+				Uint32 value = in.load(row + x * in.bpp);
+				if(!keyed || value != atlas->format->colorkey){
+					Uint8 rgba[4];
+					in.unpack(value, rgba);
+					coverage = hasAlpha ? rgba[3] : keyed ? 255 : std::max(rgba[0], std::max(rgba[1], rgba[2]));
+				}
+			}
+			if(coverage == covered){
+				continue;
+			}
+			if(covered != 0){
+				GlyphSpan span;
+				span.y = y;
+				span.x0 = start;
+				span.x1 = x;
+				span.coverage = covered;
+				spans.push_back(span);
+			}
+			start = x;
+			covered = coverage;
+		}
+	}
+}
+
+/**
+* Reads the next character of UTF-8 text, moving p past it. A malformed sequence reads as U+FFFD and only its first byte is skipped.
+**/
+Uint32 nextCodepoint(const unsigned char*& p, const unsigned char* end){
+	Uint32 codepoint = *p++;
+	if(codepoint < 0x80){
+		return codepoint;
+	}
+	int extra;
+	Uint32 least;
+	if((codepoint & 0xE0) == 0xC0){
+		extra = 1;
+		least = 0x80;
+		codepoint &= 0x1F;
+	}
+	else if((codepoint & 0xF0) == 0xE0){
+		extra = 2;
+		least = 0x800;
+		codepoint &= 0x0F;
+	}
+	else if((codepoint & 0xF8) == 0xF0){
+		extra = 3;
+		least = 0x10000;
+		codepoint &= 0x07;
+	}
+	else{
+		return 0xFFFD;
+	}
+	if(end - p < extra){
+		return 0xFFFD;
+	}
+	for(int i = 0; i < extra; i++){
+		if((p[i] & 0xC0) != 0x80){
+			return 0xFFFD;
+		}
+		codepoint = codepoint << 6 | (p[i] & 0x3F);
+	}
+	//Overlong encodings and surrogates aren't characters
+	if(codepoint < least || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)){
+		return 0xFFFD;
+	}
+	p += extra;
+	return codepoint;
+}
+
+/**
+* Finds the glyph for a character, or the font's fallback glyph if it doesn't have one.
+* @return The glyph's index, or -1 if there is nothing to draw.
+**/
+int glyphIndex(const BitmapFont* font, Uint32 codepoint){
+	if(codepoint < 128){
+		int index = font->ascii[codepoint];
+		return index >= 0 ? index : font->fallback;
+	}
+	std::unordered_map<Uint32, int>::const_iterator it = font->others.find(codepoint);
+	return it != font->others.end() ? it->second : font->fallback;
+}
+
+/**
+* Lays out UTF-8 text with its top left corner at x, y and draws it on a canvas, if given. A newline starts a new line lineHeight
+* further down, back at x.
+* @param canvas The canvas to draw on, NULL to only measure the text, w, h Set to the size of the text: its widest line, and its lines
+**/
+void layoutText(const BitmapFont* font, SpanCanvas* canvas, int x, int y, const unsigned char* text, size_t length, int* w, int* h){
+	const unsigned char* end = text + length;
+	int penX = 0;
+	int lineY = 0;
+	int widest = 0;
+	while(text < end){
+		Uint32 codepoint = nextCodepoint(text, end);
+		if(codepoint == '\n'){
+			widest = std::max(widest, penX);
+			penX = 0;
+			lineY += font->lineHeight;
+			continue;
+		}
+		int index = glyphIndex(font, codepoint);
+		if(index < 0){
+			continue;
+		}
+		const Glyph& glyph = font->glyphs[index];
+		if(canvas != NULL){
+			int glyphX = x + penX + glyph.xOffset;
+			int glyphY = y + lineY + glyph.yOffset;
+			for(size_t i = glyph.firstSpan; i < glyph.firstSpan + glyph.spanCount; i++){
+				const GlyphSpan& span = font->spans[i];
+				canvas->coverSpan(glyphY + span.y, glyphX + span.x0, glyphX + span.x1, span.coverage);
+			}
+		}
+		penX += glyph.advance;
+	}
+	*w = std::max(widest, penX);
+	*h = length > 0 ? lineY + font->lineHeight : 0;
+}
+
+/*Size of one sprite record in an sdl_BlitBatch binary:
+<<SX:16/signed, SY:16/signed, SW:16, SH:16, DX:16/signed, DY:16/signed>>, all native byte order*/
+#define spriteRecordSize 12
+
+/**
+* Blits many rectangles of one source surface onto one destination. Each record is clipped against the source's edges and the
+* clip rectangle here, then handed straight to SDL_LowerBlit
+* so SDL doesn't check and clip each one again. Records that end up empty are skipped.
+* When the source blends, the kernel is picked and both surfaces locked once for the whole batch.
+* @param clip The rectangle of the destination to draw inside, normally its clip rectangle, records count sprite records, see spriteRecordSize,
+*	blend The source's blend mode, handle The destination's handle, each sprite drawn is marked dirty
+* @return 0 on success, -1 if SDL failed a blit or a surface couldn't be locked.
+**/
+int blitSprites(SDL_Surface* source, SDL_Surface* destination, const SDL_Rect& clip, const unsigned char* records, size_t count, BlendState blend, SurfaceHandle* handle){
+	BlendBlitRow kernel = blendBlitKernel(blend.mode, source->format, destination->format);
+	if(kernel != NULL && lockBlendSurfaces(source, destination) < 0){
+		return -1;
+	}
+	unsigned long long pixels = 0;
+	for(size_t i = 0; i < count; i++){
+		Sint16 fields[6];
+		std::memcpy(fields, records + i * spriteRecordSize, spriteRecordSize);
+		int sx = fields[0], sy = fields[1];
+		int w = (Uint16) fields[2], h = (Uint16) fields[3];
+		int dx = fields[4], dy = fields[5];
+		if(!clipBlit(source, clip, sx, sy, w, h, dx, dy)){
+			continue;
+		}
+		markDirty(handle, dx, dy, w, h);
+		pixels += (unsigned long long) w * h;
+		if(kernel != NULL){
+			blendRows(source, sx, sy, destination, dx, dy, w, h, kernel, blend.alpha);
+			continue;
+		}
+		SDL_Rect srcRect, dstRect;
+		srcRect.x = sx;
+		srcRect.y = sy;
+		srcRect.w = dstRect.w = w;
+		srcRect.h = dstRect.h = h;
+		dstRect.x = dx;
+		dstRect.y = dy;
+		if(SDL_LowerBlit(source, &srcRect, destination, &dstRect) < 0){
+			return -1;
+		}
+	}
+	if(kernel != NULL){
+		unlockBlendSurfaces(source, destination);
+	}
+	bytesBlitted.fetch_add(pixels * destination->format->BytesPerPixel, std::memory_order_relaxed);
+	return 0;
+}
+
+/*Index of an empty tile in an sdl_DrawTilemap binary, nothing is drawn there*/
+#define emptyTile 0xFFFF
+
+/*A tilemap being drawn by sdl_DrawTilemap. Tile (column, row) of the map is drawn with its top left corner at
+(column * tileW - viewX, row * tileH - viewY) on the target*/
+struct Tilemap{
+	SDL_Surface* tileset;
+	int tileW, tileH;
+	int setColumns; //Tiles across the tileset
+	int setTiles; //Tiles in the tileset, indices from here on are drawn as empty
+	const unsigned char* tiles; //16 bit native indices, row by row
+	int columns, rows;
+	int viewX, viewY;
+
+	//Indices are copied out rather than cast, the binary need not be aligned
+	Uint16 at(int column, int row) const{
+		Uint16 index;
+		std::memcpy(&index, tiles + ((size_t) row * columns + column) * sizeof(Uint16), sizeof(Uint16));
+		return index;
+	}
+};
+
+inline int floorDiv(int a, int b){
+	return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+/**
+* Works out which tiles of a map cover a rectangle of the target, as inclusive column and row ranges.
+* @return False if none do.
+**/
+bool tilesCovering(const Tilemap& map, const SDL_Rect& area, int* c0, int* c1, int* r0, int* r1){
+	*c0 = std::max(0, floorDiv(area.x + map.viewX, map.tileW));
+	*c1 = std::min(map.columns - 1, floorDiv(area.x + area.w - 1 + map.viewX, map.tileW));
+	*r0 = std::max(0, floorDiv(area.y + map.viewY, map.tileH));
+	*r1 = std::min(map.rows - 1, floorDiv(area.y + area.h - 1 + map.viewY, map.tileH));
+	return area.w > 0 && area.h > 0 && *c0 <= *c1 && *r0 <= *r1;
+}
+
+/**
+* Checks if a tileset's pixels can be copied byte for byte onto a surface: the same format, nothing to blend and no colour key.
+**/
+bool tilesCopyable(SDL_Surface* tileset, SDL_Surface* surface, BlendState blend){
+	const SDL_PixelFormat* src = tileset->format;
+	const SDL_PixelFormat* dst = surface->format;
+	return blend.mode == BLEND_NONE && tileset != surface && !(tileset->flags & (SDL_SRCCOLORKEY | SDL_SRCALPHA)) &&
+		src->BytesPerPixel == dst->BytesPerPixel && src->Rmask == dst->Rmask && src->Gmask == dst->Gmask && src->Bmask == dst->Bmask &&
+		src->Amask == dst->Amask && (src->BytesPerPixel > 1 || src->palette == dst->palette);
+}
+
+/**
+* Draws the tiles covering area by copying them one row of pixels at a time, straight across every tile in the row of tiles, so the
+* target is written top to bottom. Both surfaces must be locked and tilesCopyable.
+* @return The number of pixels copied.
+**/
+unsigned long long copyTiles(const Tilemap& map, SDL_Surface* surface, const SDL_Rect& area){
+	int c0, c1, r0, r1;
+	if(!tilesCovering(map, area, &c0, &c1, &r0, &r1)){
+		return 0;
+	}
+	int bpp = surface->format->BytesPerPixel;
+	//A visible tile in the row of tiles being drawn: where it goes on the target, clipped, and where it comes from in the tileset
+	struct TileSpan{
+		int dx, w;
+		int sx, sy;
+	};
+	std::vector<TileSpan> spans;
+	unsigned long long pixels = 0;
+	for(int r = r0; r <= r1; r++){
+		spans.clear();
+		for(int c = c0; c <= c1; c++){
+			int index = map.at(c, r);
+			if(index >= map.setTiles){
+				continue;
+			}
+			int dx = c * map.tileW - map.viewX;
+			int x0 = std::max(dx, (int) area.x);
+			int x1 = std::min(dx + map.tileW, area.x + area.w);
+			TileSpan span = {x0, x1 - x0, (index % map.setColumns) * map.tileW + x0 - dx, (index / map.setColumns) * map.tileH};
+			spans.push_back(span);
+		}
+		int top = r * map.tileH - map.viewY;
+		int y0 = std::max(top, (int) area.y);
+		int y1 = std::min(top + map.tileH, area.y + area.h);
+		for(int y = y0; y < y1; y++){
+			Uint8* row = (Uint8 *)surface->pixels + (size_t) y * surface->pitch;
+			for(size_t i = 0; i < spans.size(); i++){
+				const Uint8* src = (const Uint8 *)map.tileset->pixels + (size_t) (spans[i].sy + y - top) * map.tileset->pitch + (size_t) spans[i].sx * bpp;
+				std::memcpy(row + (size_t) spans[i].dx * bpp, src, (size_t) spans[i].w * bpp);
+			}
+		}
+		for(size_t i = 0; i < spans.size(); i++){
+			pixels += (unsigned long long) spans[i].w * (y1 - y0);
+		}
+	}
+	return pixels;
+}
+
+/**
+* Draws the tiles of a map covering a rectangle of the target, and nothing outside it. Tiles are copied a row at a time where they can
+* be, and otherwise handed to blitSprites, which blends them and handles colour keys and format conversion.
+* @param area The rectangle to draw inside, within the target's clip rectangle, blend The tileset's blend mode, handle The target's handle,
+*	marked dirty
+* @return 0 on success, -1 if a blit failed or a surface couldn't be locked.
+**/
+int drawTilemapArea(const Tilemap& map, SDL_Surface* surface, const SDL_Rect& area, BlendState blend, SurfaceHandle* handle){
+	if(tilesCopyable(map.tileset, surface, blend)){
+		if(lockBlendSurfaces(map.tileset, surface) < 0){
+			return (-1);
+		}
+		unsigned long long pixels = copyTiles(map, surface, area);
+		unlockBlendSurfaces(map.tileset, surface);
+		markDirty(handle, area.x, area.y, area.w, area.h);
+		bytesBlitted.fetch_add(pixels * surface->format->BytesPerPixel, std::memory_order_relaxed);
+		return 0;
+	}
+	int c0, c1, r0, r1;
+	if(!tilesCovering(map, area, &c0, &c1, &r0, &r1)){
+		return 0;
+	}
+	std::vector<unsigned char> records;
+	records.reserve((size_t) (c1 - c0 + 1) * (r1 - r0 + 1) * spriteRecordSize);
+	for(int r = r0; r <= r1; r++){
+		for(int c = c0; c <= c1; c++){
+			int index = map.at(c, r);
+			if(index >= map.setTiles){
+				continue;
+			}
+			Sint16 fields[6] = {(Sint16) ((index % map.setColumns) * map.tileW), (Sint16) ((index / map.setColumns) * map.tileH),
+				(Sint16) map.tileW, (Sint16) map.tileH, (Sint16) (c * map.tileW - map.viewX), (Sint16) (r * map.tileH - map.viewY)};
+			records.insert(records.end(), (unsigned char*) fields, (unsigned char*) fields + spriteRecordSize);
+		}
+	}
+	return blitSprites(map.tileset, surface, area, records.data(), records.size() / spriteRecordSize, blend, handle);
+}
+
+/*Opcodes for the commands sdl_Submit understands. sdlCommandList.erl builds the encoding*/
+enum SubmitCommand{
+	SUBMIT_BLIT = 1,
+	SUBMIT_FILL = 2,
+	SUBMIT_SET_PIXELS = 3,
+	SUBMIT_UPDATE_RECT = 4,
+	SUBMIT_FLIP = 5,
+	SUBMIT_BLIT_BATCH = 6,
+	SUBMIT_PRESENT = 7
+};
+
+/*Reads fields out of an sdl_Submit command list in native byte order, checking every read against the end of the list*/
+struct CommandReader{
+	const unsigned char* pos;
+	const unsigned char* end;
+
+	template<typename T> bool get(T* value){
+		if((size_t) (end - pos) < sizeof(T)){
+			return false;
+		}
+		std::memcpy(value, pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
+	}
+
+	bool getRect(SDL_Rect* rect){
+		return get(&rect->x) && get(&rect->y) && get(&rect->w) && get(&rect->h);
+	}
+
+	/*Reads a surface slot and resolves it against the surfaces passed to sdl_Submit, ready to be drawn on if write is set.
+	Sets error to the reason on failure, and handle (if given) to the slot's handle*/
+	SDL_Surface* getSurface(const std::vector<SurfaceHandle*>& surfaces, bool write, const char** error, SurfaceHandle** handle = NULL){
+		Uint16 slot;
+		if(!get(&slot)){
+			*error = "truncated";
+			return NULL;
+		}
+		if(slot >= surfaces.size()){
+			*error = "bad_slot";
+			return NULL;
+		}
+		SDL_Surface* surface = NULL;
+		if(surfaces[slot] != NULL){
+			surface = write ? writableSurface(surfaces[slot]) : surfaces[slot]->surface;
+		}
+		if(handle != NULL){
+			*handle = surfaces[slot];
+		}
+		if(surface == NULL){
+			*error = "no_surface";
+		}
+		return surface;
+	}
+};
+
+/**
+* Draws tiles of the current render job until there are none left, starting with the thread's own run and then stealing.
+* @param self The thread's run, 0 for the calling thread
+**/
+void drawTiles(int self){
+	int participants = renderParticipants;
+	for(int k = 0; k < participants; k++){
+		TileQueue& queue = renderQueues[(self + k) % participants];
+		for(int tile = queue.next++; tile < queue.end; tile = queue.next++){
+			renderDrawTile(renderContext, tile);
+		}
+	}
+}
+
+/**
+* Body of a render thread. Waits for a job, draws tiles until none are left, and reports back, until the pool is stopped.
+* @param self The thread's run of tiles, seen The job count when the thread was started, any later job is new
+**/
+void renderLoop(int self, unsigned long seen){
+	std::unique_lock<std::mutex> lock(renderLock);
+	while(!renderStopping){
+		if(renderGeneration == seen){
+			renderWake.wait(lock);
+			continue;
+		}
+		seen = renderGeneration;
+		lock.unlock();
+		drawTiles(self);
+		lock.lock();
+		if(--renderBusy == 0){
+			renderDone.notify_one();
+		}
+	}
+}
+
+/**
+* Draws a job on the render thread pool and waits for every tile to be done. The calling thread draws tiles too. The job is split into
+* renderTilesPerThread tiles per participant, counted once the pool is held so sdl_SetRenderThreads can't change it part way through.
+* @param drawTile Draws one tile, from any thread, prepare Called with the number of tiles before any are drawn, context Passed to both
+* @return true if the job was drawn, false if there is no pool or another job has it, in which case nothing was drawn.
+**/
+bool runTiled(void (*drawTile)(void* context, int tile), void (*prepare)(void* context, int tiles), void* context){
+	std::unique_lock<std::mutex> job(renderJobLock, std::try_to_lock);
+	if(!job.owns_lock()){
+		return false;
+	}
+	int participants = renderParticipants;
+	if(participants < 2){
+		return false;
+	}
+	int tiles = participants * renderTilesPerThread;
+	prepare(context, tiles);
+	for(int i = 0; i < participants; i++){
+		renderQueues[i].next = (int) ((long) tiles * i / participants);
+		renderQueues[i].end = (int) ((long) tiles * (i + 1) / participants);
+	}
+	{
+		std::lock_guard<std::mutex> lock(renderLock);
+		renderDrawTile = drawTile;
+		renderContext = context;
+		renderBusy = participants - 1;
+		renderGeneration++;
+	}
+	renderWake.notify_all();
+	drawTiles(0);
+	std::unique_lock<std::mutex> lock(renderLock);
+	while(renderBusy > 0){
+		renderDone.wait(lock);
+	}
+	return true;
+}
+
+/**
+* Stops the render threads, if there are any, leaving one participant. Must be called with renderJobLock held.
+**/
+void stopRenderThreads(){
+	{
+		std::lock_guard<std::mutex> lock(renderLock);
+		renderStopping = true;
+	}
+	renderWake.notify_all();
+	for(size_t i = 0; i < renderThreads.size(); i++){
+		renderThreads[i].join();
+	}
+	renderThreads.clear();
+	delete[] renderQueues;
+	renderQueues = NULL;
+	renderParticipants = 1;
+	renderStopping = false;
+}
+
+/*An sdl_Submit command read out of the command list, with its surfaces looked up, ready to be drawn*/
+struct SubmitOp{
+	Uint8 op;
+	int position; //Where it is in the command list, counting from 1, for error tuples
+	SurfaceHandle* sourceHandle; //The surface blitted from, for SUBMIT_BLIT and SUBMIT_BLIT_BATCH
+	SDL_Surface* source;
+	SurfaceHandle* handle; //The surface drawn on, updated, flipped or presented
+	SDL_Surface* destination;
+	SDL_Rect rect; //The fill or update rectangle, or the source rectangle of a blit
+	Sint16 x, y; //Where a blit goes
+	Uint32 colour;
+	const unsigned char* records; //Pixel or sprite records, left in the command list
+	Uint32 count;
+};
+
+/**
+* Reads one command from an sdl_Submit command list and looks up its surfaces. Surfaces that will be drawn on are made writable here,
+* in command list order, so copy on write sees the same sharing it would if every command were drawn as soon as it was read. A source
+* waiting in a RenderBatch counts as shared, so drawing on it copies it and the batched blit still reads what it was given.
+* @param op The opcode already read, reader Positioned just after the opcode, surfaces The surfaces slots refer to
+* @return NULL on success, otherwise the reason the command is bad (used as an atom).
+**/
+const char* readCommand(Uint8 op, CommandReader& reader, const std::vector<SurfaceHandle*>& surfaces, SubmitOp* command){
+	const char* error = NULL;
+	command->op = op;
+	switch(op){
+		case SUBMIT_BLIT:
+			command->source = reader.getSurface(surfaces, false, &error, &command->sourceHandle);
+			if(error || !reader.getRect(&command->rect)){
+				return error ? error : "truncated";
+			}
+			command->destination = reader.getSurface(surfaces, true, &error, &command->handle);
+			if(error || !reader.get(&command->x) || !reader.get(&command->y)){
+				return error ? error : "truncated";
+			}
+			return NULL;
+		case SUBMIT_FILL:
+			command->destination = reader.getSurface(surfaces, true, &error, &command->handle);
+			if(error || !reader.getRect(&command->rect) || !reader.get(&command->colour)){
+				return error ? error : "truncated";
+			}
+			return NULL;
+		case SUBMIT_SET_PIXELS:
+			command->destination = reader.getSurface(surfaces, true, &error, &command->handle);
+			if(error || !reader.get(&command->count)){
+				return error ? error : "truncated";
+			}
+			if((size_t) (reader.end - reader.pos) / 8 < command->count){
+				return "truncated";
+			}
+			command->records = reader.pos;
+			reader.pos += (size_t) command->count * 8;
+			return NULL;
+		case SUBMIT_UPDATE_RECT:
+			command->destination = reader.getSurface(surfaces, false, &error, &command->handle);
+			if(error || !reader.getRect(&command->rect)){
+				return error ? error : "truncated";
+			}
+			return NULL;
+		case SUBMIT_FLIP:
+		case SUBMIT_PRESENT:
+			command->destination = reader.getSurface(surfaces, false, &error, &command->handle);
+			return error;
+		case SUBMIT_BLIT_BATCH:
+			command->source = reader.getSurface(surfaces, false, &error, &command->sourceHandle);
+			if(error){
+				return error;
+			}
+			command->destination = reader.getSurface(surfaces, true, &error, &command->handle);
+			if(error || !reader.get(&command->count)){
+				return error ? error : "truncated";
+			}
+			if((size_t) (reader.end - reader.pos) / spriteRecordSize < command->count){
+				return "truncated";
+			}
+			command->records = reader.pos;
+			reader.pos += (size_t) command->count * spriteRecordSize;
+			return NULL;
+	}
+	return "bad_opcode";
+}
+
+/**
+* Checks whether a command only draws on its destination, so it can be split into tiles. Updates, flips and presents can't be.
+**/
+inline bool drawingCommand(Uint8 op){
+	return op == SUBMIT_BLIT || op == SUBMIT_FILL || op == SUBMIT_SET_PIXELS || op == SUBMIT_BLIT_BATCH;
+}
+
+/**
+* Draws a drawing command, or the part of it inside a clip rectangle.
+* @param clip The rectangle of the destination to draw inside, handle The handle to mark dirty (the command's own, or a tile's stand in)
+* @return NULL on success, otherwise the reason the command failed (used as an atom).
+**/
+const char* drawCommand(const SubmitOp& command, const SDL_Rect& clip, SurfaceHandle* handle){
+	switch(command.op){
+		case SUBMIT_BLIT: {
+			SDL_Rect srcRect = command.rect;
+			SDL_Rect dstRect;
+			dstRect.x = command.x;
+			dstRect.y = command.y;
+			//An empty source rectangle means the whole source surface
+			SDL_Rect* srcArg = (srcRect.w == 0 && srcRect.h == 0) ? NULL : &srcRect;
+			if(blendedBlit(command.sourceHandle->blend, command.source, srcArg, command.destination, &dstRect, clip) < 0){
+				return "blit_failed";
+			}
+			//The area actually drawn is left in dstRect
+			markDirty(handle, dstRect.x, dstRect.y, dstRect.w, dstRect.h);
+			return NULL;
+		}
+		case SUBMIT_FILL: {
+			SpanCanvas canvas;
+			int result = beginCanvas(&canvas, handle, command.destination, command.colour, &clip);
+			if(result == -1){
+				return "bad_format";
+			}
+			if(result == -2){
+				return "lock_failed";
+			}
+			//An empty rectangle means the whole surface
+			if(command.rect.w == 0 && command.rect.h == 0){
+				canvasFillRect(&canvas, 0, 0, command.destination->w, command.destination->h);
+			}
+			else{
+				canvasFillRect(&canvas, command.rect.x, command.rect.y, command.rect.w, command.rect.h);
+			}
+			endCanvas(&canvas);
+			return NULL;
+		}
+		case SUBMIT_SET_PIXELS: {
+			int result = setPixelRecords(command.destination, command.records, command.count, handle, &clip);
+			if(result == -1){
+				return "bad_format";
+			}
+			if(result == -2){
+				return "lock_failed";
+			}
+			return NULL;
+		}
+		case SUBMIT_BLIT_BATCH:
+			if(blitSprites(command.source, command.destination, clip, command.records, command.count, command.sourceHandle->blend, handle) < 0){
+				return "blit_failed";
+			}
+			return NULL;
+	}
+	return "bad_opcode";
+}
+
+/**
+* Runs one command in full on the calling thread.
+* @return NULL on success, otherwise the reason the command failed (used as an atom).
+**/
+const char* runCommand(const SubmitOp& command){
+	SurfaceHandle* handle = command.handle;
+	SDL_Surface* destination = command.destination;
+	switch(command.op){
+		case SUBMIT_UPDATE_RECT:
+			SDL_UpdateRect(destination, command.rect.x, command.rect.y, command.rect.w, command.rect.h);
+			return NULL;
+		case SUBMIT_FLIP:
+			if(handle->isScreen){
+				captureFrame(destination);
+			}
+			if(SDL_Flip(destination) < 0){
+				return "flip_failed";
+			}
+			if(handle->isScreen){
+				presented(handle, (unsigned long) destination->w * destination->h);
+			}
+			return NULL;
+		case SUBMIT_PRESENT:
+			if(!handle->isScreen){
+				return "not_screen";
+			}
+			if(presentDirty(handle) < 0){
+				return "flip_failed";
+			}
+			return NULL;
+	}
+	return drawCommand(command, destination->clip_rect, handle);
+}
+
+/**
+* Roughly how many pixels a drawing command touches, before clipping. Decides whether a batch is worth splitting into tiles.
+**/
+long commandPixels(const SubmitOp& command){
+	switch(command.op){
+		case SUBMIT_BLIT:
+			if(command.rect.w == 0 && command.rect.h == 0){
+				return (long) command.source->w * command.source->h;
+			}
+			return (long) command.rect.w * command.rect.h;
+		case SUBMIT_FILL:
+			if(command.rect.w == 0 && command.rect.h == 0){
+				return (long) command.destination->w * command.destination->h;
+			}
+			return (long) command.rect.w * command.rect.h;
+		case SUBMIT_SET_PIXELS:
+			return command.count;
+		case SUBMIT_BLIT_BATCH: {
+			long area = 0;
+			for(Uint32 i = 0; i < command.count; i++){
+				Uint16 size[2];
+				std::memcpy(size, command.records + i * spriteRecordSize + 4, sizeof(size));
+				area += (long) size[0] * size[1];
+			}
+			return area;
+		}
+	}
+	return 0;
+}
+
+/*Drawing commands collected to be drawn together, tile by tile, by the render thread pool. Tiles are drawn in any order and at the
+same time, so a command only joins if that can't change the result: no surface is both read and drawn on in one batch, and each
+source is only blitted onto one destination (SDL keeps the blit mapping for one destination per source, and remaps it on the fly)*/
+struct RenderBatch{
+	std::vector<SubmitOp> commands;
+	std::vector<SurfaceHandle*> handles; //The surfaces drawn on, each once
+	std::vector<int> handleIndex; //For each command, its destination's place in handles
+	//Sources read, and the destination each is blitted onto. The batch holds a reference on each source until it is drawn: a later command
+	//drawing on the source's handle replaces the handle's surface (see writableSurface), leaving the old one to the asset cache or to
+	//handles that aren't locked, which could free it before the batch is drawn
+	std::vector<std::pair<SDL_Surface*, SDL_Surface*> > blits;
+	long pixels;
+	bool mustLock; //A surface needs locking, SDL's lock count isn't safe to share between threads so the batch is drawn alone
+
+	RenderBatch() : pixels(0), mustLock(false){}
+
+	~RenderBatch(){
+		clear();
+	}
+
+	bool fits(const SubmitOp& command) const{
+		for(size_t i = 0; i < blits.size(); i++){
+			if(blits[i].first == command.destination){
+				return false;
+			}
+			if(command.source != NULL && blits[i].first == command.source && blits[i].second != command.destination){
+				return false;
+			}
+		}
+		for(size_t i = 0; command.source != NULL && i < handles.size(); i++){
+			if(handles[i]->surface == command.source){
+				return false;
+			}
+		}
+		return command.source != command.destination;
+	}
+
+	void add(const SubmitOp& command){
+		size_t index = std::find(handles.begin(), handles.end(), command.handle) - handles.begin();
+		if(index == handles.size()){
+			handles.push_back(command.handle);
+		}
+		handleIndex.push_back(index);
+		if(command.source != NULL){
+			retainSurface(command.source);
+			blits.push_back(std::make_pair(command.source, command.destination));
+			mustLock = mustLock || SDL_MUSTLOCK(command.source);
+		}
+		mustLock = mustLock || SDL_MUSTLOCK(command.destination);
+		pixels += commandPixels(command);
+		commands.push_back(command);
+	}
+
+	void clear(){
+		commands.clear();
+		handles.clear();
+		handleIndex.clear();
+		for(size_t i = 0; i < blits.size(); i++){
+			releaseSurface(blits[i].first);
+		}
+		blits.clear();
+		pixels = 0;
+		mustLock = false;
+	}
+};
+
+/**
+* Works out the part of a surface's clip rectangle that falls in one tile. Tiles are bands of whole rows, so each row's pixels stay
+* together in memory and a primitive is only clipped once per band. Every surface is split into the same number of bands, whatever its size.
+**/
+SDL_Rect tileClip(SDL_Surface* surface, int tile, int tiles){
+	SDL_Rect clip = surface->clip_rect;
+	int y0 = std::max((int) clip.y, (int) ((long) surface->h * tile / tiles));
+	int y1 = std::min(clip.y + clip.h, (int) ((long) surface->h * (tile + 1) / tiles));
+	clip.y = y0;
+	clip.h = y1 > y0 ? y1 - y0 : 0;
+	return clip;
+}
+
+/*A batch being drawn by the render thread pool. Each tile marks what it draws dirty on its own copies of the handles (tileHandles,
+one per tile per surface in handles), which are merged into the real handles once every tile is done*/
+struct TiledBatch{
+	const RenderBatch* batch;
+	int tiles;
+	std::vector<SurfaceHandle> tileHandles;
+	std::mutex errorLock; //Held while failed and error are set together
+	std::atomic<size_t> failed; //The first command that failed, commands.size() if none did. Tiles stop before it
+	const char* error;
+};
+
+/**
+* Gives each tile of a batch its own copies of the handles it draws on, once runTiled knows how many tiles there are.
+**/
+void prepareBatchTiles(void* context, int tiles){
+	TiledBatch* tiled = (TiledBatch *)context;
+	const RenderBatch& batch = *tiled->batch;
+	tiled->tiles = tiles;
+	for(int tile = 0; tile < tiles; tile++){
+		for(size_t i = 0; i < batch.handles.size(); i++){
+			SurfaceHandle copy = *batch.handles[i];
+			copy.dirtyCount = 0;
+			copy.allDirty = false;
+			tiled->tileHandles.push_back(copy);
+		}
+	}
+}
+
+/**
+* Checks whether a drawing command can fail when its surfaces don't need locking, besides SDL failing to map a blit (checked when the
+* mappings are set up, see drawBatch). A batch holding one is drawn one command at a time, so nothing after the failure is drawn.
+**/
+bool drawableCommand(const SubmitOp& command){
+	switch(command.op){
+		case SUBMIT_FILL:
+			return spanFiller(command.destination->format->BytesPerPixel) != NULL;
+		case SUBMIT_SET_PIXELS:
+			return pixelWriter(command.destination->format->BytesPerPixel) != NULL;
+	}
+	return true;
+}
+
+/**
+* Draws one tile of a batch, called by the render threads. A tile stops at the first command any tile has seen fail.
+**/
+void drawBatchTile(void* context, int tile){
+	TiledBatch* tiled = (TiledBatch *)context;
+	const RenderBatch& batch = *tiled->batch;
+	SurfaceHandle* tileHandles = &tiled->tileHandles[tile * batch.handles.size()];
+	for(size_t i = 0; i < batch.commands.size() && i < tiled->failed; i++){
+		const SubmitOp& command = batch.commands[i];
+		SDL_Rect clip = tileClip(command.destination, tile, tiled->tiles);
+		if(clip.w == 0 || clip.h == 0){
+			continue;
+		}
+		const char* error = drawCommand(command, clip, &tileHandles[batch.handleIndex[i]]);
+		if(error != NULL){
+			std::lock_guard<std::mutex> lock(tiled->errorLock);
+			if(i < tiled->failed){
+				tiled->failed = i;
+				tiled->error = error;
+			}
+			return;
+		}
+	}
+}
+
+/**
+* Draws a batch of drawing commands, split into tiles across the render thread pool if it's big enough to be worth it and the pool
+* is free, otherwise one command after another on the calling thread. Empties the batch.
+* @param failed Set to the position of the command that failed, if one did
+* @return NULL on success, otherwise the reason a command failed (used as an atom).
+**/
+const char* drawBatch(RenderBatch& batch, int* failed){
+	const char* error = NULL;
+	if(batch.commands.empty()){
+		return NULL;
+	}
+	if(!batch.mustLock && batch.pixels > dirtyPixelThreshold && renderParticipants > 1){
+		TiledBatch tiled;
+		tiled.batch = &batch;
+		tiled.failed = batch.commands.size();
+		tiled.error = NULL;
+		//Set up SDL's blit mappings here, with empty blits, rather than have the tiles race to do it. Tiles draw commands at the same
+		//time, so a batch with a command that would fail is left to the calling thread, which stops there
+		bool drawable = true;
+		SDL_Rect empty;
+		empty.x = empty.y = 0;
+		empty.w = empty.h = 0;
+		for(size_t i = 0; i < batch.blits.size(); i++){
+			SDL_Rect at = empty;
+			if(SDL_LowerBlit(batch.blits[i].first, &empty, batch.blits[i].second, &at) < 0){
+				drawable = false;
+			}
+		}
+		for(size_t i = 0; i < batch.commands.size() && drawable; i++){
+			drawable = drawableCommand(batch.commands[i]);
+		}
+		if(drawable && runTiled(drawBatchTile, prepareBatchTiles, &tiled)){
+			for(int tile = 0; tile < tiled.tiles; tile++){
+				for(size_t i = 0; i < batch.handles.size(); i++){
+					SurfaceHandle& drawn = tiled.tileHandles[tile * batch.handles.size() + i];
+					if(drawn.allDirty){
+						SDL_Rect clip = tileClip(drawn.surface, tile, tiled.tiles);
+						markDirty(batch.handles[i], clip.x, clip.y, clip.w, clip.h);
+					}
+					for(int r = 0; r < drawn.dirtyCount; r++){
+						markDirty(batch.handles[i], drawn.dirtyRects[r].x, drawn.dirtyRects[r].y, drawn.dirtyRects[r].w, drawn.dirtyRects[r].h);
+					}
+				}
+			}
+			if(tiled.failed < batch.commands.size()){
+				*failed = batch.commands[tiled.failed].position;
+				error = tiled.error;
+			}
+			batch.clear();
+			return error;
+		}
+	}
+	for(size_t i = 0; i < batch.commands.size() && error == NULL; i++){
+		error = runCommand(batch.commands[i]);
+		*failed = batch.commands[i].position;
+	}
+	batch.clear();
+	return error;
+}
+
+/**
+* Checks whether a NIF is running on a normal scheduler, where long calls hold up other Erlang processes.
+* @return true on a normal scheduler, false on a dirty scheduler.
+**/
+inline bool onNormalScheduler(){
+	return enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER;
+}
+
+/**
+* Body of the timer thread. Sleeps until the soonest timer is due, sends {sdl_delay, Ref} to its process, and repeats until unload.
+**/
+void timerLoop(){
+	std::unique_lock<std::mutex> lock(timerLock);
+	while(!timerStopping){
+		if(timerQueue.empty()){
+			timerWake.wait(lock);
+			continue;
+		}
+		if(std::chrono::steady_clock::now() < timerQueue.top().deadline){
+			//Woken early by a new timer or by unload, either way look again
+			timerWake.wait_until(lock, timerQueue.top().deadline);
+			continue;
+		}
+		PendingTimer timer = timerQueue.top();
+		timerQueue.pop();
+		lock.unlock();
+		enif_send(NULL, &timer.pid, timer.msgEnv, enif_make_tuple2(timer.msgEnv, enif_make_atom(timer.msgEnv, "sdl_delay"), timer.ref));
+		enif_free_env(timer.msgEnv);
+		lock.lock();
+	}
+}
+
+/**
+* Body of the frame clock thread. Frame n is due n/fps seconds after the clock started, so the time it takes to wake up and send
+* a tick never adds up into drift. If a deadline has already passed by whole frames those frames are skipped and reported as missed.
+* Sends {frame_tick, FrameNo, TimestampUs, MissedFrames} until stopped or until the subscriber exits.
+**/
+void frameClockLoop(){
+	std::unique_lock<std::mutex> lock(frameClockLock);
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const long long fps = frameClock.fps;
+	long long frameNo = 0;
+	ErlNifEnv* msgEnv = enif_alloc_env();
+	while(!frameClockStopping){
+		std::chrono::steady_clock::time_point deadline = start + std::chrono::nanoseconds((frameNo + 1) * 1000000000LL / fps);
+		if(frameClockWake.wait_until(lock, deadline, [] { return frameClockStopping; })){
+			break;
+		}
+		//Work out how many whole frames went by while we weren't running
+		long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		long long due = elapsed * fps / 1000000000LL;
+		long long missed = due - frameNo - 1;
+		if(missed < 0){
+			missed = 0;
+		}
+		frameNo += 1 + missed;
+		frameClock.frames++;
+		frameClock.missed += missed;
+
+		ERL_NIF_TERM tick = enif_make_tuple4(msgEnv, enif_make_atom(msgEnv, "frame_tick"), enif_make_int64(msgEnv, frameNo), enif_make_int64(msgEnv, enif_monotonic_time(ERL_NIF_USEC)), enif_make_int64(msgEnv, missed));
+		ErlNifPid subscriber = frameClock.subscriber;
+		lock.unlock();
+		int sent = enif_send(NULL, &subscriber, msgEnv, tick);
+		enif_clear_env(msgEnv);
+		lock.lock();
+		//Nobody to tick for any more
+		if(!sent){
+			break;
+		}
+	}
+	enif_free_env(msgEnv);
+}
+
+/**
+* Stops the frame clock thread if it's running. Must be called without frameClockLock held.
+**/
+void stopFrameClock(){
+	{
+		std::lock_guard<std::mutex> lock(frameClockLock);
+		frameClockStopping = true;
+		frameClockWake.notify_one();
+	}
+	if(frameClockThread.joinable()){
+		frameClockThread.join();
+	}
+}
+
+/**
+* Moves every event waiting in SDL's queue onto the end of batch. A mouse motion straight after another is merged into it, keeping the
+* newest position and button state and adding up the relative motion.
+* SDL 1.2 reads events through the video driver, so this holds the screen's lock and never runs alongside drawing onto or presenting
+* the screen. Nothing is read while there is no screen.
+* @return True if a key event was taken.
+**/
+bool pollEvents(std::vector<SDL_Event>& batch, long* merged){
+	std::lock_guard<std::mutex> screen(screenLock);
+	SurfaceLocks locks;
+	locks.lock(screenHandle);
+	if(screenHandle == NULL){
+		return false;
+	}
+	SDL_PumpEvents();
+	bool keys = false;
+	SDL_Event events[eventChunk];
+	int got;
+	while((got = SDL_PeepEvents(events, eventChunk, SDL_GETEVENT, SDL_ALLEVENTS)) > 0){
+		for(int i = 0; i < got; i++){
+			if(events[i].type == SDL_MOUSEMOTION && !batch.empty() && batch.back().type == SDL_MOUSEMOTION){
+				SDL_MouseMotionEvent& last = batch.back().motion;
+				last.x = events[i].motion.x;
+				last.y = events[i].motion.y;
+				last.state = events[i].motion.state;
+				last.xrel += events[i].motion.xrel;
+				last.yrel += events[i].motion.yrel;
+				(*merged)++;
+				continue;
+			}
+			keys = keys || events[i].type == SDL_KEYDOWN || events[i].type == SDL_KEYUP;
+			batch.push_back(events[i]);
+		}
+	}
+	return keys;
+}
+
+/**
+* Makes the Erlang term for an event. The event types SDL 1.2 has are given their own tuples, anything else is {event, Type}.
+**/
+ERL_NIF_TERM eventTerm(ErlNifEnv* env, const SDL_Event& event){
+	switch(event.type){
+	case SDL_KEYDOWN:
+	case SDL_KEYUP:
+		return enif_make_tuple4(env, enif_make_atom(env, event.type == SDL_KEYDOWN ? "key_down" : "key_up"), enif_make_int(env, event.key.keysym.sym),
+			enif_make_int(env, event.key.keysym.mod), enif_make_int(env, event.key.keysym.unicode));
+	case SDL_MOUSEMOTION:
+		return enif_make_tuple6(env, enif_make_atom(env, "mouse_motion"), enif_make_int(env, event.motion.x), enif_make_int(env, event.motion.y),
+			enif_make_int(env, event.motion.xrel), enif_make_int(env, event.motion.yrel), enif_make_int(env, event.motion.state));
+	case SDL_MOUSEBUTTONDOWN:
+	case SDL_MOUSEBUTTONUP:
+		return enif_make_tuple4(env, enif_make_atom(env, event.type == SDL_MOUSEBUTTONDOWN ? "mouse_button_down" : "mouse_button_up"),
+			enif_make_int(env, event.button.button), enif_make_int(env, event.button.x), enif_make_int(env, event.button.y));
+	case SDL_JOYAXISMOTION:
+		return enif_make_tuple4(env, enif_make_atom(env, "joy_axis"), enif_make_int(env, event.jaxis.which), enif_make_int(env, event.jaxis.axis),
+			enif_make_int(env, event.jaxis.value));
+	case SDL_JOYBALLMOTION:
+		return enif_make_tuple5(env, enif_make_atom(env, "joy_ball"), enif_make_int(env, event.jball.which), enif_make_int(env, event.jball.ball),
+			enif_make_int(env, event.jball.xrel), enif_make_int(env, event.jball.yrel));
+	case SDL_JOYHATMOTION:
+		return enif_make_tuple4(env, enif_make_atom(env, "joy_hat"), enif_make_int(env, event.jhat.which), enif_make_int(env, event.jhat.hat),
+			enif_make_int(env, event.jhat.value));
+	case SDL_JOYBUTTONDOWN:
+	case SDL_JOYBUTTONUP:
+		return enif_make_tuple3(env, enif_make_atom(env, event.type == SDL_JOYBUTTONDOWN ? "joy_button_down" : "joy_button_up"),
+			enif_make_int(env, event.jbutton.which), enif_make_int(env, event.jbutton.button));
+	case SDL_ACTIVEEVENT:
+		return enif_make_tuple3(env, enif_make_atom(env, "active"), enif_make_int(env, event.active.gain), enif_make_int(env, event.active.state));
+	case SDL_VIDEORESIZE:
+		return enif_make_tuple3(env, enif_make_atom(env, "resize"), enif_make_int(env, event.resize.w), enif_make_int(env, event.resize.h));
+	case SDL_VIDEOEXPOSE:
+		return enif_make_atom(env, "expose");
+	case SDL_QUIT:
+		return enif_make_atom(env, "quit");
+	default:
+		return enif_make_tuple2(env, enif_make_atom(env, "event"), enif_make_int(env, event.type));
+	}
+}
+
+/**
+* Body of the event pump thread. Looks for events every eventPollMs and sends what it has found as {sdl_events, TimestampUs, [Event]}
+* at most fps times a second, skipping batches with nothing in them. With immediateKeys a key event is sent as soon as it is found,
+* along with everything found before it. Runs until stopped or until the subscriber exits.
+**/
+void eventPumpLoop(){
+	std::unique_lock<std::mutex> lock(eventPumpLock);
+	const std::chrono::nanoseconds period(1000000000LL / eventPump.fps);
+	const bool immediateKeys = eventPump.immediateKeys;
+	const ErlNifPid subscriber = eventPump.subscriber;
+	std::chrono::steady_clock::time_point nextBatch = std::chrono::steady_clock::now() + period;
+	std::vector<SDL_Event> batch;
+	std::vector<ERL_NIF_TERM> terms;
+	ErlNifEnv* msgEnv = enif_alloc_env();
+	while(!eventPumpStopping){
+		if(eventPumpWake.wait_for(lock, std::chrono::milliseconds(eventPollMs), [] { return eventPumpStopping; })){
+			break;
+		}
+		lock.unlock();
+		long merged = 0;
+		bool keys = pollEvents(batch, &merged);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		bool due = now >= nextBatch;
+		while(nextBatch <= now){
+			nextBatch += period;
+		}
+		size_t sending = 0;
+		int sent = 1;
+		if(!batch.empty() && (due || (keys && immediateKeys))){
+			terms.clear();
+			for(size_t i = 0; i < batch.size(); i++){
+				terms.push_back(eventTerm(msgEnv, batch[i]));
+			}
+			ERL_NIF_TERM message = enif_make_tuple3(msgEnv, enif_make_atom(msgEnv, "sdl_events"), enif_make_int64(msgEnv, enif_monotonic_time(ERL_NIF_USEC)),
+				enif_make_list_from_array(msgEnv, terms.data(), terms.size()));
+			sent = enif_send(NULL, &subscriber, msgEnv, message);
+			enif_clear_env(msgEnv);
+			sending = batch.size();
+			batch.clear();
+		}
+		lock.lock();
+		eventPump.merged += merged;
+		if(sending > 0){
+			eventPump.batches++;
+			eventPump.events += sending;
+		}
+		//Nobody to send to any more
+		if(!sent){
+			break;
+		}
+	}
+	enif_free_env(msgEnv);
+}
+
+/**
+* Stops the event pump thread if it's running. Must be called without eventPumpLock held.
+**/
+void stopEventPump(){
+	{
+		std::lock_guard<std::mutex> lock(eventPumpLock);
+		eventPumpStopping = true;
+		eventPumpWake.notify_one();
+	}
+	if(eventPumpThread.joinable()){
+		eventPumpThread.join();
+	}
+}
+
+/**
+* Unpacks a captured frame into 8 bit R, G, B triples.
+**/
+void unpackFrame(const CaptureSlot& slot, std::vector<Uint8>& rgb){
+	const SDL_PixelFormat& format = slot.format;
+	int bpp = format.BytesPerPixel;
+	size_t count = (size_t) slot.w * slot.h;
+	rgb.resize(count * 3);
+	const Uint8* pixel = slot.pixels.data();
+	Uint8* out = rgb.data();
+	for(size_t i = 0; i < count; i++, pixel += bpp, out += 3){
+		Uint32 value;
+		switch(bpp){
+		case 1:
+			out[0] = slot.palette[*pixel].r;
+			out[1] = slot.palette[*pixel].g;
+			out[2] = slot.palette[*pixel].b;
+			continue;
+		case 2:
+			value = loadPixel<2>(pixel);
+			break;
+		case 3:
+			value = loadPixel<3>(pixel);
+			break;
+		default:
+			value = loadPixel<4>(pixel);
+			break;
+		}
+		out[0] = expandChannel((value & format.Rmask) >> format.Rshift, format.Rloss);
+		out[1] = expandChannel((value & format.Gmask) >> format.Gshift, format.Gloss);
+		out[2] = expandChannel((value & format.Bmask) >> format.Bshift, format.Bloss);
+	}
+}
+
+/**
+* Converts R, G, B triples to the planes of a Y4M 4:2:0 frame, BT.601 studio range. Each chroma sample is the average of the 2x2
+* pixels it covers.
+**/
+void rgbToYUV420(const std::vector<Uint8>& rgb, int w, int h, std::vector<Uint8>& yuv){
+	int cw = (w + 1) / 2;
+	int ch = (h + 1) / 2;
+	yuv.resize((size_t) w * h + 2 * (size_t) cw * ch);
+	Uint8* yPlane = yuv.data();
+	Uint8* uPlane = yPlane + (size_t) w * h;
+	Uint8* vPlane = uPlane + (size_t) cw * ch;
+	for(size_t i = 0; i < (size_t) w * h; i++){
+		const Uint8* p = &rgb[i * 3];
+		yPlane[i] = ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16;
+	}
+	for(int cy = 0; cy < ch; cy++){
+		for(int cx = 0; cx < cw; cx++){
+			int r = 0, g = 0, b = 0, n = 0;
+			for(int y = cy * 2; y < std::min(cy * 2 + 2, h); y++){
+				for(int x = cx * 2; x < std::min(cx * 2 + 2, w); x++){
+					const Uint8* p = &rgb[((size_t) y * w + x) * 3];
+					r += p[0];
+					g += p[1];
+					b += p[2];
+					n++;
+				}
+			}
+			r /= n;
+			g /= n;
+			b /= n;
+			//Offset so the sums are never negative before the shift
+			uPlane[cy * cw + cx] = (-38 * r - 74 * g + 112 * b + 32896) >> 8;
+			vPlane[cy * cw + cx] = (112 * r - 94 * g - 18 * b + 32896) >> 8;
+		}
+	}
+}
+
+/**
+* Writes one converted frame: appended to the Y4M file, whose header goes in front of the first frame, or to its own PPM file named
+* after the capture's path and the frame number.
+* @return False if the write failed.
+**/
+bool writeCapturedFrame(const std::vector<Uint8>& rgb, std::vector<Uint8>& yuv, int w, int h, long frameNo, bool* header){
+	if(capture.format == CAPTURE_PPM){
+		std::string number = std::to_string(frameNo);
+		if(number.size() < 6){
+			number.insert(0, 6 - number.size(), '0');
+		}
+		std::ofstream file(capture.path + number + ".ppm", std::ios::binary | std::ios::trunc);
+		file << "P6\n" << w << " " << h << "\n255\n";
+		file.write((const char*) rgb.data(), rgb.size());
+		file.close();
+		return !file.fail();
+	}
+	if(!*header){
+		capture.file << "YUV4MPEG2 W" << w << " H" << h << " F" << capture.fps << ":1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n";
+		*header = true;
+	}
+	rgbToYUV420(rgb, w, h, yuv);
+	capture.file << "FRAME\n";
+	capture.file.write((const char*) yuv.data(), yuv.size());
+	return capture.file.good();
+}
+
+/**
+* Body of the capture writer thread. Takes frames from the ring oldest first, and hands each slot back as soon as it has been unpacked
+* so the next frame can be copied in while this one is converted and written. Once stopped it writes what is left in the ring.
+**/
+void captureLoop(){
+	std::unique_lock<std::mutex> lock(captureLock);
+	std::vector<Uint8> rgb;
+	std::vector<Uint8> yuv;
+	bool header = false;
+	while(true){
+		captureWake.wait(lock, [] { return capture.queued > 0 || captureStopping; });
+		if(capture.queued == 0){
+			break;
+		}
+		const CaptureSlot& slot = capture.slots[capture.next];
+		int w = slot.w;
+		int h = slot.h;
+		long frameNo = slot.frameNo;
+		bool failed = capture.failed;
+		lock.unlock();
+		if(!failed){
+			unpackFrame(slot, rgb);
+		}
+		lock.lock();
+		capture.next = (capture.next + 1) % capture.slots.size();
+		capture.queued--;
+		lock.unlock();
+		bool wrote = !failed && writeCapturedFrame(rgb, yuv, w, h, frameNo, &header);
+		lock.lock();
+		if(wrote){
+			capture.written++;
+		}
+		else{
+			capture.failed = true;
+			capture.dropped++;
+		}
+	}
+}
+
+/**
+* Stops the capture if one is running, after the frames already copied have been written. Must be called without captureLock held.
+**/
+void stopCapture(){
+	{
+		std::lock_guard<std::mutex> lock(captureLock);
+		capturing = false;
+		captureStopping = true;
+		captureWake.notify_one();
+	}
+	if(captureThread.joinable()){
+		captureThread.join();
+	}
+	if(capture.file.is_open()){
+		capture.file.close();
+		if(capture.file.fail()){
+			capture.failed = true;
+		}
+	}
+	std::vector<CaptureSlot>().swap(capture.slots);
+}
+
+/*NIF FUNCTIONS 
+-------------------------------------------------------------------------------------------------------------------------------------------*/
+
+/**
+*	Wrapped SDL_Init function.
+*	@params Requires a flag (char*). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_Init (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Init", 1);
+	NifTimer timing(callStats);
+	char initFlag[maxBuffLen];
+	enif_get_string(env, argv[0], initFlag, maxBuffLen, ERL_NIF_LATIN1); //Gets the string passed by the function call and puts it in initFlag.
+	if (std::strcmp(initFlag, "SDL_INIT_VIDEO") == 0){
+		SDL_Init(SDL_INIT_VIDEO);
+		return enif_make_int(env,0); /*exit code, process terminated correctly*/
+	}
+	else{
+		/* Flag not recognised, process not terminated correctly*/
+		return enif_make_string(env, "Init Flag not recognised, Init terminated" , ERL_NIF_LATIN1);
+	}
+}
+
+/**
+*	Wrapped SDL_Quit function.
+*	@params None.
+*	@Return ERL_NIF_TERM 0 on success
+**/
+static ERL_NIF_TERM sdl_Quit (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Quit", 0);
+	NifTimer timing(callStats);
+	//SDL_Quit frees the video surface, so the handle holding it must let go first
+	{
+		std::lock_guard<std::mutex> screen(screenLock);
+		SurfaceLocks locks;
+		locks.lock(screenHandle);
+		if(screenHandle != NULL){
+			setHandleSurface(screenHandle, NULL, false);
+		}
+	}
+	//Cached surfaces are in the format of a screen that is going away
+	clearAssetCache();
+	SDL_Quit();
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	Wrapped SDL_CreateSurface function.
+*	@params Requires a surface name (char*). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, an error if the surface already exists, or the new surface handle on success.
+*		The handle can be passed to any function in place of the surface name.
+**/
+static ERL_NIF_TERM sdl_CreateSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_CreateSurface", 1);
+	NifTimer timing(callStats);
+	char surfaceName[maxBuffLen];
+	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+		return enif_make_badarg(env);
+	}
+	std::string surfaceString(surfaceName);
+	RegistryShard& shard = registryShard(surfaceString);
+	std::lock_guard<std::mutex> lock(shard.lock);
+	//If the surfaceName already exists throw a wobbly
+	if(shard.names.count(surfaceString) > 0){
+		return enif_make_string(env, "The surface name specified already exists, new surface not created" , ERL_NIF_LATIN1);
+	}
+	SurfaceHandle* handle = (SurfaceHandle*) enif_alloc_resource(surfaceResourceType, sizeof(SurfaceHandle));
+	handle->lock = enif_mutex_create((char*) "sdl_surface");
+	handle->surface = NULL;
+	handle->isScreen = false;
+	handle->dirtyCount = 0;
+	handle->allDirty = false;
+	handle->blend.mode = BLEND_NONE;
+	handle->blend.alpha = 255;
+	handle->drawBlend = handle->blend;
+	handle->tilemap = NULL;
+	handle->version = nextSurfaceVersion();
+	
+	//The registry keeps the reference from enif_alloc_resource, Erlang gets its own through enif_make_resource
+	shard.names[surfaceString] = handle;
+	return enif_make_resource(env, handle);
+}
+
+/**
+*	Wrapped SDL_SetVideoMode function.
+*	@params Requires integer values (width, height, bits-per-pixel), a flag (char*) and a surface. Passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, Surface not found error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_SetVideoMode (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetVideoMode", 5);
+	NifTimer timing(callStats);
+	int width, height, bits;
+	char flag[maxBuffLen];
+	//If width, height and bits passed are not integers throw an error
+	if (!enif_get_int(env, argv[0], &width) || !enif_get_int(env, argv[1], &height) || !enif_get_int(env, argv[2], &bits))
+	{
+		return enif_make_badarg(env);
+	}
+	//If flag passed is not a string throw an error
+	if(!enif_get_string(env, argv[3], flag, maxBuffLen, ERL_NIF_LATIN1)){
+		//If fileName passed is not a string throw an error
+		return enif_make_badarg(env);
+	}
+	
+	//If surface passed is not a handle or a string throw an error
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[4], &handle);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	//If surface doesn't exist throw an error
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_SetVideoMode" , ERL_NIF_LATIN1);
+	}
+	
+	//Check flag
+	if (std::strcmp(flag, "SDL_SWSURFACE") == 0){
+		
+		std::lock_guard<std::mutex> screen(screenLock);
+		SurfaceLocks locks;
+		locks.lock(handle, screenHandle);
+		//Any other handle holding the old video surface loses it, SDL may have freed it
+		if(screenHandle != NULL && screenHandle != handle){
+			setHandleSurface(screenHandle, NULL, false);
+		}
+		SDL_Surface* surface = SDL_SetVideoMode(width, height, bits, SDL_SWSURFACE);
+		setHandleSurface(handle, surface, surface != NULL);
+		
+		return enif_make_int(env,0); /*exit code, process terminated correctly*/
+	}
+	else{
+		/* Flag not recognised, process not terminated correctly*/
+		return enif_make_string(env, "Flag not recognised, sdl_SetVideoMode terminated" , ERL_NIF_LATIN1);
+	}
+}
+
+/**
+*	Wrapped SDL_LoadBMP function.
+*	@params Requires the name of the file to load (char*), and a surface to load into. Are passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, surface not found error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_LoadBMP (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_LoadBMP", 2);
+	NifTimer timing(callStats);
+	char fileName[maxBuffLen];
+	if(!enif_get_string(env, argv[0], fileName, maxBuffLen, ERL_NIF_LATIN1)){
+		//If fileName passed is not a string throw an error
+		return enif_make_badarg(env);
+	}
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[1], &handle);
+	if(found<0){
+		//If surface passed is not a handle or a string throw an error
+		return enif_make_badarg(env);
+	}
+	//If surface doesn't exist throw an error
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_LoadBMP" , ERL_NIF_LATIN1);
+	}
+	//Otherwise load the bmp into the surface, replacing (and freeing) whatever it held before.
+	//The surface comes from the asset cache and may be shared, it is copied if anything draws on it
+	SDL_Surface* surface = loadCachedBMP(fileName);
+	if(surface==NULL){
+		return enif_make_string(env, "LOAD BMP ERRROR ", ERL_NIF_LATIN1);
+	}
+	replaceHandleSurface(handle, surface);
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Loads a BMP from an Erlang binary, e.g. one kept in ETS or received from another node, without going
+*	through a file. The binary's bytes are decoded in place, not copied.
+*	@params Requires the BMP file contents (binary), and a surface to load into. Are passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, surface not found error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_LoadBMPFromBinary (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_LoadBMPFromBinary", 2);
+	NifTimer timing(callStats);
+	ErlNifBinary bmp;
+	if(!enif_inspect_binary(env, argv[0], &bmp)){
+		return enif_make_badarg(env);
+	}
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[1], &handle);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_LoadBMPFromBinary" , ERL_NIF_LATIN1);
+	}
+	//Decoding a large image takes too long for a normal scheduler. The rescheduled call sees the same binary, nothing is copied
+	if(onNormalScheduler() && bmp.size > dirtyPixelThreshold * 4){
+		return timing.reschedule(env, "sdl_LoadBMPFromBinary", sdl_LoadBMPFromBinary, argc, argv);
+	}
+	SDL_Surface* surface = loadBMPFromMemory(bmp.data, bmp.size);
+	if(surface==NULL){
+		return enif_make_string(env, "LOAD BMP ERRROR ", ERL_NIF_LATIN1);
+	}
+	replaceHandleSurface(handle, surface);
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Maps an asset pack file into memory so BMPs stored in it can be loaded with sdl_LoadBMPFromPack.
+*	Pages are only read from disk when an entry in them is loaded.
+*	@params Requires the name of the pack file (char*). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, an error string if the file couldn't be mapped, or the pack
+**/
+static ERL_NIF_TERM sdl_OpenAssetPack (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_OpenAssetPack", 1);
+	NifTimer timing(callStats);
+	char fileName[maxBuffLen];
+	if(!enif_get_string(env, argv[0], fileName, maxBuffLen, ERL_NIF_LATIN1)){
+		return enif_make_badarg(env);
+	}
+	int fd = open(fileName, O_RDONLY);
+	if(fd < 0){
+		return enif_make_string(env, "Could not open asset pack in sdl_OpenAssetPack", ERL_NIF_LATIN1);
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size == 0){
+		close(fd);
+		return enif_make_string(env, "Could not open asset pack in sdl_OpenAssetPack", ERL_NIF_LATIN1);
+	}
+	void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	//The mapping stays valid after the file is closed
+	close(fd);
+	if(data == MAP_FAILED){
+		return enif_make_string(env, "Could not map asset pack in sdl_OpenAssetPack", ERL_NIF_LATIN1);
+	}
+	AssetPack* pack = (AssetPack*) enif_alloc_resource(assetPackResourceType, sizeof(AssetPack));
+	pack->data = data;
+	pack->size = info.st_size;
+	ERL_NIF_TERM term = enif_make_resource(env, pack);
+	//The term now owns the pack
+	enif_release_resource(pack);
+	return term;
+}
+
+/**
+*	New function for this library. Loads a BMP stored in an asset pack.
+*	@params Requires the pack from sdl_OpenAssetPack, the byte offset and size of the BMP within the pack (integers), and a surface to load into.
+*		Are passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error (also if the entry runs past the end of the pack), surface not found error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_LoadBMPFromPack (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_LoadBMPFromPack", 4);
+	NifTimer timing(callStats);
+	AssetPack* pack;
+	ErlNifUInt64 offset, size;
+	if(!enif_get_resource(env, argv[0], assetPackResourceType, (void**) &pack) || !enif_get_uint64(env, argv[1], &offset) || !enif_get_uint64(env, argv[2], &size)){
+		return enif_make_badarg(env);
+	}
+	if(offset > pack->size || size > pack->size - offset){
+		return enif_make_badarg(env);
+	}
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[3], &handle);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_LoadBMPFromPack" , ERL_NIF_LATIN1);
+	}
+	const Uint8* entry = (const Uint8*) pack->data + offset;
+	//Ask for the whole entry to be read in at once rather than faulting it in a page at a time. madvise needs a page aligned start
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = offset - offset % page;
+	madvise((Uint8*) pack->data + start, offset + size - start, MADV_WILLNEED);
+	SDL_Surface* surface = loadBMPFromMemory(entry, size);
+	if(surface==NULL){
+		return enif_make_string(env, "LOAD BMP ERRROR ", ERL_NIF_LATIN1);
+	}
+	replaceHandleSurface(handle, surface);
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Loads BMPs into the asset cache ahead of time, so later sdl_LoadBMP calls for them don't touch the disk.
+*	@params Requires a list of file names. Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, an error string naming the first file that couldn't be loaded, or 0 on success.
+*		Files after one that fails are still loaded.
+**/
+static ERL_NIF_TERM sdl_PreloadBMP (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_PreloadBMP", 1);
+	NifTimer timing(callStats);
+	char fileName[maxBuffLen];
+	ERL_NIF_TERM list = argv[0];
+	ERL_NIF_TERM head;
+	std::string failed;
+	if(!enif_is_list(env, list)){
+		return enif_make_badarg(env);
+	}
+	while(enif_get_list_cell(env, list, &head, &list)){
+		if(!enif_get_string(env, head, fileName, maxBuffLen, ERL_NIF_LATIN1)){
+			return enif_make_badarg(env);
+		}
+		SDL_Surface* surface = loadCachedBMP(fileName);
+		if(surface == NULL){
+			if(failed.empty()){
+				failed = fileName;
+			}
+			continue;
+		}
+		//Only the cache holds on to it
+		releaseSurface(surface);
+	}
+	if(!failed.empty()){
+		return enif_make_string(env, ("LOAD BMP ERRROR " + failed).c_str(), ERL_NIF_LATIN1);
+	}
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Sets how many bytes of decoded pixels the asset cache may hold, evicting the least recently used
+*	assets if it is already over. The default is 64MB, 0 turns the cache off.
+*	@params Requires the budget in bytes (integer). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_SetAssetCacheBudget (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetAssetCacheBudget", 1);
+	NifTimer timing(callStats);
+	ErlNifUInt64 budget;
+	if(!enif_get_uint64(env, argv[0], &budget)){
+		return enif_make_badarg(env);
+	}
+	std::lock_guard<std::mutex> lock(assetCacheLock);
+	assetCacheBudget = (size_t) budget;
+	evictAssets();
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Reports on the asset cache.
+*	@Return ERL_NIF_TERM {Assets, Bytes, Budget, Hits, Misses}
+**/
+static ERL_NIF_TERM sdl_AssetCacheStats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_AssetCacheStats", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> lock(assetCacheLock);
+	return enif_make_tuple5(env, enif_make_uint64(env, assetCache.size()), enif_make_uint64(env, assetCacheBytes), enif_make_uint64(env, assetCacheBudget), enif_make_uint64(env, assetCacheHits), enif_make_uint64(env, assetCacheMisses));
+}
+
+/**
+*	New function for this library. Gives a surface a new blank (black) surface in the screen's pixel format, or 32 bit RGB if no video mode
+*	is set, replacing (and freeing) whatever it held before. The pixels come from the surface pool, so scratch surfaces made and freed
+*	every frame reuse the same memory.
+*	@params Requires the width and height (integers), and a surface. Are passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, surface not found error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_CreateBlankSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_CreateBlankSurface", 3);
+	NifTimer timing(callStats);
+	int width, height;
+	if(!enif_get_int(env, argv[0], &width) || !enif_get_int(env, argv[1], &height) || width <= 0 || height <= 0){
+		return enif_make_badarg(env);
+	}
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[2], &handle);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_CreateBlankSurface" , ERL_NIF_LATIN1);
+	}
+	//Clearing a large surface carries on where it can't hold up other processes
+	if(onNormalScheduler() && (long) width * height > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_CreateBlankSurface", sdl_CreateBlankSurface, argc, argv);
+	}
+	SDL_PixelFormat fallback;
+	SDL_Surface* surface = pooledSurface(width, height, scratchFormat(&fallback));
+	if(surface==NULL){
+		return enif_make_string(env, "Surface could not be created in sdl_CreateBlankSurface", ERL_NIF_LATIN1);
+	}
+	std::memset(surface->pixels, 0, (size_t) surface->pitch * surface->h);
+	replaceHandleSurface(handle, surface);
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Allocates pixels for a number of surfaces of one size up front, in a single arena, e.g. during a loading
+*	screen. Surfaces of that size made by sdl_CreateBlankSurface (in the current pixel format) then never allocate. Arena memory stays
+*	with the pool until the library is unloaded.
+*	@params Requires the width and height of the surfaces and how many to allocate for (integers). Are passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, an error if the memory couldn't be allocated, or 0 on success
+**/
+static ERL_NIF_TERM sdl_ReserveSurfaces (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_ReserveSurfaces", 3);
+	NifTimer timing(callStats);
+	int width, height, count;
+	if(!enif_get_int(env, argv[0], &width) || !enif_get_int(env, argv[1], &height) || !enif_get_int(env, argv[2], &count) || count <= 0){
+		return enif_make_badarg(env);
+	}
+	SDL_PixelFormat fallback;
+	int pitch = surfacePitch(width, height, scratchFormat(&fallback));
+	if(pitch == 0){
+		return enif_make_badarg(env);
+	}
+	size_t bytes = (size_t) pitch * height;
+	Uint8* arena = (Uint8*) std::malloc(bytes * count);
+	if(arena == NULL){
+		return enif_make_string(env, "Out of memory in sdl_ReserveSurfaces", ERL_NIF_LATIN1);
+	}
+	std::lock_guard<std::mutex> lock(poolLock);
+	Uint64 bucket = poolBucket(pitch, height);
+	for(int i = 0; i < count; i++){
+		PoolBuffer& buffer = poolBuffers[arena + bytes * i];
+		buffer.bucket = bucket;
+		buffer.bytes = bytes;
+		buffer.arena = true;
+		poolFree[bucket].push_back(arena + bytes * i);
+	}
+	poolFreeBytes += bytes * count;
+	poolArenaBytes += bytes * count;
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Sets how many bytes of free pixel buffers the surface pool keeps for reuse, giving back any over it.
+*	The default is 32MB. Arenas made by sdl_ReserveSurfaces count towards it but are always kept.
+*	@params Requires the budget in bytes (integer). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_SetSurfacePoolBudget (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetSurfacePoolBudget", 1);
+	NifTimer timing(callStats);
+	ErlNifUInt64 budget;
+	if(!enif_get_uint64(env, argv[0], &budget)){
+		return enif_make_badarg(env);
+	}
+	std::lock_guard<std::mutex> lock(poolLock);
+	poolBudget = (size_t) budget;
+	trimPool();
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Reports on the surface pool. Hits are surfaces whose pixels were reused, misses had to allocate.
+*	@Return ERL_NIF_TERM {BytesInUse, HighWater, FreeBytes, ArenaBytes, Budget, Hits, Misses}
+**/
+static ERL_NIF_TERM sdl_SurfacePoolStats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SurfacePoolStats", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> lock(poolLock);
+	ERL_NIF_TERM stats[] = {enif_make_uint64(env, poolBytesInUse), enif_make_uint64(env, poolHighWater), enif_make_uint64(env, poolFreeBytes),
+		enif_make_uint64(env, poolArenaBytes), enif_make_uint64(env, poolBudget), enif_make_uint64(env, poolHits), enif_make_uint64(env, poolMisses)};
+	return enif_make_tuple_from_array(env, stats, 7);
+}
+
+/**
+*	Wrapped SDL_BlitSurface function.
+*	@params Requires a surface to blit from, the rectangle to blit from it, a surface to blit to, and where to put it
+*		(surface from, Rect, surface to, Position). Are passed as an argument from Erlang.
+*		Rect is {X, Y, W, H}, or "NULL" for the whole surface. Position is {X, Y} (or {X, Y, W, H}, W and H are ignored as in SDL),
+*		or "NULL" for the top left corner.
+*	@Return ERL_NIF_TERM A bad argument error, an error if either surface doesn't exist, or 0 on success
+**/
+static ERL_NIF_TERM sdl_BlitSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_BlitSurface", 4);
+	NifTimer timing(callStats);
+	char flag[maxBuffLen];
+	SDL_Rect sourceRect, destinationRect;
+	SDL_Rect* sourceArg = &sourceRect;
+	int arity;
+	const ERL_NIF_TERM* fields;
+	int x, y;
+	
+	//Each rectangle is either a tuple or the string "NULL"
+	if(!rectLookup(env, argv[1], &sourceRect)){
+		if(!enif_get_string(env, argv[1], flag, maxBuffLen, ERL_NIF_LATIN1)){
+			return enif_make_badarg(env);
+		}
+		if(std::strcmp(flag, "NULL") != 0){
+			/* Flag not recognised, process not terminated correctly*/
+			return enif_make_string(env, "A Flag is not recognised, BlitSurface terminated" , ERL_NIF_LATIN1);
+		}
+		sourceArg = NULL;
+	}
+	if(enif_get_tuple(env, argv[3], &arity, &fields) && (arity == 2 || arity == 4)){
+		if(!coordLookup(env, fields[0], &x) || !coordLookup(env, fields[1], &y)){
+			return enif_make_badarg(env);
+		}
+		destinationRect.x = x;
+		destinationRect.y = y;
+	}
+	else{
+		if(!enif_get_string(env, argv[3], flag, maxBuffLen, ERL_NIF_LATIN1)){
+			return enif_make_badarg(env);
+		}
+		if(std::strcmp(flag, "NULL") != 0){
+			return enif_make_string(env, "A Flag is not recognised, BlitSurface terminated" , ERL_NIF_LATIN1);
+		}
+		//Same as SDL does for a NULL position, but SDL only reports the area drawn back through a rectangle we pass
+		destinationRect.x = 0;
+		destinationRect.y = 0;
+	}
+
+	//Check if our surfaces exist
+	SDL_Surface* primarySurface; // move from
+	SDL_Surface* secondarySurface; // move into
+	SurfaceHandle* primaryHandle;
+	SurfaceHandle* secondaryHandle;
+	int pfound = surfaceLookup(env, argv[0], &primaryHandle);
+	int sfound = surfaceLookup(env, argv[2], &secondaryHandle);
+	if(pfound<0 || sfound<0){
+		return enif_make_badarg(env);
+	}
+	
+	// If surface doesnt exist then error
+	if(pfound==0 || sfound==0){
+		return enif_make_string(env, "Surface not found in sdl_BlitSurface", ERL_NIF_LATIN1);
+	}
+	//Both handles are locked together, so a blit the other way at the same time can't deadlock
+	SurfaceLocks locks;
+	locks.lock(primaryHandle, secondaryHandle);
+	if(primaryHandle->surface==NULL || secondaryHandle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_BlitSurface", ERL_NIF_LATIN1);
+	}
+	
+	//Large blits carry on where they can't hold up other processes, counting the copy of a shared destination
+	long area = sourceArg ? (long) sourceRect.w * sourceRect.h : (long) primaryHandle->surface->w * primaryHandle->surface->h;
+	if(onNormalScheduler() && area + copyCost(secondaryHandle) > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_BlitSurface", sdl_BlitSurface, argc, argv);
+	}
+	secondarySurface = writableSurface(secondaryHandle);
+	//After the copy, in case the source is the destination
+	primarySurface = primaryHandle->surface;
+	if(secondarySurface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_BlitSurface", ERL_NIF_LATIN1);
+	}
+	//Blended as set by sdl_SetBlendMode on the source
+	if(blendedBlit(primaryHandle->blend, primarySurface, sourceArg, secondarySurface, &destinationRect, secondarySurface->clip_rect) < 0){
+		return enif_make_string(env, "Blit failed in sdl_BlitSurface", ERL_NIF_LATIN1);
+	}
+	markDirty(secondaryHandle, destinationRect.x, destinationRect.y, destinationRect.w, destinationRect.h);
+	return enif_make_int(env,0); /*exit code, process terminated correctly*/
+}
+		
+/**
+*	New function for this library. Blits many sprites from one source surface (e.g. a sprite atlas) onto one surface in a single call.
+*	Clipping is done once per sprite in the library rather than by SDL on every blit, and sprites entirely off the surface cost nothing.
+*	@param atlas The surface to blit from, surface The surface to blit to (handles or names), sprites A binary of packed records, one per sprite:
+*		<<SX:16/signed-native, SY:16/signed-native, SW:16/native, SH:16/native, DX:16/signed-native, DY:16/signed-native>>,
+*		the rectangle {SX,SY,SW,SH} of the atlas is drawn at {DX,DY}. sdlCommandList:sprite/2 builds one. Sprites are drawn in order.
+*	@Return ERL_NIF_TERM A bad argument error, an error if either surface doesn't exist, or 0 on success
+**/
+static ERL_NIF_TERM sdl_BlitBatch (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_BlitBatch", 3);
+	NifTimer timing(callStats);
+	ErlNifBinary sprites;
+	if(!enif_inspect_binary(env, argv[2], &sprites) || sprites.size % spriteRecordSize != 0){
+		return enif_make_badarg(env);
+	}
+	SDL_Surface* atlas;
+	SDL_Surface* surface;
+	SurfaceHandle* atlasHandle;
+	SurfaceHandle* handle;
+	int afound = surfaceLookup(env, argv[0], &atlasHandle);
+	int sfound = surfaceLookup(env, argv[1], &handle);
+	if(afound<0 || sfound<0){
+		return enif_make_badarg(env);
+	}
+	if(afound==0 || sfound==0){
+		return enif_make_string(env, "Surface not found in sdl_BlitBatch", ERL_NIF_LATIN1);
+	}
+	SurfaceLocks locks;
+	locks.lock(atlasHandle, handle);
+	if(atlasHandle->surface==NULL || handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_BlitBatch", ERL_NIF_LATIN1);
+	}
+
+	size_t count = sprites.size / spriteRecordSize;
+	//Add up the sprite areas (before clipping), and the copy of a shared destination, to see if the batch is too big for a normal scheduler
+	long area = 0;
+	for(size_t i = 0; i < count && area <= dirtyPixelThreshold; i++){
+		Uint16 size[2];
+		std::memcpy(size, sprites.data + i * spriteRecordSize + 4, sizeof(size));
+		area += (long) size[0] * size[1];
+	}
+	if(area + copyCost(handle) > dirtyPixelThreshold && onNormalScheduler()){
+		return timing.reschedule(env, "sdl_BlitBatch", sdl_BlitBatch, argc, argv);
+	}
+	surface = writableSurface(handle);
+	atlas = atlasHandle->surface;
+	if(surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_BlitBatch", ERL_NIF_LATIN1);
+	}
+	if(area > dirtyPixelThreshold && renderParticipants > 1 && atlas != surface){
+		//Split across the render threads, the same way as a batch of sdl_Submit commands
+		SubmitOp command;
+		command.op = SUBMIT_BLIT_BATCH;
+		command.position = 1;
+		command.sourceHandle = atlasHandle;
+		command.source = atlas;
+		command.handle = handle;
+		command.destination = surface;
+		command.records = sprites.data;
+		command.count = count;
+		RenderBatch batch;
+		batch.add(command);
+		int failed;
+		if(drawBatch(batch, &failed) != NULL){
+			return enif_make_string(env, "Blit failed in sdl_BlitBatch", ERL_NIF_LATIN1);
+		}
+		return enif_make_int(env,0);
+	}
+	if(blitSprites(atlas, surface, surface->clip_rect, sprites.data, count, atlasHandle->blend, handle) < 0){
+		return enif_make_string(env, "Blit failed in sdl_BlitBatch", ERL_NIF_LATIN1);
+	}
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Draws a tilemap in one call. Only the tiles covering the surface's clip rectangle are looked at, and
+*	where the tileset can be copied straight onto the surface (same format, blend mode none, no colour key) they are copied a row of
+*	pixels at a time across the whole row of tiles. Otherwise they are blitted as sdl_BlitBatch would, blended as sdl_SetBlendMode says.
+*	@param tileset The surface holding the tiles, numbered left to right then top to bottom, tileW, tileH The size of a tile,
+*		tiles A binary of 16 bit native tile indices row by row, 65535 (or any index past the end of the tileset) for no tile,
+*		columns The number of tiles in each row of the map, viewX, viewY The map pixel drawn at the surface's top left corner,
+*		surface The surface to draw on, mode "SDL_TILEMAP_DRAW" to draw the tiles over what is there already, or "SDL_TILEMAP_LAYER"
+*		when the surface holds only this map, e.g. a background layer that is blitted to the screen each frame. A layer has no tiles
+*		cleared to its colour key (0 if it has none), and remembers what it holds: drawn again with the same tileset, view and clip
+*		rectangle, only the tiles that changed are redrawn. Drawing on the layer or its tileset any other way, or with "SDL_TILEMAP_DRAW",
+*		makes it forget.
+*	@Return ERL_NIF_TERM A bad argument error, an error string, or 0 on success
+**/
+static ERL_NIF_TERM sdl_DrawTilemap (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_DrawTilemap", 9);
+	NifTimer timing(callStats);
+	int tileW, tileH, columns, viewX, viewY;
+	ErlNifBinary tiles;
+	char flag[maxBuffLen];
+	if(!enif_get_int(env, argv[1], &tileW) || !enif_get_int(env, argv[2], &tileH) || tileW < 1 || tileH < 1 ||
+		!enif_inspect_binary(env, argv[3], &tiles) || !enif_get_int(env, argv[4], &columns) || columns < 1 ||
+		tiles.size % (sizeof(Uint16) * columns) != 0 || !enif_get_int(env, argv[5], &viewX) || !enif_get_int(env, argv[6], &viewY) ||
+		!enif_get_string(env, argv[8], flag, maxBuffLen, ERL_NIF_LATIN1)){
+		return enif_make_badarg(env);
+	}
+	bool layer;
+	if(std::strcmp(flag, "SDL_TILEMAP_DRAW") == 0){
+		layer = false;
+	}
+	else if(std::strcmp(flag, "SDL_TILEMAP_LAYER") == 0){
+		layer = true;
+	}
+	else{
+		return enif_make_string(env, "A Flag is not recognised, DrawTilemap terminated" , ERL_NIF_LATIN1);
+	}
+	SurfaceHandle* tilesetHandle;
+	SurfaceHandle* handle;
+	int tfound = surfaceLookup(env, argv[0], &tilesetHandle);
+	int sfound = surfaceLookup(env, argv[7], &handle);
+	if(tfound<0 || sfound<0){
+		return enif_make_badarg(env);
+	}
+	if(tfound==0 || sfound==0){
+		return enif_make_string(env, "Surface not found in sdl_DrawTilemap", ERL_NIF_LATIN1);
+	}
+	SurfaceLocks locks;
+	locks.lock(tilesetHandle, handle);
+	SDL_Surface* surface = handle->surface;
+	SDL_Surface* tileset = tilesetHandle->surface;
+	if(tileset==NULL || surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_DrawTilemap", ERL_NIF_LATIN1);
+	}
+	if(tileW > tileset->w || tileH > tileset->h){
+		return enif_make_string(env, "Tiles are larger than the tileset in sdl_DrawTilemap", ERL_NIF_LATIN1);
+	}
+
+	Tilemap map;
+	map.tileset = tileset;
+	map.tileW = tileW;
+	map.tileH = tileH;
+	map.setColumns = tileset->w / tileW;
+	map.setTiles = std::min(map.setColumns * (tileset->h / tileH), emptyTile);
+	map.tiles = tiles.data;
+	map.columns = columns;
+	map.rows = tiles.size / sizeof(Uint16) / columns;
+	map.viewX = viewX;
+	map.viewY = viewY;
+	const SDL_Rect clip = surface->clip_rect;
+	BlendState blend = tilesetHandle->blend;
+
+	//The areas to draw: the whole clip rectangle, or on a layer that already holds this map, the tiles that changed
+	std::vector<SDL_Rect> areas(1, clip);
+	TilemapCache* cache = layer ? handle->tilemap : NULL;
+	int c0, c1, r0, r1;
+	if(cache != NULL && cache->version == handle->version && cache->tilesetVersion == tilesetHandle->version && cache->blend.mode == blend.mode && cache->blend.alpha == blend.alpha &&
+		cache->tileW == tileW && cache->tileH == tileH && cache->columns == columns && cache->tiles.size() * sizeof(Uint16) == tiles.size &&
+		cache->viewX == viewX && cache->viewY == viewY && std::memcmp(&cache->clip, &clip, sizeof(SDL_Rect)) == 0){
+		areas.clear();
+		if(tilesCovering(map, clip, &c0, &c1, &r0, &r1)){
+			for(int r = r0; r <= r1; r++){
+				for(int c = c0; c <= c1; c++){
+					if(map.at(c, r) == cache->tiles[(size_t) r * columns + c]){
+						continue;
+					}
+					SDL_Rect area;
+					int x0 = std::max(c * tileW - viewX, (int) clip.x);
+					int y0 = std::max(r * tileH - viewY, (int) clip.y);
+					area.x = x0;
+					area.y = y0;
+					area.w = std::min((c + 1) * tileW - viewX, clip.x + clip.w) - x0;
+					area.h = std::min((r + 1) * tileH - viewY, clip.y + clip.h) - y0;
+					areas.push_back(area);
+				}
+			}
+			//Past half the tiles it's quicker to redraw the lot in one go
+			if(areas.size() * 2 > (size_t) (c1 - c0 + 1) * (r1 - r0 + 1)){
+				areas.assign(1, clip);
+			}
+		}
+	}
+	long area = 0;
+	for(size_t i = 0; i < areas.size() && area <= dirtyPixelThreshold; i++){
+		area += (long) areas[i].w * areas[i].h;
+	}
+	if(area + copyCost(handle) > dirtyPixelThreshold && onNormalScheduler()){
+		return timing.reschedule(env, "sdl_DrawTilemap", sdl_DrawTilemap, argc, argv);
+	}
+	surface = writableSurface(handle);
+	if(surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_DrawTilemap", ERL_NIF_LATIN1);
+	}
+	//The tileset may be the surface just copied
+	map.tileset = tilesetHandle->surface;
+
+	//Forgotten until the layer is drawn in full, so a failure part way through doesn't leave it believing it holds the map
+	cache = handle->tilemap;
+	handle->tilemap = NULL;
+	Uint32 clear = (surface->flags & SDL_SRCCOLORKEY) ? surface->format->colorkey : 0;
+	for(size_t i = 0; i < areas.size(); i++){
+		if(layer){
+			SDL_Rect cleared = areas[i];
+			SDL_FillRect(surface, &cleared, clear);
+			markDirty(handle, areas[i].x, areas[i].y, areas[i].w, areas[i].h);
+		}
+		if(drawTilemapArea(map, surface, areas[i], blend, handle) < 0){
+			delete cache;
+			return enif_make_string(env, "Blit failed in sdl_DrawTilemap", ERL_NIF_LATIN1);
+		}
+	}
+	if(!layer){
+		delete cache;
+	}
+	else{
+		if(cache == NULL){
+			cache = new TilemapCache;
+		}
+		cache->version = handle->version;
+		cache->tilesetVersion = tilesetHandle->version;
+		cache->blend = blend;
+		cache->tileW = tileW;
+		cache->tileH = tileH;
+		cache->columns = columns;
+		cache->viewX = viewX;
+		cache->viewY = viewY;
+		cache->clip = clip;
+		cache->tiles.resize(tiles.size / sizeof(Uint16));
+		std::memcpy(cache->tiles.data(), tiles.data, tiles.size);
+		handle->tilemap = cache;
+	}
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Blits a rectangle of one surface onto another scaled and rotated. The source rectangle is stretched
+*	to fill the destination rectangle, then turned clockwise about the destination rectangle's centre. It is blended as sdl_SetBlendMode
+*	says, and whatever the source's format, only the turned rectangle is drawn.
+*	Transformed images are cached, so drawing the same transform of a surface again only costs the blit. Drawing on the source makes
+*	a new image next time, see sdl_SetTransformCacheBudget.
+*	@param source The surface to blit from, srcRect {X, Y, W, H} inside the source or "NULL" for all of it, surface The surface to blit to,
+*		dstRect {X, Y, W, H} or "NULL" for the whole of surface (e.g. to scale a frame up to the screen), angle Degrees clockwise (a number),
+*		filter "SDL_FILTER_NEAREST" for the nearest pixel or "SDL_FILTER_BILINEAR" to blend the four nearest
+*	@Return ERL_NIF_TERM A bad argument error, an error string, or 0 on success
+**/
+static ERL_NIF_TERM sdl_BlitTransformed (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_BlitTransformed", 6);
+	NifTimer timing(callStats);
+	char flag[maxBuffLen];
+	SDL_Rect srcRect, dstRect;
+	bool wholeSource = false;
+	bool wholeSurface = false;
+	double angle;
+	long wholeAngle;
+	if(!enif_get_double(env, argv[4], &angle)){
+		if(!enif_get_long(env, argv[4], &wholeAngle)){
+			return enif_make_badarg(env);
+		}
+		angle = (double) wholeAngle;
+	}
+	//Each rectangle is either a tuple or the string "NULL"
+	if(!rectLookup(env, argv[1], &srcRect)){
+		if(!enif_get_string(env, argv[1], flag, maxBuffLen, ERL_NIF_LATIN1)){
+			return enif_make_badarg(env);
+		}
+		if(std::strcmp(flag, "NULL") != 0){
+			return enif_make_string(env, "A Flag is not recognised, BlitTransformed terminated" , ERL_NIF_LATIN1);
+		}
+		wholeSource = true;
+	}
+	if(!rectLookup(env, argv[3], &dstRect)){
+		if(!enif_get_string(env, argv[3], flag, maxBuffLen, ERL_NIF_LATIN1)){
+			return enif_make_badarg(env);
+		}
+		if(std::strcmp(flag, "NULL") != 0){
+			return enif_make_string(env, "A Flag is not recognised, BlitTransformed terminated" , ERL_NIF_LATIN1);
+		}
+		wholeSurface = true;
+	}
+	if(!enif_get_string(env, argv[5], flag, maxBuffLen, ERL_NIF_LATIN1)){
+		return enif_make_badarg(env);
+	}
+	int filter;
+	if(std::strcmp(flag, "SDL_FILTER_NEAREST") == 0){
+		filter = FILTER_NEAREST;
+	}
+	else if(std::strcmp(flag, "SDL_FILTER_BILINEAR") == 0){
+		filter = FILTER_BILINEAR;
+	}
+	else{
+		return enif_make_string(env, "A Flag is not recognised, BlitTransformed terminated" , ERL_NIF_LATIN1);
+	}
+
+	SurfaceHandle* sourceHandle;
+	SurfaceHandle* handle;
+	int sfound = surfaceLookup(env, argv[0], &sourceHandle);
+	int dfound = surfaceLookup(env, argv[2], &handle);
+	if(sfound<0 || dfound<0){
+		return enif_make_badarg(env);
+	}
+	if(sfound==0 || dfound==0){
+		return enif_make_string(env, "Surface not found in sdl_BlitTransformed", ERL_NIF_LATIN1);
+	}
+	SurfaceLocks locks;
+	locks.lock(sourceHandle, handle);
+	//Looked up before the destination is made writable, which gives it a new version
+	SDL_Surface* source = sourceHandle->surface;
+	Uint64 version = sourceHandle->version;
+	SDL_Surface* surface = handle->surface;
+	if(source==NULL || surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_BlitTransformed", ERL_NIF_LATIN1);
+	}
+	if(wholeSource){
+		srcRect.x = 0;
+		srcRect.y = 0;
+		srcRect.w = source->w;
+		srcRect.h = source->h;
+	}
+	else if(srcRect.x < 0 || srcRect.y < 0 || srcRect.x + srcRect.w > source->w || srcRect.y + srcRect.h > source->h){
+		return enif_make_string(env, "Source rectangle is outside the source in sdl_BlitTransformed", ERL_NIF_LATIN1);
+	}
+	if(wholeSurface){
+		dstRect.x = 0;
+		dstRect.y = 0;
+		dstRect.w = surface->w;
+		dstRect.h = surface->h;
+	}
+	if(srcRect.w == 0 || srcRect.h == 0 || dstRect.w == 0 || dstRect.h == 0){
+		return enif_make_int(env,0);
+	}
+	if(onNormalScheduler() && (long) dstRect.w * dstRect.h + copyCost(handle) > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_BlitTransformed", sdl_BlitTransformed, argc, argv);
+	}
+	surface = writableSurface(handle);
+	if(surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_BlitTransformed", ERL_NIF_LATIN1);
+	}
+	if(sourceHandle == handle){
+		source = surface;
+	}
+
+	//Alpha as an ordinary blit of the source would use it: SDL only uses it with SDL_SRCALPHA set, the blend modes always do
+	BlendState blend = sourceHandle->blend;
+	bool keepAlpha = blend.mode != BLEND_NONE || (source->flags & SDL_SRCALPHA);
+	Uint8 surfaceAlpha = blend.mode == BLEND_NONE && (source->flags & SDL_SRCALPHA) && source->format->Amask == 0 ? source->format->alpha : 255;
+	SDL_Surface* image = NULL;
+	int offsetX = 0, offsetY = 0;
+	{
+		std::lock_guard<std::mutex> lock(transformCacheLock);
+		for(std::list<TransformEntry>::iterator it = transformCache.begin(); it != transformCache.end(); ++it){
+			if(it->source == source && it->version == version && std::memcmp(&it->srcRect, &srcRect, sizeof(SDL_Rect)) == 0 && it->w == dstRect.w &&
+				it->h == dstRect.h && it->angle == angle && it->filter == filter && it->keepAlpha == keepAlpha && it->surfaceAlpha == surfaceAlpha){
+				transformCache.splice(transformCache.begin(), transformCache, it);
+				image = it->image;
+				offsetX = it->offsetX;
+				offsetY = it->offsetY;
+				retainSurface(image);
+				transformCacheHits++;
+				break;
+			}
+		}
+		if(image == NULL){
+			transformCacheMisses++;
+		}
+	}
+	if(image == NULL){
+		if(SDL_MUSTLOCK(source) && SDL_LockSurface(source) < 0){
+			return enif_make_string(env, "Could not lock the source in sdl_BlitTransformed", ERL_NIF_LATIN1);
+		}
+		std::vector<Uint32> texture;
+		transformTexture(source, srcRect, keepAlpha, surfaceAlpha, filter == FILTER_BILINEAR, std::fmod(angle, 90.0) == 0, texture);
+		if(SDL_MUSTLOCK(source)){
+			SDL_UnlockSurface(source);
+		}
+		image = transformImage(texture, srcRect, dstRect.w, dstRect.h, angle, filter, &offsetX, &offsetY);
+		if(image == NULL){
+			return enif_make_string(env, "Could not make the transformed image in sdl_BlitTransformed", ERL_NIF_LATIN1);
+		}
+		//A surface drawing on itself has a new version already, so there is no point keeping what it looked like before
+		size_t bytes = (size_t) image->pitch * image->h;
+		if(source != surface){
+			std::lock_guard<std::mutex> lock(transformCacheLock);
+			if(bytes <= transformCacheBudget){
+				TransformEntry entry;
+				entry.source = source;
+				entry.version = version;
+				entry.srcRect = srcRect;
+				entry.w = dstRect.w;
+				entry.h = dstRect.h;
+				entry.angle = angle;
+				entry.filter = filter;
+				entry.keepAlpha = keepAlpha;
+				entry.surfaceAlpha = surfaceAlpha;
+				entry.offsetX = offsetX;
+				entry.offsetY = offsetY;
+				entry.image = image;
+				entry.bytes = bytes;
+				retainSurface(image);
+				transformCache.push_front(entry);
+				transformCacheBytes += bytes;
+				evictTransforms();
+			}
+		}
+	}
+
+	//The image is blitted like any other surface, blended as the source would be
+	int sx = 0, sy = 0, w = image->w, h = image->h;
+	int dx = dstRect.x + offsetX, dy = dstRect.y + offsetY;
+	int result = 0;
+	if(clipBlit(image, surface->clip_rect, sx, sy, w, h, dx, dy)){
+		BlendBlitRow kernel = blendBlitKernel(blend.mode, image->format, surface->format);
+		if(kernel == NULL){
+			SDL_Rect from, to;
+			from.x = sx;
+			from.y = sy;
+			from.w = to.w = w;
+			from.h = to.h = h;
+			to.x = dx;
+			to.y = dy;
+			result = SDL_LowerBlit(image, &from, surface, &to);
+		}
+		else if(lockBlendSurfaces(image, surface) < 0){
+			result = -1;
+		}
+		else{
+			blendRows(image, sx, sy, surface, dx, dy, w, h, kernel, blend.alpha);
+			unlockBlendSurfaces(image, surface);
+		}
+		markDirty(handle, dx, dy, w, h);
+		bytesBlitted.fetch_add((unsigned long long) w * h * surface->format->BytesPerPixel, std::memory_order_relaxed);
+	}
+	releaseSurface(image);
+	if(result < 0){
+		return enif_make_string(env, "Blit failed in sdl_BlitTransformed", ERL_NIF_LATIN1);
+	}
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Sets how many bytes of transformed images sdl_BlitTransformed may keep, evicting the least recently
+*	used if it is already over. The default is 16MB, 0 turns the cache off.
+*	@params Requires the budget in bytes (integer). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_SetTransformCacheBudget (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetTransformCacheBudget", 1);
+	NifTimer timing(callStats);
+	ErlNifUInt64 budget;
+	if(!enif_get_uint64(env, argv[0], &budget)){
+		return enif_make_badarg(env);
+	}
+	std::lock_guard<std::mutex> lock(transformCacheLock);
+	transformCacheBudget = (size_t) budget;
+	evictTransforms();
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Reports on the transform cache.
+*	@Return ERL_NIF_TERM {Images, Bytes, Budget, Hits, Misses}
+**/
+static ERL_NIF_TERM sdl_TransformCacheStats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_TransformCacheStats", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> lock(transformCacheLock);
+	return enif_make_tuple5(env, enif_make_uint64(env, transformCache.size()), enif_make_uint64(env, transformCacheBytes), enif_make_uint64(env, transformCacheBudget), enif_make_uint64(env, transformCacheHits), enif_make_uint64(env, transformCacheMisses));
+}
+
+/**
+*	New function for this library. Adds a layer to the layer tree composed by sdl_Compose, or changes one. Layers are drawn bottom first
+*	in z order, layers with the same z in the order they were added, each blended as sdl_SetBlendMode says for its surface. The layer
+*	keeps the surface handle alive until it is removed.
+*	@params Requires a layer id (integer, chosen by the caller), the surface it shows (handle or name), its position (x,y) on the target,
+*		its z, its opacity (0..255, below 255 a surface with blend mode none is blended) and a flag: "SDL_LAYER_SHOWN", "SDL_LAYER_HIDDEN",
+*		or "SDL_LAYER_STATIC" for a shown layer that rarely changes. The static layers under every other shown layer are composed into
+*		a cached background once, and after that only where they change.
+*	@Return ERL_NIF_TERM A bad argument error, an error string, or 0 on success
+**/
+static ERL_NIF_TERM sdl_SetLayer (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetLayer", 7);
+	NifTimer timing(callStats);
+	int id, x, y, z, opacity;
+	char flag[maxBuffLen];
+	if(!enif_get_int(env, argv[0], &id) || !enif_get_int(env, argv[2], &x) || !enif_get_int(env, argv[3], &y) || !enif_get_int(env, argv[4], &z) ||
+		!enif_get_int(env, argv[5], &opacity) || !enif_get_string(env, argv[6], flag, maxBuffLen, ERL_NIF_LATIN1) ||
+		x < -32768 || x > 32767 || y < -32768 || y > 32767 || opacity < 0 || opacity > 255){
+		return enif_make_badarg(env);
+	}
+	bool visible = true;
+	bool isStatic = false;
+	if(std::strcmp(flag, "SDL_LAYER_HIDDEN") == 0){
+		visible = false;
+	}
+	else if(std::strcmp(flag, "SDL_LAYER_STATIC") == 0){
+		isStatic = true;
+	}
+	else if(std::strcmp(flag, "SDL_LAYER_SHOWN") != 0){
+		return enif_make_string(env, "A Flag is not recognised, SetLayer terminated" , ERL_NIF_LATIN1);
+	}
+	std::lock_guard<std::mutex> lock(compositorLock);
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[1], &handle);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_SetLayer", ERL_NIF_LATIN1);
+	}
+	SurfaceHandle* replaced = NULL;
+	{
+		SurfaceLocks locks;
+		locks.lock(handle);
+		if(handle->isScreen){
+			return enif_make_string(env, "Surface is the screen in sdl_SetLayer", ERL_NIF_LATIN1);
+		}
+	}
+	std::vector<Layer>& layers = compositor.layers;
+	std::vector<Layer>::iterator layer = layers.begin();
+	while(layer != layers.end() && layer->id != id){
+		++layer;
+	}
+	if(layer == layers.end()){
+		Layer added = Layer();
+		added.id = id;
+		added.handle = NULL;
+		layer = layers.insert(layers.end(), added);
+	}
+	if(layer->handle != handle){
+		replaced = layer->handle;
+		enif_keep_resource(handle);
+		layer->handle = handle;
+	}
+	bool moved = layer->z != z;
+	layer->x = x;
+	layer->y = y;
+	layer->z = z;
+	layer->opacity = (Uint8) opacity;
+	layer->visible = visible;
+	layer->isStatic = isStatic;
+	//What changed is worked out by sdl_Compose, only the order is kept here
+	if(moved){
+		std::stable_sort(layers.begin(), layers.end(), layerBelow);
+	}
+	//With no locks on handles held, in case this was the last reference
+	if(replaced != NULL){
+		enif_release_resource(replaced);
+	}
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Takes a layer out of the layer tree, see sdl_SetLayer.
+*	@params Requires the layer id (integer). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, a layer not found error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_RemoveLayer (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_RemoveLayer", 1);
+	NifTimer timing(callStats);
+	int id;
+	if(!enif_get_int(env, argv[0], &id)){
+		return enif_make_badarg(env);
+	}
+	std::lock_guard<std::mutex> lock(compositorLock);
+	std::vector<Layer>& layers = compositor.layers;
+	for(size_t i = 0; i < layers.size(); i++){
+		if(layers[i].id == id){
+			composeAgain(layers[i].drawn.area, layers[i].drawn.background);
+			SurfaceHandle* handle = layers[i].handle;
+			layers.erase(layers.begin() + i);
+			enif_release_resource(handle);
+			return enif_make_int(env,0); /*exit code*/
+		}
+	}
+	return enif_make_string(env, "Layer not found in sdl_RemoveLayer", ERL_NIF_LATIN1);
+}
+
+/**
+*	New function for this library. Empties the layer tree and drops the cached background.
+*	@Return ERL_NIF_TERM 0
+**/
+static ERL_NIF_TERM sdl_ClearLayers (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_ClearLayers", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> lock(compositorLock);
+	for(size_t i = 0; i < compositor.layers.size(); i++){
+		enif_release_resource(compositor.layers[i].handle);
+	}
+	compositor.layers.clear();
+	if(compositor.background != NULL){
+		releaseSurface(compositor.background);
+		compositor.background = NULL;
+	}
+	compositor.dirtyCount = 0;
+	compositor.allDirty = true;
+	return enif_make_int(env,0); /*exit code*/
+}
+
+/**
+*	New function for this library. Composes the layer tree onto a surface and, if it is the screen, presents it as sdl_Present does.
+*	Only the areas where something changed since the last call are composed again: where a layer was added, removed, moved, shown,
+*	hidden or restacked, where its opacity or its surface's blend mode, colour key or alpha changed, and where its surface was drawn on.
+*	Those areas are filled from the cached background of static layers (or black if there are none) and the layers above it are drawn
+*	over them. The surface should only be drawn on through layers, anything else drawn on it makes the next call compose all of it again.
+*	@params Requires the surface to compose onto (handle or name). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, an error string, or the number of pixels composed
+**/
+static ERL_NIF_TERM sdl_Compose (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Compose", 1);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> lock(compositorLock);
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[0], &handle);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_Compose", ERL_NIF_LATIN1);
+	}
+	std::vector<SurfaceHandle*> handles(1, handle);
+	for(size_t i = 0; i < compositor.layers.size(); i++){
+		if(compositor.layers[i].handle == handle){
+			return enif_make_string(env, "A layer shows the surface being composed in sdl_Compose", ERL_NIF_LATIN1);
+		}
+		handles.push_back(compositor.layers[i].handle);
+	}
+	SurfaceLocks locks;
+	locks.lock(handles);
+	if(handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_Compose", ERL_NIF_LATIN1);
+	}
+	size_t backgroundLayers = collectLayerChanges(handle);
+	//Large changes carry on where they can't hold up other processes, the changes collected so far are kept for then
+	unsigned long pixels = regionPixels(compositor.dirtyRects, compositor.dirtyCount, compositor.allDirty, compositor.width, compositor.height);
+	if(compositor.background != NULL){
+		pixels += regionPixels(compositor.backgroundRects, compositor.backgroundCount, compositor.allBackground, compositor.width, compositor.height);
+	}
+	if(onNormalScheduler() && pixels + copyCost(handle) > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_Compose", sdl_Compose, argc, argv);
+	}
+	SDL_Surface* surface = writableSurface(handle);
+	if(surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_Compose", ERL_NIF_LATIN1);
+	}
+	unsigned long composed = composeDirty(handle, surface, backgroundLayers);
+	compositor.targetVersion = handle->version;
+	compositor.composes++;
+	compositor.lastPixels = composed;
+	compositor.totalPixels += composed;
+	if(handle->isScreen && presentDirty(handle) < 0){
+		return enif_make_string(env, "Flip failed in sdl_Compose" , ERL_NIF_LATIN1);
+	}
+	return enif_make_ulong(env, composed);
+}
+
+/**
+*	New function for this library. Reports how much work sdl_Compose has been doing.
+*	@Return ERL_NIF_TERM {Layers, Composes, LastComposePixels, TotalPixels, BackgroundPixels}, BackgroundPixels being those composed into
+*		the cached background
+**/
+static ERL_NIF_TERM sdl_CompositorStats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_CompositorStats", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> lock(compositorLock);
+	return enif_make_tuple5(env, enif_make_uint64(env, compositor.layers.size()), enif_make_ulong(env, compositor.composes), enif_make_ulong(env, compositor.lastPixels), enif_make_uint64(env, compositor.totalPixels), enif_make_uint64(env, compositor.backgroundPixels));
+}
+
+/**
+*	Wrapped SDL_Flip function.
+*	@params Requires the surface to flip (handle or name). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, a surface not found error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_Flip (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Flip", 1);
+	NifTimer timing(callStats);
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		//If argument passed is not a handle or a string throw an error
+		return enif_make_badarg(env);
+	}
+	//If surface doesn't exist throw an error
+	if(found==0 || handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_Flip" , ERL_NIF_LATIN1);
+	}
+	SDL_Surface* surface = handle->surface;
+	//Flipping a large software surface copies the whole of it, so that carries on on a dirty scheduler
+	if(onNormalScheduler() && surface->w * surface->h > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_Flip", sdl_Flip, argc, argv);
+	}
+	if(handle->isScreen){
+		captureFrame(surface);
+	}
+	SDL_Flip(surface);
+	if(handle->isScreen){
+		presented(handle, (unsigned long) surface->w * surface->h);
+	}
+	return enif_make_int(env,0); /*exit code*/	
+}
+
+/**
+*	New function for this library. Presents only the parts of the screen drawn on since it was last presented.
+*	Every blit, fill and pixel write marks the area it changed, overlapping and touching areas are merged, and the result is sent to the
+*	display with one SDL_UpdateRects call. If most of the screen changed it is flipped instead.
+*	@params Requires the screen surface (handle or name). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, an error string, or the number of pixels presented
+**/
+static ERL_NIF_TERM sdl_Present (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Present", 1);
+	NifTimer timing(callStats);
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0 || handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_Present" , ERL_NIF_LATIN1);
+	}
+	if(!handle->isScreen){
+		return enif_make_string(env, "Surface is not the screen in sdl_Present" , ERL_NIF_LATIN1);
+	}
+	unsigned long pixels = dirtyPixels(handle);
+	if(onNormalScheduler() && pixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_Present", sdl_Present, argc, argv);
+	}
+	if(presentDirty(handle) < 0){
+		return enif_make_string(env, "Flip failed in sdl_Present" , ERL_NIF_LATIN1);
+	}
+	return enif_make_ulong(env, pixels);
+}
+
+/**
+*	New function for this library. Reports how much of the screen sdl_Present and sdl_Flip have been sending to the display.
+*	@Return ERL_NIF_TERM {Frames, LastFramePixels, TotalPixels}
+**/
+static ERL_NIF_TERM sdl_PresentStats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_PresentStats", 0);
+	NifTimer timing(callStats);
+	return enif_make_tuple3(env, enif_make_ulong(env, presentedFrames), enif_make_ulong(env, lastPresentedPixels), enif_make_uint64(env, totalPresentedPixels));
+}
+
+/**
+*	New function for this library. Reports the instrumentation every NIF keeps on itself, so you can see which calls take up the frame time.
+*	@Return ERL_NIF_TERM A map: #{nifs => #{{Name, Arity} => Times}, frames => Times, bytes_blitted => Bytes, pixels_written => Pixels}
+*		nifs only has the NIFs called since the library was loaded, frames are the times between frames shown by sdl_Flip and sdl_Present.
+*		Times are maps of #{count, total_ns, mean_ns, p50_ns, p90_ns, p99_ns, max_ns, histogram}, the histogram is a list of
+*		{StartNs, Count} for each bucket holding any times. Buckets are 25% wide, so the percentiles are accurate to 25%.
+**/
+static ERL_NIF_TERM sdl_Stats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Stats", 0);
+	NifTimer timing(callStats);
+	ERL_NIF_TERM nifs = enif_make_new_map(env);
+	{
+		std::lock_guard<std::mutex> lock(nifStatsLock);
+		for(size_t i = 0; i < nifStats.size(); i++){
+			ERL_NIF_TERM key = enif_make_tuple2(env, enif_make_atom(env, nifStats[i]->name), enif_make_int(env, nifStats[i]->arity));
+			enif_make_map_put(env, nifs, key, histogramMap(env, &nifStats[i]->latency), &nifs);
+		}
+	}
+	ERL_NIF_TERM stats = enif_make_new_map(env);
+	enif_make_map_put(env, stats, enif_make_atom(env, "nifs"), nifs, &stats);
+	enif_make_map_put(env, stats, enif_make_atom(env, "frames"), histogramMap(env, &frameTimes), &stats);
+	enif_make_map_put(env, stats, enif_make_atom(env, "bytes_blitted"), enif_make_uint64(env, bytesBlitted.load()), &stats);
+	enif_make_map_put(env, stats, enif_make_atom(env, "pixels_written"), enif_make_uint64(env, pixelsWritten.load()), &stats);
+	return stats;
+}
+
+/**
+*	New function for this library. Clears everything sdl_Stats reports, e.g. after warming up or at the start of a level.
+*	@Return ERL_NIF_TERM 0
+**/
+static ERL_NIF_TERM sdl_ResetStats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_ResetStats", 0);
+	NifTimer timing(callStats);
+	{
+		std::lock_guard<std::mutex> lock(nifStatsLock);
+		for(size_t i = 0; i < nifStats.size(); i++){
+			resetHistogram(&nifStats[i]->latency);
+		}
+	}
+	resetHistogram(&frameTimes);
+	//The next frame starts the count again
+	lastFrameTime = 0;
+	bytesBlitted = 0;
+	pixelsWritten = 0;
+	return enif_make_int(env, 0);
+}
+
+/**
+*	Wrapped SDL_Delay function.
+*	Runs on a dirty IO scheduler, so only the calling process waits. sdl_DelayAsync doesn't block at all.
+*	@params Requires an integer value (in ms). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, or 0 on success
+**/
+static ERL_NIF_TERM sdl_Delay (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Delay", 1);
+	NifTimer timing(callStats);
+	int x;
+	if (!enif_get_int(env, argv[0], &x)) /*If argument isn't an integer throw an error */
+	{
+		return enif_make_badarg(env);
+	}
+	SDL_Delay(x);
+	return enif_make_int(env, 0); /* Exit code */
+}
+
+/**
+*	New function for this library. A non-blocking replacement for sdl_Delay.
+*	@params Requires an integer value (in ms). Is passed as an argument from Erlang.
+*	@Return ERL_NIF_TERM A bad argument error, or a reference Ref on success. {sdl_delay, Ref} is sent to the calling process after the delay.
+**/
+static ERL_NIF_TERM sdl_DelayAsync (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_DelayAsync", 1);
+	NifTimer timing(callStats);
+	int x;
+	if (!enif_get_int(env, argv[0], &x) || x < 0) /*If argument isn't a positive integer throw an error */
+	{
+		return enif_make_badarg(env);
+	}
+	PendingTimer timer;
+	timer.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(x);
+	enif_self(env, &timer.pid);
+	timer.msgEnv = enif_alloc_env();
+	timer.ref = enif_make_ref(timer.msgEnv);
+	ERL_NIF_TERM ref = enif_make_copy(env, timer.ref);
+
+	std::lock_guard<std::mutex> lock(timerLock);
+	if(!timerThread.joinable()){
+		timerStopping = false;
+		timerThread = std::thread(timerLoop);
+	}
+	timerQueue.push(timer);
+	timerWake.notify_one();
+	return ref;
+}
+
+/**
+*	New function for this library. Starts a native frame clock, replacing the one already running if there is one.
+*	The clock paces frames without blocking a scheduler, use it in place of sdl_Delay between sdl_Flip calls.
+*	@params Requires the target frames per second (integer, 1 to 1000) and the pid to send ticks to.
+*	@Return ERL_NIF_TERM A bad argument error, or 0 on success.
+*		{frame_tick, FrameNo, TimestampUs, MissedFrames} is sent to the pid once per frame. FrameNo counts from 1, TimestampUs is
+*		erlang:monotonic_time(microsecond) when the tick was sent, MissedFrames is how many frames were skipped because the tick was late.
+**/
+static ERL_NIF_TERM sdl_StartFrameClock (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_StartFrameClock", 2);
+	NifTimer timing(callStats);
+	int fps;
+	ErlNifPid subscriber;
+	if(!enif_get_int(env, argv[0], &fps) || fps < 1 || fps > 1000 || !enif_get_local_pid(env, argv[1], &subscriber)){
+		return enif_make_badarg(env);
+	}
+	std::lock_guard<std::mutex> control(frameClockControlLock);
+	stopFrameClock();
+
+	frameClockStopping = false;
+	frameClock.fps = fps;
+	frameClock.subscriber = subscriber;
+	frameClock.frames = 0;
+	frameClock.missed = 0;
+	frameClockThread = std::thread(frameClockLoop);
+	return enif_make_int(env, 0); /* Exit code */
+}
+
+/**
+*	New function for this library. Stops the frame clock.
+*	@Return ERL_NIF_TERM {Ticks, MissedFrames}, the totals for the clock that was running ({0, 0} if none was).
+**/
+static ERL_NIF_TERM sdl_StopFrameClock (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_StopFrameClock", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> control(frameClockControlLock);
+	bool running = frameClockThread.joinable();
+	stopFrameClock();
+	if(!running){
+		return enif_make_tuple2(env, enif_make_int(env, 0), enif_make_int(env, 0));
+	}
+	return enif_make_tuple2(env, enif_make_long(env, frameClock.frames), enif_make_long(env, frameClock.missed));
+}
+
+/**
+*	New function for this library. Starts a native event pump, replacing the one already running if there is one.
+*	Input is read off the schedulers and arrives as messages, so there is no need to poll for it from Erlang. Events are only read
+*	while there is a screen (set by sdl_SetVideoMode). Unicode translation is turned on so key events carry the character typed.
+*	@params Requires the batches per second (integer, 1 to 1000), the pid to send events to, and "SDL_KEYS_IMMEDIATE" to send key events
+*		as soon as they arrive or "SDL_KEYS_BATCHED" to send them with the rest.
+*	@Return ERL_NIF_TERM A bad argument error, an error string if the key flag is not recognised, or 0 on success.
+*		{sdl_events, TimestampUs, Events} is sent to the pid at most once per batch, oldest event first, and only when there are events.
+*		A run of mouse motion is merged into one event with the latest position and the relative motion added up. Events are
+*		{key_down | key_up, Sym, Mod, Unicode}, {mouse_motion, X, Y, XRel, YRel, ButtonState}, {mouse_button_down | mouse_button_up, Button, X, Y},
+*		{joy_axis, Joystick, Axis, Value}, {joy_ball, Joystick, Ball, XRel, YRel}, {joy_hat, Joystick, Hat, Value},
+*		{joy_button_down | joy_button_up, Joystick, Button}, {active, Gain, State}, {resize, W, H}, expose, quit, or {event, Type} for any other.
+**/
+static ERL_NIF_TERM sdl_StartEventPump (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_StartEventPump", 3);
+	NifTimer timing(callStats);
+	int fps;
+	ErlNifPid subscriber;
+	char flag[maxBuffLen];
+	if(!enif_get_int(env, argv[0], &fps) || fps < 1 || fps > 1000 || !enif_get_local_pid(env, argv[1], &subscriber) ||
+		!enif_get_string(env, argv[2], flag, maxBuffLen, ERL_NIF_LATIN1)){
+		return enif_make_badarg(env);
+	}
+	bool immediateKeys;
+	if(std::strcmp(flag, "SDL_KEYS_IMMEDIATE") == 0){
+		immediateKeys = true;
+	}
+	else if(std::strcmp(flag, "SDL_KEYS_BATCHED") == 0){
+		immediateKeys = false;
+	}
+	else{
+		return enif_make_string(env, "A Flag is not recognised, StartEventPump terminated" , ERL_NIF_LATIN1);
+	}
+	std::lock_guard<std::mutex> control(eventPumpControlLock);
+	stopEventPump();
+
+	SDL_EnableUNICODE(1);
+	eventPumpStopping = false;
+	eventPump.fps = fps;
+	eventPump.immediateKeys = immediateKeys;
+	eventPump.subscriber = subscriber;
+	eventPump.batches = 0;
+	eventPump.events = 0;
+	eventPump.merged = 0;
+	eventPumpThread = std::thread(eventPumpLoop);
+	return enif_make_int(env, 0); /* Exit code */
+}
+
+/**
+*	New function for this library. Stops the event pump. Events it had not sent yet are dropped.
+*	@Return ERL_NIF_TERM {Batches, Events, MergedMotion}, the totals for the pump that was running ({0, 0, 0} if none was).
+**/
+static ERL_NIF_TERM sdl_StopEventPump (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_StopEventPump", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> control(eventPumpControlLock);
+	bool running = eventPumpThread.joinable();
+	stopEventPump();
+	if(!running){
+		return enif_make_tuple3(env, enif_make_int(env, 0), enif_make_int(env, 0), enif_make_int(env, 0));
+	}
+	return enif_make_tuple3(env, enif_make_long(env, eventPump.batches), enif_make_long(env, eventPump.events), enif_make_long(env, eventPump.merged));
+}
+
+/**
+*	New function for this library. Starts capturing every frame presented to the screen (by sdl_Flip, sdl_Present or sdl_Submit) to disk,
+*	replacing the capture already running if there is one. Works with any video driver, including the headless dummy driver.
+*	Frames are copied into a ring of buffers and written by a background thread, so presenting never waits for the disk. A frame
+*	presented while the whole ring is waiting to be written is dropped and counted.
+*	@params Requires the path (string), the format "SDL_CAPTURE_Y4M" for one Y4M 4:2:0 video file or "SDL_CAPTURE_PPM" for one PPM file
+*		per frame named Path followed by the frame number (e.g. "out/frame_" gives out/frame_000001.ppm), the frame rate written in the
+*		Y4M header (integer, 1 to 1000), and the number of frames the ring holds (integer, 2 to 256).
+*	@Return ERL_NIF_TERM A bad argument error, an error string, or 0 on success.
+**/
+static ERL_NIF_TERM sdl_StartCapture (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_StartCapture", 4);
+	NifTimer timing(callStats);
+	char path[maxBuffLen];
+	char flag[maxBuffLen];
+	int fps, frames;
+	if(!enif_get_string(env, argv[0], path, maxBuffLen, ERL_NIF_LATIN1) || !enif_get_string(env, argv[1], flag, maxBuffLen, ERL_NIF_LATIN1) ||
+		!enif_get_int(env, argv[2], &fps) || fps < 1 || fps > 1000 || !enif_get_int(env, argv[3], &frames) || frames < 2 || frames > 256){
+		return enif_make_badarg(env);
+	}
+	int format;
+	if(std::strcmp(flag, "SDL_CAPTURE_Y4M") == 0){
+		format = CAPTURE_Y4M;
+	}
+	else if(std::strcmp(flag, "SDL_CAPTURE_PPM") == 0){
+		format = CAPTURE_PPM;
+	}
+	else{
+		return enif_make_string(env, "A Flag is not recognised, StartCapture terminated" , ERL_NIF_LATIN1);
+	}
+	std::lock_guard<std::mutex> control(captureControlLock);
+	stopCapture();
+
+	if(format == CAPTURE_Y4M){
+		capture.file.open(path, std::ios::binary | std::ios::trunc);
+		if(!capture.file.is_open()){
+			return enif_make_string(env, "Could not open the file in sdl_StartCapture" , ERL_NIF_LATIN1);
+		}
+	}
+	capture.slots.resize(frames);
+	//Allocate the ring now for the screen there is, so presenting doesn't allocate while capturing
+	{
+		std::lock_guard<std::mutex> screen(screenLock);
+		SurfaceLocks locks;
+		locks.lock(screenHandle);
+		if(screenHandle != NULL && screenHandle->surface != NULL){
+			SDL_Surface* surface = screenHandle->surface;
+			for(int i = 0; i < frames; i++){
+				capture.slots[i].pixels.resize((size_t) surface->w * surface->format->BytesPerPixel * surface->h);
+			}
+		}
+	}
+	capture.format = format;
+	capture.fps = fps;
+	capture.path = path;
+	capture.next = 0;
+	capture.queued = 0;
+	capture.width = 0;
+	capture.height = 0;
+	capture.frames = 0;
+	capture.written = 0;
+	capture.dropped = 0;
+	capture.failed = false;
+	captureStopping = false;
+	captureThread = std::thread(captureLoop);
+	{
+		std::lock_guard<std::mutex> lock(captureLock);
+		capturing = true;
+	}
+	return enif_make_int(env, 0); /* Exit code */
+}
+
+/**
+*	New function for this library. Stops capturing frames, once the frames already copied have been written.
+*	@Return ERL_NIF_TERM {Frames, Written, Dropped} for the capture that was running ({0, 0, 0} if none was), or an error string if
+*		writing a frame failed. Frames is how many frames were presented while capturing.
+**/
+static ERL_NIF_TERM sdl_StopCapture (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_StopCapture", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> control(captureControlLock);
+	bool running = captureThread.joinable();
+	stopCapture();
+	if(!running){
+		return enif_make_tuple3(env, enif_make_int(env, 0), enif_make_int(env, 0), enif_make_int(env, 0));
+	}
+	if(capture.failed){
+		return enif_make_string(env, "Writing a frame failed in sdl_StopCapture" , ERL_NIF_LATIN1);
+	}
+	return enif_make_tuple3(env, enif_make_long(env, capture.frames), enif_make_long(env, capture.written), enif_make_long(env, capture.dropped));
+}
+
+/**
+*	New function for this library. Reports on the capture running, or the last one if none is.
+*	@Return ERL_NIF_TERM {Frames, Written, Dropped, Queued}. Queued is how many frames are waiting in the ring to be written.
+**/
+static ERL_NIF_TERM sdl_CaptureStats (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_CaptureStats", 0);
+	NifTimer timing(callStats);
+	std::lock_guard<std::mutex> lock(captureLock);
+	return enif_make_tuple4(env, enif_make_long(env, capture.frames), enif_make_long(env, capture.written), enif_make_long(env, capture.dropped),
+		enif_make_ulong(env, capture.queued));
+}
+
+/**
+*	Wrapped SDL_FreeSurface function.
+*	@params Requires the surface to free (handle or name). Is passed as an argument from Erlang.
+*		Freeing by name also releases the name so that it can be used again.
+*	@Return ERL_NIF_TERM A bad argument error, a string error if the surface is not found, or 0 on success
+**/
+static ERL_NIF_TERM sdl_FreeSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_FreeSurface", 1);
+	NifTimer timing(callStats);
+	SurfaceHandle* handle;
+	int found = surfaceLookup(env, argv[0], &handle);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_FreeSurface" , ERL_NIF_LATIN1);
+	}
+	
+	//Free the surface. The handle itself lives on (empty) until Erlang lets go of it
+	replaceHandleSurface(handle, NULL);
+
+	//Drop the name, and with it the registry's reference. The lookup's term keeps the handle alive until we return
+	char surfaceName[maxBuffLen];
+	if(enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+		std::string name(surfaceName);
+		RegistryShard& shard = registryShard(name);
+		std::lock_guard<std::mutex> lock(shard.lock);
+		//Unless another process has freed the name and reused it meanwhile
+		std::unordered_map<std::string, SurfaceHandle*>::iterator it = shard.names.find(name);
+		if(it != shard.names.end() && it->second == handle){
+			shard.names.erase(it);
+			enif_release_resource(handle);
+		}
+	}
+	return enif_make_int(env, 0); /*Exit Code*/
+}
+
+/**
+*	Wrapped SDL_UpdateRect function
+*	@params Requires the surface to be updated (handle or name), the position (x,y) of the rectangle and it's size (w,h)
+*	@return 0 on success, error String otherwise.
+**/
+static ERL_NIF_TERM sdl_UpdateRect (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_UpdateRect", 5);
+	NifTimer timing(callStats);
+	int x, y, w, h;
+	if(!enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y) || !enif_get_int(env, argv[3], &w) || !enif_get_int(env, argv[4], &h)){
+		return enif_make_badarg(env);
+	}
+	
+	SDL_Surface* surface;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &surface, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_UpdateRect", ERL_NIF_LATIN1);
+	}
+	
+	//Update the rect for the surface
+	SDL_UpdateRect(surface, x, y, w, h);
+	
+	return enif_make_int(env, 0); /*Exit code*/
+}
+
+/**
+*	New function for the library.
+*	@param surface The surface (handle or name) whose pixel format is being gotten.
+*	@return ERL_NIF_TERM Erlang List of various pixel format elements, or an error message on failure.
+**/
+static ERL_NIF_TERM sdl_GetPixelFormat (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_GetPixelFormat", 1);
+	NifTimer timing(callStats);
+	SDL_Surface* surface;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &surface, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_GetPixelFormat", ERL_NIF_LATIN1);
+	}
+	
+	//Get Pixel Format
+	SDL_PixelFormat* pixelFormat = surface->format;
+	
+	//Make lists for loss, shift, and mask to cut down on size of pixelList. This means we will be passing back a list containing lists
+	ERL_NIF_TERM lossList = enif_make_list4(env, enif_make_int(env, pixelFormat->Rloss), enif_make_int(env, pixelFormat->Gloss), enif_make_int(env, pixelFormat->Bloss), enif_make_int(env, pixelFormat->Aloss));
+	
+	ERL_NIF_TERM shiftList = enif_make_list4(env, enif_make_int(env, pixelFormat->Rshift), enif_make_int(env, pixelFormat->Gshift), enif_make_int(env, pixelFormat->Bshift), enif_make_int(env, pixelFormat->Ashift));
+	
+	ERL_NIF_TERM maskList = enif_make_list4(env, enif_make_int(env, pixelFormat->Rmask), enif_make_int(env, pixelFormat->Gmask), enif_make_int(env, pixelFormat->Bmask), enif_make_int(env, pixelFormat->Amask));
+		
+	//The first element is whatever identified the surface (its name or its handle), in place of the palette pointer
+	ERL_NIF_TERM pixelList = enif_make_list8(env, argv[0], enif_make_int(env, pixelFormat->BitsPerPixel), enif_make_int(env, pixelFormat->BytesPerPixel), lossList, shiftList, maskList, enif_make_int(env, pixelFormat->colorkey), enif_make_int(env, pixelFormat->alpha));
+		
+	return(pixelList);
+}
+
+/**
+*	Wrapped SDL_MapRGB
+*	Stores new RGB maps in rgbMaps under their names
+*	Overwrites if the name already exists
+*	@Param mapName Name of map (for storage and reference), format Surface (handle or name) whose format we're using,  r red value, g green value, b blue value
+*	@Return 0 on success, error String otherwise.
+**/
+ERL_NIF_TERM sdl_MapRGB (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_MapRGB", 5);
+	NifTimer timing(callStats);
+	char mapName[maxBuffLen];
+	int r, g, b;
+	//Ok, so it's fiddly to pass hex values in from erlang but we could convert integers
+	if(!enif_get_string(env, argv[0], mapName, maxBuffLen, ERL_NIF_LATIN1)){
+		return enif_make_badarg(env);
+	}
+	
+	if(!enif_get_int(env, argv[2], &r) || !enif_get_int(env, argv[3], &g) || !enif_get_int(env, argv[4], &b)){
+		return enif_make_badarg(env);
+	}
+	if(r<0 || r>255 || g<0 || g>255 || b<0 || b>255){
+		return enif_make_string(env, "R, G, or B value out of bounds in sdl_mapRGB. Please ensure value is 0<=X<=255", ERL_NIF_LATIN1);
+	}
+	
+	//Check format exists
+	SDL_Surface* formatSurface;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[1], &formatSurface, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_MapRGB", ERL_NIF_LATIN1);
+	}
+	
+	Uint8 rHex = (Uint8) r;
+	Uint8 gHex = (Uint8) g;
+	Uint8 bHex = (Uint8) b;
+	
+	//Creates the map if it doesn't exist, otherwise overwrites it
+	Uint32 pixel = SDL_MapRGB(formatSurface->format, rHex, gHex, bHex);
+	std::lock_guard<std::mutex> lock(rgbMapLock);
+	rgbMaps[mapName] = pixel;
+	
+	return enif_make_int(env, 0); /*Exit code*/
+}
+
+/**
+*	Wrapped SDL_MapRGB without a stored map. Useful alongside surface handles, the pixel value can be passed anywhere a map name can.
+*	@Param format Surface (handle or name) whose format we're using,  r red value, g green value, b blue value
+*	@Return The mapped pixel value on success, error String otherwise.
+**/
+ERL_NIF_TERM sdl_MapRGB4 (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_MapRGB", 4);
+	NifTimer timing(callStats);
+	int r, g, b;
+	if(!enif_get_int(env, argv[1], &r) || !enif_get_int(env, argv[2], &g) || !enif_get_int(env, argv[3], &b)){
+		return enif_make_badarg(env);
+	}
+	if(r<0 || r>255 || g<0 || g>255 || b<0 || b>255){
+		return enif_make_string(env, "R, G, or B value out of bounds in sdl_mapRGB. Please ensure value is 0<=X<=255", ERL_NIF_LATIN1);
+	}
+
+	SDL_Surface* formatSurface;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &formatSurface, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_MapRGB", ERL_NIF_LATIN1);
+	}
+
+	return enif_make_uint(env, SDL_MapRGB(formatSurface->format, (Uint8) r, (Uint8) g, (Uint8) b));
+}
+
+/**
+*	Wrapped MUSTLOCK SDL function
+*	@param surface The surface (handle or name) to check lock status on
+*	@return 0 if True, 1 if False, Error srting otherwise.
+**/
+ERL_NIF_TERM sdl_MUSTLOCK (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_MUSTLOCK", 1);
+	NifTimer timing(callStats);
+	SDL_Surface* surface;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &surface, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_MUSTLOCK" , ERL_NIF_LATIN1);
+	}
+	
+	//Apparently Nifs don't have a make boolean option, so we've got to use int instead
+	if(SDL_MUSTLOCK(surface)){
+		//return TRUE
+		return enif_make_int(env,0);
+	}
+	//return FALSE
+	return enif_make_int(env,1);
+}
+
+/**
+*	Wrapped LockSurface SDL Function. Locks a surface.
+*	@Params surface The surface (handle or name) to be locked.
+*	@return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_LockSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_LockSurface", 1);
+	NifTimer timing(callStats);
+	SDL_Surface* surface;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &surface, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_LockSurface" , ERL_NIF_LATIN1);
+	}
+	
+	 if ( SDL_LockSurface(surface) < 0 ) {
+            return enif_make_string(env, "Surface couldn't be locked in sdl_LockSurface" , ERL_NIF_LATIN1);
+        }
+	return enif_make_int(env,0); /*Exit code*/
+}
+
+/**
+*	Wrapped UnlockSurface SDL Function. Unlocks a surface.
+*	@Params surface The surface (handle or name) to be unlocked.
+*	@return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_UnlockSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_UnlockSurface", 1);
+	NifTimer timing(callStats);
+	SDL_Surface* surface;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &surface, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_UnlockSurface" , ERL_NIF_LATIN1);
+	}
+	
+	SDL_UnlockSurface(surface);
+	return enif_make_int(env,0); /*Exit code*/
+}
+
+/**
+*	New function for this library. Sets the rgb value of a pixel in a surface.
+*	@param surface The target surface (handle or name), x and y are the co-ordinates of the pixel,
+*		colour Name of the RGB Map the pixel will inherit the colour value from (or the pixel value itself).
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_SetPixel (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetPixel", 4);
+	NifTimer timing(callStats);
+	int x, y;
+	if(!enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y)){
+		return enif_make_badarg(env);
+	}
+	
+	SDL_Surface* surface;
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0 || handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_SetPixel" , ERL_NIF_LATIN1);
+	}
+	surface = handle->surface;
+	
+	Uint32 newPixel;
+	int mFound = colourLookup(env, argv[3], &newPixel);
+	if(mFound<0){
+		return enif_make_badarg(env);
+	}
+	if(mFound==0){
+		return enif_make_string(env, "Map not found in sdl_SetPixel" , ERL_NIF_LATIN1);
+	}
+	
+	//Pixels outside the surface (or its clip rectangle) are clipped
+	if(!insideClip(surface->clip_rect, x, y)){
+		return enif_make_int(env,0);
+	}
+	if(onNormalScheduler() && copyCost(handle) > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_SetPixel", sdl_SetPixel, argc, argv);
+	}
+	surface = writableSurface(handle);
+	if(surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_SetPixel" , ERL_NIF_LATIN1);
+	}
+	
+	//Get the bytes per pixel and the old pixel value
+	int bpp = surface->format->BytesPerPixel;
+	PixelWriter write = pixelWriter(bpp);
+	if(write == NULL){
+		//We shouldn't get here, if we do there's a problem with bpp
+		return enif_make_string(env, "Bytes per pixel found to be of an invalid range in sdl_SetPixel()", ERL_NIF_LATIN1);
+	}
+	Uint8 *oldPixel = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
+	BlendedPixelWriter blended(handle, surface);
+	if(blended.kernel != NULL){
+		blended.write(oldPixel, newPixel);
+	}
+	else{
+		write(oldPixel, newPixel);
+	}
+	markDirty(handle, x, y, 1, 1);
+	pixelsWritten.fetch_add(1, std::memory_order_relaxed);
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Sets many pixels in one call.
+*	@param surface The target surface (handle or name), pixels A binary of packed records, one per pixel:
+*		<<X:16/signed-native, Y:16/signed-native, Colour:32/native>>, where Colour is a pixel value from sdl_MapRGB/4.
+*		Pixels outside the surface's clip rectangle are skipped.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_SetPixels (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetPixels", 2);
+	NifTimer timing(callStats);
+	ErlNifBinary pixels;
+	if(!enif_inspect_binary(env, argv[1], &pixels) || pixels.size % 8 != 0){
+		return enif_make_badarg(env);
+	}
+
+	SDL_Surface* surface;
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0 || handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_SetPixels" , ERL_NIF_LATIN1);
+	}
+	surface = handle->surface;
+	if(onNormalScheduler() && (long) (pixels.size / 8) + copyCost(handle) > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_SetPixels", sdl_SetPixels, argc, argv);
+	}
+	surface = writableSurface(handle);
+	if(surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_SetPixels" , ERL_NIF_LATIN1);
+	}
+
+	int result = setPixelRecords(surface, pixels.data, pixels.size / 8, handle);
+	if(result == -1){
+		return enif_make_string(env, "Bytes per pixel found to be of an invalid range in sdl_SetPixels()", ERL_NIF_LATIN1);
+	}
+	if(result == -2){
+		return enif_make_string(env, "Surface couldn't be locked in sdl_SetPixels" , ERL_NIF_LATIN1);
+	}
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Sets a run of pixels along one row.
+*	@param surface The target surface (handle or name), x and y are the co-ordinates of the first pixel,
+*		colours A binary of pixel values (from sdl_MapRGB/4), each one <<Colour:32/native>>, written left to right.
+*		The run is clipped to the surface's clip rectangle.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_SetPixelRow (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetPixelRow", 4);
+	NifTimer timing(callStats);
+	int x, y;
+	ErlNifBinary colours;
+	if(!enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y)){
+		return enif_make_badarg(env);
+	}
+	if(!enif_inspect_binary(env, argv[3], &colours) || colours.size % 4 != 0){
+		return enif_make_badarg(env);
+	}
+
+	SDL_Surface* surface;
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0 || handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_SetPixelRow" , ERL_NIF_LATIN1);
+	}
+	surface = handle->surface;
+
+	int bpp = surface->format->BytesPerPixel;
+	PixelWriter write = pixelWriter(bpp);
+	if(write == NULL){
+		return enif_make_string(env, "Bytes per pixel found to be of an invalid range in sdl_SetPixelRow()", ERL_NIF_LATIN1);
+	}
+
+	//Clip the run once, rather than checking every pixel
+	const SDL_Rect& clip = surface->clip_rect;
+	long first = 0;
+	long last = (long) (colours.size / 4);
+	if(y < clip.y || y >= clip.y + clip.h){
+		return enif_make_int(env,0);
+	}
+	if(x < clip.x){
+		first = (long) clip.x - x;
+	}
+	if((long) x + last > clip.x + clip.w){
+		last = (long) clip.x + clip.w - x;
+	}
+	if(first >= last){
+		return enif_make_int(env,0);
+	}
+	if(onNormalScheduler() && last - first + copyCost(handle) > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_SetPixelRow", sdl_SetPixelRow, argc, argv);
+	}
+	surface = writableSurface(handle);
+	if(surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_SetPixelRow" , ERL_NIF_LATIN1);
+	}
+
+	if(SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0){
+		return enif_make_string(env, "Surface couldn't be locked in sdl_SetPixelRow" , ERL_NIF_LATIN1);
+	}
+	BlendedPixelWriter blended(handle, surface);
+	Uint8* pixel = (Uint8 *)surface->pixels + y * surface->pitch + (x + first) * bpp;
+	for(long i = first; i < last; i++){
+		Uint32 colour;
+		std::memcpy(&colour, colours.data + i * 4, sizeof(colour));
+		if(blended.kernel != NULL){
+			blended.write(pixel, colour);
+		}
+		else{
+			write(pixel, colour);
+		}
+		pixel += bpp;
+	}
+	if(SDL_MUSTLOCK(surface)){
+		SDL_UnlockSurface(surface);
+	}
+	markDirty(handle, x + first, y, last - first, 1);
+	pixelsWritten.fetch_add(last - first, std::memory_order_relaxed);
+	return enif_make_int(env,0);
+}
+
+/**
+* Reads a blend mode and constant alpha passed from Erlang.
+* @return 1 if found, 0 if the mode string isn't a blend mode, -1 if the arguments are the wrong type or alpha is out of range.
+**/
+int blendLookup(ErlNifEnv* env, ERL_NIF_TERM modeTerm, ERL_NIF_TERM alphaTerm, BlendState* blend){
+	char mode[maxBuffLen];
+	int alpha;
+	if(!enif_get_string(env, modeTerm, mode, maxBuffLen, ERL_NIF_LATIN1) || !enif_get_int(env, alphaTerm, &alpha) || alpha < 0 || alpha > 255){
+		return (-1);
+	}
+	blend->alpha = alpha;
+	if(std::strcmp(mode, "SDL_BLENDMODE_NONE") == 0){
+		blend->mode = BLEND_NONE;
+	}
+	else if(std::strcmp(mode, "SDL_BLENDMODE_BLEND") == 0){
+		blend->mode = BLEND_BLEND;
+	}
+	else if(std::strcmp(mode, "SDL_BLENDMODE_ADD") == 0){
+		blend->mode = BLEND_ADD;
+	}
+	else if(std::strcmp(mode, "SDL_BLENDMODE_MOD") == 0){
+		blend->mode = BLEND_MOD;
+	}
+	else{
+		return 0;
+	}
+	return 1;
+}
+
+/**
+*	New function for this library. Sets how a surface is blended when it is blitted (by sdl_BlitSurface, sdl_BlitBatch or sdl_Submit).
+*	@param surface The surface (handle or name), mode "SDL_BLENDMODE_NONE", "SDL_BLENDMODE_BLEND", "SDL_BLENDMODE_ADD" or "SDL_BLENDMODE_MOD",
+*		alpha A constant alpha 0..255, multiplied with the surface's own per pixel alpha if it has any.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_SetBlendMode (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetBlendMode", 3);
+	NifTimer timing(callStats);
+	BlendState blend;
+	int mFound = blendLookup(env, argv[1], argv[2], &blend);
+	if(mFound<0){
+		return enif_make_badarg(env);
+	}
+	if(mFound==0){
+		return enif_make_string(env, "A Flag is not recognised, SetBlendMode terminated" , ERL_NIF_LATIN1);
+	}
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_SetBlendMode" , ERL_NIF_LATIN1);
+	}
+	handle->blend = blend;
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Sets how shapes and pixels drawn onto a surface are blended with what is already there.
+*	Used by sdl_SetPixel, sdl_SetPixels, sdl_SetPixelRow, the shape functions (sdl_FillRect, sdl_Line, sdl_FillCircle...) and sdl_Submit.
+*	@param surface The surface (handle or name), mode and alpha As sdl_SetBlendMode, the alpha is multiplied with the colour's own alpha.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_SetDrawBlendMode (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetDrawBlendMode", 3);
+	NifTimer timing(callStats);
+	BlendState blend;
+	int mFound = blendLookup(env, argv[1], argv[2], &blend);
+	if(mFound<0){
+		return enif_make_badarg(env);
+	}
+	if(mFound==0){
+		return enif_make_string(env, "A Flag is not recognised, SetDrawBlendMode terminated" , ERL_NIF_LATIN1);
+	}
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
+	}
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_SetDrawBlendMode" , ERL_NIF_LATIN1);
+	}
+	handle->drawBlend = blend;
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Fills a rectangle with one colour.
+*	@param surface The target surface (handle or name), rect {X, Y, W, H} or "NULL" for the whole surface,
+*		colour A pixel value from sdl_MapRGB/4 or the name of a map made by sdl_MapRGB/5.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_FillRect (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_FillRect", 3);
+	NifTimer timing(callStats);
+	SDL_Rect rect;
+	bool whole = false;
+	if(!rectLookup(env, argv[1], &rect)){
+		char flag[maxBuffLen];
+		if(!enif_get_string(env, argv[1], flag, maxBuffLen, ERL_NIF_LATIN1) || std::strcmp(flag, "NULL") != 0){
+			return enif_make_badarg(env);
+		}
+		whole = true;
+	}
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, argv[0], argv[2], "sdl_FillRect", &canvas, &locks, &error)){
+		return error;
+	}
+	if(whole){
+		rect.x = 0;
+		rect.y = 0;
+		rect.w = canvas.surface->w;
+		rect.h = canvas.surface->h;
+	}
+	if(onNormalScheduler() && clippedArea(&canvas, rect.x, rect.y, (long) rect.x + rect.w, (long) rect.y + rect.h) + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_FillRect", sdl_FillRect, argc, argv);
+	}
+	if(!readyCanvas(env, &canvas, "sdl_FillRect", &error)){
+		return error;
+	}
+	canvasFillRect(&canvas, rect.x, rect.y, rect.w, rect.h);
+	endCanvas(&canvas);
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Draws a horizontal line.
+*	@param surface The target surface (handle or name), x1 and x2 The ends of the line (both drawn), y Its row, colour As sdl_FillRect.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_HLine (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_HLine", 5);
+	NifTimer timing(callStats);
+	int x1, x2, y;
+	if(!coordLookup(env, argv[1], &x1) || !coordLookup(env, argv[2], &x2) || !coordLookup(env, argv[3], &y)){
+		return enif_make_badarg(env);
+	}
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, argv[0], argv[4], "sdl_HLine", &canvas, &locks, &error)){
+		return error;
+	}
+	if(onNormalScheduler() && std::abs((long) x2 - x1) + 1 + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_HLine", sdl_HLine, argc, argv);
+	}
+	if(!readyCanvas(env, &canvas, "sdl_HLine", &error)){
+		return error;
+	}
+	canvas.span(y, std::min(x1, x2), std::max(x1, x2) + 1);
+	endCanvas(&canvas);
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Draws a vertical line.
+*	@param surface The target surface (handle or name), x Its column, y1 and y2 The ends of the line (both drawn), colour As sdl_FillRect.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_VLine (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_VLine", 5);
+	NifTimer timing(callStats);
+	int x, y1, y2;
+	if(!coordLookup(env, argv[1], &x) || !coordLookup(env, argv[2], &y1) || !coordLookup(env, argv[3], &y2)){
+		return enif_make_badarg(env);
+	}
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, argv[0], argv[4], "sdl_VLine", &canvas, &locks, &error)){
+		return error;
+	}
+	if(onNormalScheduler() && std::abs((long) y2 - y1) + 1 + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_VLine", sdl_VLine, argc, argv);
+	}
+	if(!readyCanvas(env, &canvas, "sdl_VLine", &error)){
+		return error;
+	}
+	canvasFillRect(&canvas, x, std::min(y1, y2), 1, std::abs(y2 - y1) + 1);
+	endCanvas(&canvas);
+	return enif_make_int(env,0);
+}
+
+/**
+*	New function for this library. Draws a one pixel wide line between two points, both ends included.
+*	@param surface The target surface (handle or name), x1, y1, x2, y2 The ends of the line, colour As sdl_FillRect.
+*	@Return 0 on success, error string otherwise.
+**/
+ERL_NIF_TERM sdl_Line (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Line", 6);
+	NifTimer timing(callStats);
+	int x1, y1, x2, y2;
+	if(!coordLookup(env, argv[1], &x1) || !coordLookup(env, argv[2], &y1) || !coordLookup(env, argv[3], &x2) || !coordLookup(env, argv[4], &y2)){
 		return enif_make_badarg(env);
 	}
-	
-	//If surface passed is not a string throw an error
-	if(!enif_get_string(env, argv[4], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
-		return enif_make_badarg(env);
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, argv[0], argv[5], "sdl_Line", &canvas, &locks, &error)){
+		return error;
 	}
-	std::string surfaceString(surfaceName);
-	
-	//If surface doesn't exist throw an error
-	int i = surfaceIndex(surfaceString);
-	if(i<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_CreateRGBSurface" , ERL_NIF_LATIN1);
+	if(onNormalScheduler() && std::max(std::abs((long) x2 - x1), std::abs((long) y2 - y1)) + 1 + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_Line", sdl_Line, argc, argv);
 	}
-	SDL_Surface* surface = surfaceArray[i];
-	
-	//Check flag
-	if (std::strcmp(flag, "SDL_SWSURFACE") == 0){
-		
-		surface = SDL_SetVideoMode(width, height, bits, SDL_SWSURFACE);	
-		surfaceArray[i]=surface;
-		
-		return enif_make_int(env,0); /*exit code, process terminated correctly*/
+	if(!readyCanvas(env, &canvas, "sdl_Line", &error)){
+		return error;
+	}
+	//Straight lines are one span or a column of pixels
+	if(y1 == y2){
+		canvas.span(y1, std::min(x1, x2), std::max(x1, x2) + 1);
 	}
 	else{
-		/* Flag not recognised, process not terminated correctly*/
-		return enif_make_string(env, "Flag not recognised, sdl_SetVideoMode terminated" , ERL_NIF_LATIN1);
+		canvasLine(&canvas, x1, y1, x2, y2);
 	}
+	endCanvas(&canvas);
+	return enif_make_int(env,0);
 }
 
 /**
-*	Wrapped SDL_LoadBMP function.
-*	@params Requires the name of the file to load (char*), and a surface to load into. Are passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, surface not found error, or 0 on success
+*	New function for this library. Draws a filled circle.
+*	@param surface The target surface (handle or name), x and y The centre, r The radius, colour As sdl_FillRect.
+*	@Return 0 on success, error string otherwise.
 **/
-static ERL_NIF_TERM sdl_LoadBMP (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char fileName[maxBuffLen];
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], fileName, maxBuffLen, ERL_NIF_LATIN1)){
-		//If fileName passed is not a string throw an error
+ERL_NIF_TERM sdl_FillCircle (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_FillCircle", 5);
+	NifTimer timing(callStats);
+	int x, y, r;
+	if(!coordLookup(env, argv[1], &x) || !coordLookup(env, argv[2], &y) || !coordLookup(env, argv[3], &r) || r < 0){
 		return enif_make_badarg(env);
 	}
-	if(!enif_get_string(env, argv[1], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
-		//If surfaceName passed is not a string throw an error
-		return enif_make_badarg(env);
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, argv[0], argv[4], "sdl_FillCircle", &canvas, &locks, &error)){
+		return error;
 	}
-	//If surfaceName doesn't exist throw an error
-	std::string surfaceString(surfaceName);
-	int i = surfaceIndex(surfaceString);
-	if(i<0){
-		return enif_make_string(env, "SurfaceIndex<0 in sdl_LoadBMP" , ERL_NIF_LATIN1);
+	if(onNormalScheduler() && clippedArea(&canvas, (long) x - r, (long) y - r, (long) x + r + 1, (long) y + r + 1) + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_FillCircle", sdl_FillCircle, argc, argv);
 	}
-	//Otherwise load the bmp into the surface	
-
-	SDL_Surface* surface = surfaceArray[i];
-	
- 	surface = SDL_LoadBMP(fileName);
-	surfaceArray[i] = surface;
-	
-	if(surface==NULL){
-		return enif_make_string(env, "LOAD BMP ERRROR ", ERL_NIF_LATIN1);
+	if(!readyCanvas(env, &canvas, "sdl_FillCircle", &error)){
+		return error;
 	}
-	return enif_make_int(env,0); /*exit code*/
+	canvasFillEllipse(&canvas, x, y, r, r);
+	endCanvas(&canvas);
+	return enif_make_int(env,0);
 }
 
 /**
-*	Wrapped SDL_BlitSurface function.
-*	@params Requires a surface to blit from, flags for clipping and cropping, and a surface to blit to (surface from, Flag, surface to, Flag). 
-*		Are passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, an error if either surface doesn't exist, or 0 on success
+*	New function for this library. Draws a filled ellipse, with its axes along the x and y axes.
+*	@param surface The target surface (handle or name), x and y The centre, rx and ry The horizontal and vertical radii, colour As sdl_FillRect.
+*	@Return 0 on success, error string otherwise.
 **/
-static ERL_NIF_TERM sdl_BlitSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char primarySurfaceName[maxBuffLen]; // move from
-	char secondarySurfaceName[maxBuffLen]; // move into
-	char flag1[maxBuffLen];
-	char flag2[maxBuffLen];
-	
-	//If any of the arguments passed are not strings throw an error
-	if(!enif_get_string(env, argv[0], primarySurfaceName, maxBuffLen, ERL_NIF_LATIN1) || !enif_get_string(env, argv[1], flag1, maxBuffLen, ERL_NIF_LATIN1) || !enif_get_string(env, argv[2], secondarySurfaceName, maxBuffLen, ERL_NIF_LATIN1) || !enif_get_string(env, argv[3], flag2, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_FillEllipse (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_FillEllipse", 6);
+	NifTimer timing(callStats);
+	int x, y, rx, ry;
+	if(!coordLookup(env, argv[1], &x) || !coordLookup(env, argv[2], &y) || !coordLookup(env, argv[3], &rx) || !coordLookup(env, argv[4], &ry) || rx < 0 || ry < 0){
 		return enif_make_badarg(env);
 	}
-	//Check if our surfaces exist
-	std::string primSurfaceString(primarySurfaceName);
-	std::string secSurfaceString(secondarySurfaceName);
-	int pindex = surfaceIndex(primSurfaceString);
-	int sindex = surfaceIndex(secSurfaceString);
-	
-	// If surface doesnt exist then error
-	if(pindex <0  || sindex <0 ){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_BlitSurface", ERL_NIF_LATIN1);
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, argv[0], argv[5], "sdl_FillEllipse", &canvas, &locks, &error)){
+		return error;
 	}
-
-	SDL_Surface* primarySurface = surfaceArray[pindex];
-	SDL_Surface* secondarySurface = surfaceArray[sindex];
-	
-	//Check our flags
-	if (std::strcmp(flag1, "NULL") == 0 && std::strcmp(flag2, "NULL")==0){
-		
-		SDL_BlitSurface(primarySurface, NULL, secondarySurface, NULL);
-		surfaceArray[pindex] = primarySurface;
-		surfaceArray[sindex] = secondarySurface;
-		
-		return enif_make_int(env,0); /*exit code, process terminated correctly*/
+	if(onNormalScheduler() && clippedArea(&canvas, (long) x - rx, (long) y - ry, (long) x + rx + 1, (long) y + ry + 1) + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_FillEllipse", sdl_FillEllipse, argc, argv);
 	}
-	else{
-		/* Flag not recognised, process not terminated correctly*/
-		return enif_make_string(env, "A Flag is not recognised, BlitSurface terminated" , ERL_NIF_LATIN1);
+	if(!readyCanvas(env, &canvas, "sdl_FillEllipse", &error)){
+		return error;
 	}
+	canvasFillEllipse(&canvas, x, y, rx, ry);
+	endCanvas(&canvas);
+	return enif_make_int(env,0);
 }
 
+/*A NIF, for rescheduling a call onto a dirty scheduler from shared code*/
+typedef ERL_NIF_TERM (*NifFunction)(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
 /**
-*	Wrapped SDL_Flip function.
-*	@params Requires the name of the surface to flip (char*). Is passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, a surface not found error, or 0 on success
+*	Shared by sdl_FillTriangle and sdl_FillPolygon once the corners have been read.
+*	@param nifName and nif The calling NIF, for error strings and rescheduling, timing The calling NIF's timer
 **/
-static ERL_NIF_TERM sdl_Flip (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
-		//If argument passed is not a string throw an error
-		return enif_make_badarg(env);
+ERL_NIF_TERM fillPolygon (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[], const char* nifName, NifFunction nif, NifTimer& timing,
+		ERL_NIF_TERM surfaceTerm, ERL_NIF_TERM colourTerm, const std::vector<int>& xs, const std::vector<int>& ys){
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, surfaceTerm, colourTerm, nifName, &canvas, &locks, &error)){
+		return error;
 	}
-	//If surfaceName doesn't exist throw an error
-	std::string surfaceString(surfaceName);
-	int i = surfaceIndex(surfaceString);
-	if(i<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_Flip" , ERL_NIF_LATIN1);
+	if(onNormalScheduler()){
+		long area = canvas.copyPixels;
+		if(!xs.empty()){
+			area += clippedArea(&canvas, *std::min_element(xs.begin(), xs.end()), *std::min_element(ys.begin(), ys.end()),
+				*std::max_element(xs.begin(), xs.end()), *std::max_element(ys.begin(), ys.end()));
+		}
+		if(area > dirtyPixelThreshold){
+			return timing.reschedule(env, nifName, nif, argc, argv);
+		}
 	}
-	SDL_Surface* surface = surfaceArray[i];
-	SDL_Flip(surface);
-	return enif_make_int(env,0); /*exit code*/	
+	if(!readyCanvas(env, &canvas, nifName, &error)){
+		return error;
+	}
+	canvasFillPolygon(&canvas, xs, ys);
+	endCanvas(&canvas);
+	return enif_make_int(env,0);
 }
 
 /**
-*	Wrapped SDL_Delay function.
-*	@params Requires an integer value (in ms). Is passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, or 0 on success
+*	New function for this library. Draws a filled triangle.
+*	@param surface The target surface (handle or name), p1, p2, p3 The corners as {X, Y}, colour As sdl_FillRect.
+*	@Return 0 on success, error string otherwise.
 **/
-static ERL_NIF_TERM sdl_Delay (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	int x;
-	if (!enif_get_int(env, argv[0], &x)) /*If argument isn't an integer throw an error */
-	{
-		return enif_make_badarg(env);
+ERL_NIF_TERM sdl_FillTriangle (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_FillTriangle", 5);
+	NifTimer timing(callStats);
+	std::vector<int> xs(3), ys(3);
+	for(int i = 0; i < 3; i++){
+		if(!pointLookup(env, argv[i + 1], &xs[i], &ys[i])){
+			return enif_make_badarg(env);
+		}
 	}
-	SDL_Delay(x);
-	return enif_make_int(env, 0); /* Exit code */
+	return fillPolygon(env, argc, argv, "sdl_FillTriangle", sdl_FillTriangle, timing, argv[0], argv[4], xs, ys);
 }
 
 /**
-*	Wrapped SDL_FreeSurface function.
-*	@params Requires the name of the surface to free. Is passed as an argument from Erlang.
-*	@Return ERL_NIF_TERM A bad argument error, a string error if the surface is not found, or 0 on success
+*	New function for this library. Draws a filled polygon. Edges may cross, pixels are filled by the even-odd rule.
+*	@param surface The target surface (handle or name), points A list of the corners as {X, Y}, in order, colour As sdl_FillRect.
+*	@Return 0 on success, error string otherwise.
 **/
-static ERL_NIF_TERM sdl_FreeSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_FillPolygon (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_FillPolygon", 3);
+	NifTimer timing(callStats);
+	unsigned int length;
+	if(!enif_get_list_length(env, argv[1], &length)){
 		return enif_make_badarg(env);
 	}
-	std::string surfaceString(surfaceName);
-	int index = surfaceIndex(surfaceString);
-	
-	if(index<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_FreeSurface" , ERL_NIF_LATIN1);
+	std::vector<int> xs(length), ys(length);
+	ERL_NIF_TERM list = argv[1];
+	ERL_NIF_TERM head;
+	for(unsigned int i = 0; i < length; i++){
+		enif_get_list_cell(env, list, &head, &list);
+		if(!pointLookup(env, head, &xs[i], &ys[i])){
+			return enif_make_badarg(env);
+		}
 	}
-	
-	//Free the surface
-	SDL_FreeSurface(surfaceArray[index]);
-	//Erase the surface and it's name from the arrays
-	surfaceArray.erase(surfaceArray.begin()+index);
-	surfaceNames.erase(surfaceNames.begin() + index);
-	return enif_make_int(env, 0); /*Exit Code*/
+	return fillPolygon(env, argc, argv, "sdl_FillPolygon", sdl_FillPolygon, timing, argv[0], argv[2], xs, ys);
 }
 
 /**
-*	Wrapped SDL_UpdateRect function
-*	@params Requires the name of the surface to be updated, the position (x,y) of the rectangle and it's size (w,h)
-*	@return 0 on success, error String otherwise.
+*	New function for this library. Loads a bitmap font from an atlas surface and a table of glyph metrics. Each glyph is cut out of the
+*	atlas once, so the atlas can be freed afterwards and text can be drawn in any colour on any surface. Pixels of the colour key aren't
+*	part of a glyph, the others are as much as their alpha if the atlas has an alpha channel, wholly if it has a colour key, and
+*	otherwise as much as their brightest channel (so white glyphs on black work as they are). Partly covered pixels are blended.
+*	@param atlas The surface holding the glyphs (handle or name), lineHeight The distance from one line of text to the next,
+*		glyphs A list of {Codepoint, X, Y, W, H, XOffset, YOffset, XAdvance}: the rectangle (X, Y, W, H) of the atlas holding the
+*		character, where it is drawn relative to the pen (at the top of the line) and how far the pen then moves. The glyph for U+FFFD,
+*		or else the one for "?", is drawn for characters the font doesn't have.
+*	@Return The font, a bad argument error, or an error string.
 **/
-static ERL_NIF_TERM sdl_UpdateRect (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	int x, y, w, h;
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_LoadFont (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_LoadFont", 3);
+	NifTimer timing(callStats);
+	int lineHeight;
+	unsigned int length;
+	if(!coordLookup(env, argv[1], &lineHeight) || lineHeight < 1 || !enif_get_list_length(env, argv[2], &length)){
 		return enif_make_badarg(env);
 	}
-	if(!enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y) || !enif_get_int(env, argv[3], &w) || !enif_get_int(env, argv[4], &h)){
+	std::vector<unsigned int> codepoints(length);
+	std::vector<SDL_Rect> rects(length);
+	std::vector<Glyph> glyphs(length);
+	ERL_NIF_TERM list = argv[2];
+	ERL_NIF_TERM head;
+	for(unsigned int i = 0; i < length; i++){
+		enif_get_list_cell(env, list, &head, &list);
+		int arity;
+		const ERL_NIF_TERM* fields;
+		int x, y, w, h;
+		if(!enif_get_tuple(env, head, &arity, &fields) || arity != 8 || !enif_get_uint(env, fields[0], &codepoints[i]) || codepoints[i] > 0x10FFFF ||
+			!coordLookup(env, fields[1], &x) || !coordLookup(env, fields[2], &y) || !coordLookup(env, fields[3], &w) || !coordLookup(env, fields[4], &h) ||
+			w < 0 || h < 0 || !coordLookup(env, fields[5], &glyphs[i].xOffset) || !coordLookup(env, fields[6], &glyphs[i].yOffset) ||
+			!coordLookup(env, fields[7], &glyphs[i].advance)){
+			return enif_make_badarg(env);
+		}
+		rects[i].x = x;
+		rects[i].y = y;
+		rects[i].w = w;
+		rects[i].h = h;
+	}
+	SDL_Surface* atlas;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &atlas, &locks);
+	if(found<0){
 		return enif_make_badarg(env);
 	}
-	
-	std::string surfaceString(surfaceName);
-	int index = surfaceIndex(surfaceString);
-	
-	if(index<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_UpdateRect", ERL_NIF_LATIN1);
+	if(found==0){
+		return enif_make_string(env, "Surface not found in sdl_LoadFont", ERL_NIF_LATIN1);
 	}
-	
-	//Update the rect for the surface
-	SDL_UpdateRect(surfaceArray[index], x, y, w, h);
-	
-	return enif_make_int(env, 0); /*Exit code*/
+	for(unsigned int i = 0; i < length; i++){
+		if(rects[i].x < 0 || rects[i].y < 0 || rects[i].x + rects[i].w > atlas->w || rects[i].y + rects[i].h > atlas->h){
+			return enif_make_string(env, "A glyph is outside the atlas in sdl_LoadFont", ERL_NIF_LATIN1);
+		}
+	}
+	if(SDL_MUSTLOCK(atlas) && SDL_LockSurface(atlas) < 0){
+		return enif_make_string(env, "Surface couldn't be locked in sdl_LoadFont", ERL_NIF_LATIN1);
+	}
+	BitmapFont* font = new BitmapFont();
+	font->lineHeight = lineHeight;
+	font->fallback = -1;
+	std::fill(font->ascii, font->ascii + 128, -1);
+	font->maxArea = 0;
+	for(unsigned int i = 0; i < length; i++){
+		Glyph& glyph = glyphs[i];
+		glyph.w = rects[i].w;
+		glyph.h = rects[i].h;
+		glyph.firstSpan = font->spans.size();
+		glyphSpans(atlas, rects[i], font->spans);
+		glyph.spanCount = font->spans.size() - glyph.firstSpan;
+		font->maxArea = std::max(font->maxArea, (long) glyph.w * glyph.h);
+		//A character listed twice gets the last glyph given for it
+		if(codepoints[i] < 128){
+			font->ascii[codepoints[i]] = i;
+		}
+		else{
+			font->others[codepoints[i]] = i;
+		}
+	}
+	if(SDL_MUSTLOCK(atlas)){
+		SDL_UnlockSurface(atlas);
+	}
+	font->glyphs.swap(glyphs);
+	int replacement = glyphIndex(font, 0xFFFD);
+	font->fallback = replacement >= 0 ? replacement : glyphIndex(font, '?');
+	FontHandle* handle = (FontHandle*) enif_alloc_resource(fontResourceType, sizeof(FontHandle));
+	handle->font = font;
+	ERL_NIF_TERM term = enif_make_resource(env, handle);
+	//The term now owns the font
+	enif_release_resource(handle);
+	return term;
 }
 
 /**
-*	New function for the library.
-*	@param surfaceName name of the surface whose pixel format is being gotten.
-*	@return ERL_NIF_TERM Erlang List of various pixel format elements, or an error message on failure.
+*	New function for this library. Draws text in a bitmap font, blended as sdl_SetDrawBlendMode says like the shapes.
+*	@param font From sdl_LoadFont, surface The target surface (handle or name), x, y Where the top left corner of the text goes,
+*		colour As sdl_FillRect, text UTF-8 text (a binary or iolist). A newline starts a new line.
+*	@Return {W, H} The size of the text, a bad argument error, or an error string.
 **/
-static ERL_NIF_TERM sdl_GetPixelFormat (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_DrawText (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_DrawText", 6);
+	NifTimer timing(callStats);
+	FontHandle* font;
+	int x, y;
+	ErlNifBinary text;
+	if(!enif_get_resource(env, argv[0], fontResourceType, (void**) &font) || !coordLookup(env, argv[2], &x) || !coordLookup(env, argv[3], &y) ||
+		!enif_inspect_iolist_as_binary(env, argv[5], &text)){
 		return enif_make_badarg(env);
 	}
-	std::string surfaceString(surfaceName);
-	int index = surfaceIndex(surfaceString);
-	
-	if(index<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_UpdateRect", ERL_NIF_LATIN1);
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	if(!openCanvas(env, argv[1], argv[4], "sdl_DrawText", &canvas, &locks, &error)){
+		return error;
 	}
-	
-	SDL_Surface* surface = surfaceArray[index];
-	
-	//Get Pixel Format
-	SDL_PixelFormat* pixelFormat = surface->format;
-	
-	//Make lists for loss, shift, and mask to cut down on size of pixelList. This means we will be passing back a list containing lists
-	ERL_NIF_TERM lossList = enif_make_list4(env, enif_make_int(env, pixelFormat->Rloss), enif_make_int(env, pixelFormat->Gloss), enif_make_int(env, pixelFormat->Bloss), enif_make_int(env, pixelFormat->Aloss));
-	
-	ERL_NIF_TERM shiftList = enif_make_list4(env, enif_make_int(env, pixelFormat->Rshift), enif_make_int(env, pixelFormat->Gshift), enif_make_int(env, pixelFormat->Bshift), enif_make_int(env, pixelFormat->Ashift));
-	
-	ERL_NIF_TERM maskList = enif_make_list4(env, enif_make_int(env, pixelFormat->Rmask), enif_make_int(env, pixelFormat->Gmask), enif_make_int(env, pixelFormat->Bmask), enif_make_int(env, pixelFormat->Amask));
-		
-	ERL_NIF_TERM pixelList = enif_make_list8(env, enif_make_string(env, surfaceName, ERL_NIF_LATIN1), enif_make_int(env, pixelFormat->BitsPerPixel), enif_make_int(env, pixelFormat->BytesPerPixel), lossList, shiftList, maskList, enif_make_int(env, pixelFormat->colorkey), enif_make_int(env, pixelFormat->alpha));
-		
-	return(pixelList);
+	if(onNormalScheduler() && (long) text.size * font->font->maxArea + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_DrawText", sdl_DrawText, argc, argv);
+	}
+	if(!readyCanvas(env, &canvas, "sdl_DrawText", &error)){
+		return error;
+	}
+	int w, h;
+	layoutText(font->font, &canvas, x, y, text.data, text.size, &w, &h);
+	endCanvas(&canvas);
+	return enif_make_tuple2(env, enif_make_int(env, w), enif_make_int(env, h));
 }
 
 /**
-*	Wrapped SDL_MapRGB
-*	Stores new RGB maps in the rgbMap vector and their names in mapNames
-*	Overwrites if the name already exists
-*	@Param mapName Name of map (for storage and reference), formatName Name of surface whose format we're using,  r red value, g green value, b blue value
-*	@Return 0 on success, error String otherwise.
+*	New function for this library. Draws many pieces of text in a bitmap font in one call, as sdl_DrawText would one at a time.
+*	@param font From sdl_LoadFont, surface The target surface (handle or name), labels A list of {X, Y, Colour, Text}, as sdl_DrawText.
+*	@Return The number of labels drawn, a bad argument error, or an error string.
 **/
-ERL_NIF_TERM sdl_MapRGB (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char mapName[maxBuffLen];
-	char formatName[maxBuffLen];
-	int r, g, b;
-	//Ok, so it's fiddly to pass hex values in from erlang but we could convert integers
-	if(!enif_get_string(env, argv[0], mapName, maxBuffLen, ERL_NIF_LATIN1) || !enif_get_string(env, argv[1], formatName, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_DrawTextBatch (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_DrawTextBatch", 3);
+	NifTimer timing(callStats);
+	FontHandle* font;
+	unsigned int length;
+	if(!enif_get_resource(env, argv[0], fontResourceType, (void**) &font) || !enif_get_list_length(env, argv[2], &length)){
 		return enif_make_badarg(env);
 	}
-	
-	if(!enif_get_int(env, argv[2], &r) || !enif_get_int(env, argv[3], &g) || !enif_get_int(env, argv[4], &b)){
-		return enif_make_badarg(env);
+	std::vector<int> xs(length), ys(length);
+	std::vector<Uint32> colours(length);
+	std::vector<ErlNifBinary> texts(length);
+	long area = 0;
+	ERL_NIF_TERM list = argv[2];
+	ERL_NIF_TERM head;
+	for(unsigned int i = 0; i < length; i++){
+		enif_get_list_cell(env, list, &head, &list);
+		int arity;
+		const ERL_NIF_TERM* fields;
+		if(!enif_get_tuple(env, head, &arity, &fields) || arity != 4 || !coordLookup(env, fields[0], &xs[i]) || !coordLookup(env, fields[1], &ys[i]) ||
+			!enif_inspect_iolist_as_binary(env, fields[3], &texts[i])){
+			return enif_make_badarg(env);
+		}
+		int mFound = colourLookup(env, fields[2], &colours[i]);
+		if(mFound<0){
+			return enif_make_badarg(env);
+		}
+		if(mFound==0){
+			return enif_make_string(env, "Map not found in sdl_DrawTextBatch", ERL_NIF_LATIN1);
+		}
+		area += (long) texts[i].size * font->font->maxArea;
 	}
-	if(r<0 || r>255 || g<0 || g>255 || b<0 || b>255){
-		return enif_make_string(env, "R, G, or B value out of bounds in sdl_mapRGB. Please ensure value is 0<=X<=255", ERL_NIF_LATIN1);
+	SurfaceLocks locks;
+	SpanCanvas canvas;
+	ERL_NIF_TERM error;
+	//Each label sets its own colour
+	if(!openCanvas(env, argv[1], enif_make_uint(env, 0), "sdl_DrawTextBatch", &canvas, &locks, &error)){
+		return error;
 	}
-	
-	//Lookup map name
-	std::string mapString(mapName);
-	int mIndex = mapIndex(mapString);
-	
-	bool mapExists = true;
-	if(mIndex<0){
-		//Map doesn't exist create a new one
-		mIndex=mapNames.size();
-		mapNames.push_back(mapString);
-		mapExists = false;
-	}
-	//otherwise map exists, overwrite
-	
-	//Check format exists
-	std::string formatString(formatName);
-	int formatIndex = surfaceIndex(formatString);
-	
-	if(formatIndex<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_MapRGB", ERL_NIF_LATIN1);
+	if(onNormalScheduler() && area + canvas.copyPixels > dirtyPixelThreshold){
+		return timing.reschedule(env, "sdl_DrawTextBatch", sdl_DrawTextBatch, argc, argv);
 	}
-	
-	Uint8 rHex = (Uint8) r;
-	Uint8 gHex = (Uint8) g;
-	Uint8 bHex = (Uint8) b;
-	
-	SDL_PixelFormat* pixelFormat = surfaceArray[formatIndex]->format;
-	if(mapExists){
-		rgbMaps[mIndex] = SDL_MapRGB(pixelFormat, rHex, gHex, bHex);
+	if(!readyCanvas(env, &canvas, "sdl_DrawTextBatch", &error)){
+		return error;
 	}
-	else{
-		rgbMaps.push_back(SDL_MapRGB(pixelFormat, rHex, gHex, bHex));
+	for(unsigned int i = 0; i < length; i++){
+		int w, h;
+		canvasColour(&canvas, colours[i]);
+		layoutText(font->font, &canvas, xs[i], ys[i], texts[i].data, texts[i].size, &w, &h);
 	}
-	
-	return enif_make_int(env, 0); /*Exit code*/
+	endCanvas(&canvas);
+	return enif_make_int(env, length);
 }
 
 /**
-*	Wrapped MUSTLOCK SDL function
-*	@param surfaceName Name of the surface to check lock status on
-*	@return 0 if True, 1 if False, Error srting otherwise.
+*	New function for this library. Measures text in a bitmap font without drawing it, for laying it out.
+*	@param font From sdl_LoadFont, text UTF-8 text (a binary or iolist), as sdl_DrawText.
+*	@Return {W, H} The size sdl_DrawText would draw it, or a bad argument error.
 **/
-ERL_NIF_TERM sdl_MUSTLOCK (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_TextSize (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_TextSize", 2);
+	NifTimer timing(callStats);
+	FontHandle* font;
+	ErlNifBinary text;
+	if(!enif_get_resource(env, argv[0], fontResourceType, (void**) &font) || !enif_inspect_iolist_as_binary(env, argv[1], &text)){
 		return enif_make_badarg(env);
 	}
-	std::string surfaceString(surfaceName);
-	int index = surfaceIndex(surfaceString);
-	
-	if(index<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_MUSTLOCK" , ERL_NIF_LATIN1);
+	int w, h;
+	layoutText(font->font, NULL, 0, 0, text.data, text.size, &w, &h);
+	return enif_make_tuple2(env, enif_make_int(env, w), enif_make_int(env, h));
+}
+
+/**
+*	New function for this library. Reads a surface's pixels, or a rectangle of them, back into Erlang.
+*	Where possible the binary points straight at the surface's pixel buffer instead of copying it. The binary keeps the surface alive,
+*	and drawing on the surface afterwards draws on a copy, so the binary is a snapshot of the pixels at the time of the call.
+*	The screen, and rectangles that don't cover whole rows, are copied instead.
+*	@param surface The surface (handle or name), rect (optional) The rectangle {X, Y, W, H} to read, clipped to the surface. Defaults to the whole surface.
+*	@Return {W, H, Pitch, Pixels}, where row N of the rectangle starts Pitch*N bytes into the Pixels binary. A bad argument error, or an error string otherwise.
+**/
+ERL_NIF_TERM sdl_GetPixels (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats1("sdl_GetPixels", 1), callStats2("sdl_GetPixels", 2);
+	NifTimer timing(argc == 1 ? callStats1 : callStats2);
+	SurfaceHandle* handle;
+	SurfaceLocks locks;
+	int found = surfaceLookup(env, argv[0], &handle, &locks);
+	if(found<0){
+		return enif_make_badarg(env);
 	}
-	
-	//Apparently Nifs don't have a make boolean option, so we've got to use int instead
-	if(SDL_MUSTLOCK(surfaceArray[index])){
-		//return TRUE
-		return enif_make_int(env,0);
+	if(found==0 || handle->surface==NULL){
+		return enif_make_string(env, "Surface not found in sdl_GetPixels" , ERL_NIF_LATIN1);
 	}
-	//return FALSE
-	return enif_make_int(env,1);
+	SDL_Surface* surface = handle->surface;
+
+	SDL_Rect rect;
+	if(argc < 2){
+		rect.x = 0;
+		rect.y = 0;
+		rect.w = surface->w;
+		rect.h = surface->h;
+	}
+	else if(!rectLookup(env, argv[1], &rect)){
+		return enif_make_badarg(env);
+	}
+	//Clip the rectangle to the surface
+	long x0 = rect.x < 0 ? 0 : rect.x;
+	long y0 = rect.y < 0 ? 0 : rect.y;
+	long x1 = (long) rect.x + rect.w > surface->w ? surface->w : (long) rect.x + rect.w;
+	long y1 = (long) rect.y + rect.h > surface->h ? surface->h : (long) rect.y + rect.h;
+	long w = x1 > x0 ? x1 - x0 : 0;
+	long h = y1 > y0 ? y1 - y0 : 0;
+
+	int bpp = surface->format->BytesPerPixel;
+	size_t rowBytes = (size_t) w * bpp;
+	bool wholeRows = (x0 == 0 && w == surface->w) || h <= 1;
+	ERL_NIF_TERM pixels;
+	long pitch;
+
+	//The screen is drawn on in place and a surface that must be locked may move its pixels, those are always copied
+	if(wholeRows && !handle->isScreen && !SDL_MUSTLOCK(surface)){
+		pitch = h > 1 ? surface->pitch : (long) rowBytes;
+		size_t size = h > 0 ? (size_t) (h - 1) * surface->pitch + rowBytes : 0;
+		PixelSnapshot* snapshot = (PixelSnapshot*) enif_alloc_resource(pixelSnapshotResourceType, sizeof(PixelSnapshot));
+		retainSurface(surface);
+		snapshot->surface = surface;
+		pixels = enif_make_resource_binary(env, snapshot, (Uint8 *)surface->pixels + y0 * surface->pitch + x0 * bpp, size);
+		enif_release_resource(snapshot);
+	}
+	else{
+		if(onNormalScheduler() && w * h > dirtyPixelThreshold){
+			return timing.reschedule(env, "sdl_GetPixels", sdl_GetPixels, argc, argv);
+		}
+		if(SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0){
+			return enif_make_string(env, "Surface couldn't be locked in sdl_GetPixels" , ERL_NIF_LATIN1);
+		}
+		pitch = (long) rowBytes;
+		Uint8* copy = enif_make_new_binary(env, rowBytes * h, &pixels);
+		for(long row = 0; row < h; row++){
+			memcpy(copy + row * rowBytes, (Uint8 *)surface->pixels + (y0 + row) * surface->pitch + x0 * bpp, rowBytes);
+		}
+		if(SDL_MUSTLOCK(surface)){
+			SDL_UnlockSurface(surface);
+		}
+	}
+	return enif_make_tuple4(env, enif_make_long(env, w), enif_make_long(env, h), enif_make_long(env, pitch), pixels);
 }
 
 /**
-*	Wrapped LockSurface SDL Function. Locks a surface.
-*	@Params surfaceName Name of surface to be locked.
-*	@return 0 on success, error string otherwise.
+*	New function for this library. Sets the number of threads large sdl_Submit command lists and sdl_BlitBatch calls are drawn with.
+*	Their drawing is split into bands of rows drawn at the same time by a pool of native threads, with the calling scheduler
+*	thread drawing too. Batches that are small, or use surfaces that need locking, are still drawn on the calling thread alone.
+*	@param threads The number of threads to draw with, counting the calling thread. 1 (the default) turns the pool off,
+*		0 uses one per CPU core.
+*	@Return The number of threads now drawing, or a bad argument error
 **/
-ERL_NIF_TERM sdl_LockSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_SetRenderThreads (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_SetRenderThreads", 1);
+	NifTimer timing(callStats);
+	int threads;
+	if(!enif_get_int(env, argv[0], &threads) || threads < 0 || threads > 256){
 		return enif_make_badarg(env);
 	}
-	std::string surfaceString(surfaceName);
-	int index = surfaceIndex(surfaceString);
-	
-	if(index<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_LockSurface" , ERL_NIF_LATIN1);
+	if(threads == 0){
+		threads = std::max(1u, std::thread::hardware_concurrency());
 	}
-	
-	 if ( SDL_LockSurface(surfaceArray[index]) < 0 ) {
-            return enif_make_string(env, "Surface couldn't be locked in sdl_LockSurface" , ERL_NIF_LATIN1);
-        }
-	return enif_make_int(env,0); /*Exit code*/
+	//Waits for any job on the pool to finish
+	std::lock_guard<std::mutex> job(renderJobLock);
+	stopRenderThreads();
+	if(threads > 1){
+		renderQueues = new TileQueue[threads];
+		renderParticipants = threads;
+		for(int i = 1; i < threads; i++){
+			renderThreads.push_back(std::thread(renderLoop, i, renderGeneration));
+		}
+	}
+	return enif_make_int(env, renderParticipants);
 }
 
 /**
-*	Wrapped UnlockSurface SDL Function. Unlocks a surface.
-*	@Params surfaceName Name of surface to be unlocked.
-*	@return 0 on success, error string otherwise.
+*	New function for this library. Runs a whole list of drawing commands in one call, in order.
+*	@param surfaces A list of surfaces (handles or names). Commands refer to them by their position in the list, starting at 0.
+*		commands The encoded command list (a binary or iolist), as built by the functions in sdlCommandList.erl.
+*	@Return 0 if every command ran, {error, N, Reason} if command N (counting from 1) failed. Commands after a failure are not run.
 **/
-ERL_NIF_TERM sdl_UnlockSurface (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1)){
+ERL_NIF_TERM sdl_Submit (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
+	static NifStats callStats("sdl_Submit", 2);
+	NifTimer timing(callStats);
+	ErlNifBinary commands;
+	unsigned int length;
+	if(!enif_get_list_length(env, argv[0], &length) || !enif_inspect_iolist_as_binary(env, argv[1], &commands)){
 		return enif_make_badarg(env);
 	}
-	std::string surfaceString(surfaceName);
-	int index = surfaceIndex(surfaceString);
-	
-	if(index<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_LockSurface" , ERL_NIF_LATIN1);
+
+	//Resolve every surface once up front. Surfaces that aren't found only fail the commands that use them
+	std::vector<SurfaceHandle*> surfaces(length, (SurfaceHandle*) NULL);
+	ERL_NIF_TERM list = argv[0];
+	ERL_NIF_TERM head;
+	for(unsigned int i = 0; i < length; i++){
+		enif_get_list_cell(env, list, &head, &list);
+		if(surfaceLookup(env, head, &surfaces[i]) < 0){
+			return enif_make_badarg(env);
+		}
 	}
-	
-	SDL_UnlockSurface(surfaceArray[index]);
-	return enif_make_int(env,0); /*Exit code*/
+	//Every surface in the list stays locked until the whole command list has been drawn
+	SurfaceLocks locks;
+	locks.lock(surfaces);
+
+	CommandReader reader;
+	reader.pos = commands.data;
+	reader.end = commands.data + commands.size;
+	RenderBatch batch;
+	int failed = 0;
+	const char* error = NULL;
+	SubmitOp command;
+	command.position = 0;
+	while(reader.pos < reader.end && error == NULL){
+		command.position++;
+		command.source = NULL;
+		command.sourceHandle = NULL;
+		Uint8 op;
+		reader.get(&op);
+		error = readCommand(op, reader, surfaces, &command);
+		if(error != NULL){
+			failed = command.position;
+			break;
+		}
+		if(renderParticipants < 2){
+			//No render threads, so draw each command straight away
+			error = runCommand(command);
+			failed = command.position;
+			continue;
+		}
+		//Drawing commands are batched up for the render threads, anything else waits for the batch to be drawn first
+		if(!drawingCommand(op) || !batch.fits(command)){
+			error = drawBatch(batch, &failed);
+		}
+		if(error == NULL && drawingCommand(op)){
+			batch.add(command);
+		}
+		else if(error == NULL){
+			error = runCommand(command);
+			failed = command.position;
+		}
+	}
+	//Commands before a bad one are still drawn
+	int batchFailed;
+	const char* batchError = drawBatch(batch, &batchFailed);
+	if(batchError != NULL){
+		error = batchError;
+		failed = batchFailed;
+	}
+	if(error != NULL){
+		return enif_make_tuple3(env, enif_make_atom(env, "error"), enif_make_int(env, failed), enif_make_atom(env, error));
+	}
+	return enif_make_int(env,0);
 }
 
 /**
-*	New function for this library. Sets the rgb value of a pixel in a surface.
-*	@param surfaceName Name of the target surface, x and y are the co-ordinates of the pixel, mapName Name of the RGB Map the pixel will inherit the colour value from.
-*	@Return 0 on success, error string otherwise.
+*	Called when the library is loaded. Opens the resource types used by the library.
+*	@return 0 on success, anything else fails the load.
 **/
-ERL_NIF_TERM sdl_SetPixel (ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]){
-	char surfaceName[maxBuffLen];
-	char mapName[maxBuffLen];
-	int x, y;
-	if(!enif_get_string(env, argv[0], surfaceName, maxBuffLen, ERL_NIF_LATIN1) || !enif_get_string(env, argv[3], mapName, maxBuffLen, ERL_NIF_LATIN1)){
-		return enif_make_badarg(env);
+static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info){
+	ErlNifResourceFlags tried;
+	surfaceResourceType = enif_open_resource_type(env, NULL, "sdl_surface", surfaceHandleDtor, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), &tried);
+	if(surfaceResourceType == NULL){
+		return 1;
 	}
-	
-	if(!enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y)){
-		return enif_make_badarg(env);
+	pixelSnapshotResourceType = enif_open_resource_type(env, NULL, "sdl_pixels", pixelSnapshotDtor, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), &tried);
+	if(pixelSnapshotResourceType == NULL){
+		return 1;
 	}
-	
-	std::string surfaceString(surfaceName);
-	int index = surfaceIndex(surfaceString);
-	if(index<0){
-		return enif_make_string(env, "SurfaceIndex returned <0 in sdl_SetPixel" , ERL_NIF_LATIN1);
+	assetPackResourceType = enif_open_resource_type(env, NULL, "sdl_asset_pack", assetPackDtor, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), &tried);
+	if(assetPackResourceType == NULL){
+		return 1;
 	}
-	
-	std::string mapString(mapName);
-	int mIndex = mapIndex(mapString);
-	if(mIndex<0){
-		return enif_make_string(env, "MapIndex returned <0 in sdl_SetPixel" , ERL_NIF_LATIN1);
+	fontResourceType = enif_open_resource_type(env, NULL, "sdl_font", fontDtor, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER), &tried);
+	if(fontResourceType == NULL){
+		return 1;
 	}
-	
-	Uint32 newPixel = rgbMaps[mIndex];
-	
-	//Get the bytes per pixel and the old pixel value
-	int bpp = surfaceArray[index]->format->BytesPerPixel;
-	Uint8 *oldPixel = (Uint8 *)surfaceArray[index]->pixels + y * surfaceArray[index]->pitch + x * bpp;
-	
-	if (bpp == 1){
-		*oldPixel = newPixel;
-	}
-	else if (bpp == 2){
-		*(Uint16 *)oldPixel = newPixel;
-	}
-	else if (bpp == 3){
-		//For a bits per pixel size of 3 the order of pixels may be reversed
-		if(SDL_BYTEORDER == SDL_BIG_ENDIAN) {
-            oldPixel[0] = (newPixel >> 16) & 0xff;
-            oldPixel[1] = (newPixel >> 8) & 0xff;
-            oldPixel[2] = newPixel & 0xff;
-        } else {
-            oldPixel[0] = newPixel & 0xff;
-            oldPixel[1] = (newPixel >> 8) & 0xff;
-            oldPixel[2] = (newPixel >> 16) & 0xff;
-        }
+	return 0;
+}
+
+/**
+*	Called when the library is unloaded. Stops the native threads, the code they run is about to go away.
+**/
+static void unload(ErlNifEnv* env, void* priv_data){
+	{
+		std::lock_guard<std::mutex> lock(timerLock);
+		timerStopping = true;
+		timerWake.notify_one();
 	}
-	else if (bpp == 4){
-		*(Uint32 *)oldPixel = newPixel;
+	if(timerThread.joinable()){
+		timerThread.join();
 	}
-	else{
-		//We shouldn't get here, if we do there's a problem with bpp
-		return enif_make_string(env, "Bytes per pixel found to be of an invalid range in sdl_SetPixel()", ERL_NIF_LATIN1);
+	stopFrameClock();
+	stopEventPump();
+	stopCapture();
+	{
+		std::lock_guard<std::mutex> job(renderJobLock);
+		stopRenderThreads();
+	}
+	while(!timerQueue.empty()){
+		enif_free_env(timerQueue.top().msgEnv);
+		timerQueue.pop();
 	}
-	return enif_make_int(env,0);
 }
 
 /**
 *	An array of the functions (as they are referred to by Erlang, their arity, and the function name in cpp)
+*	File I/O and waiting run on dirty IO schedulers. sdl_Submit draws a whole frame so always runs on a dirty CPU scheduler,
+*	the other drawing functions move there themselves when given a large job.
 **/
 static ErlNifFunc nif_funcs[] = {
 	{"sdl_Init", 1, sdl_Init},
 	{"sdl_Quit", 0, sdl_Quit},
 	{"sdl_CreateSurface",1,sdl_CreateSurface},
 	{"sdl_SetVideoMode",5,sdl_SetVideoMode},
-	{"sdl_LoadBMP",2,sdl_LoadBMP},
+	{"sdl_LoadBMP",2,sdl_LoadBMP,ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"sdl_LoadBMPFromBinary",2,sdl_LoadBMPFromBinary},
+	{"sdl_OpenAssetPack",1,sdl_OpenAssetPack,ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"sdl_LoadBMPFromPack",4,sdl_LoadBMPFromPack,ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"sdl_PreloadBMP",1,sdl_PreloadBMP,ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"sdl_SetAssetCacheBudget",1,sdl_SetAssetCacheBudget},
+	{"sdl_AssetCacheStats",0,sdl_AssetCacheStats},
+	{"sdl_CreateBlankSurface",3,sdl_CreateBlankSurface},
+	{"sdl_ReserveSurfaces",3,sdl_ReserveSurfaces},
+	{"sdl_SetSurfacePoolBudget",1,sdl_SetSurfacePoolBudget},
+	{"sdl_SurfacePoolStats",0,sdl_SurfacePoolStats},
 	{"sdl_BlitSurface",4,sdl_BlitSurface},
+	{"sdl_BlitBatch",3,sdl_BlitBatch},
+	{"sdl_DrawTilemap",9,sdl_DrawTilemap},
+	{"sdl_BlitTransformed",6,sdl_BlitTransformed},
+	{"sdl_SetTransformCacheBudget",1,sdl_SetTransformCacheBudget},
+	{"sdl_TransformCacheStats",0,sdl_TransformCacheStats},
+	{"sdl_SetLayer",7,sdl_SetLayer},
+	{"sdl_RemoveLayer",1,sdl_RemoveLayer},
+	{"sdl_ClearLayers",0,sdl_ClearLayers},
+	{"sdl_Compose",1,sdl_Compose},
+	{"sdl_CompositorStats",0,sdl_CompositorStats},
 	{"sdl_Flip",1,sdl_Flip},
-	{"sdl_Delay",1,sdl_Delay},
+	{"sdl_Present",1,sdl_Present},
+	{"sdl_PresentStats",0,sdl_PresentStats},
+	{"sdl_Stats",0,sdl_Stats},
+	{"sdl_ResetStats",0,sdl_ResetStats},
+	{"sdl_Delay",1,sdl_Delay,ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"sdl_DelayAsync",1,sdl_DelayAsync},
+	{"sdl_StartFrameClock",2,sdl_StartFrameClock},
+	{"sdl_StopFrameClock",0,sdl_StopFrameClock},
+	{"sdl_StartEventPump",3,sdl_StartEventPump},
+	{"sdl_StopEventPump",0,sdl_StopEventPump},
+	{"sdl_StartCapture",4,sdl_StartCapture,ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"sdl_StopCapture",0,sdl_StopCapture,ERL_NIF_DIRTY_JOB_IO_BOUND},
+	{"sdl_CaptureStats",0,sdl_CaptureStats},
 	{"sdl_FreeSurface",1,sdl_FreeSurface},
 	{"sdl_UpdateRect",5,sdl_UpdateRect},
 	{"sdl_GetPixelFormat", 1, sdl_GetPixelFormat},
 	{"sdl_MapRGB",5,sdl_MapRGB},
+	{"sdl_MapRGB",4,sdl_MapRGB4},
 	{"sdl_MUSTLOCK",1,sdl_MUSTLOCK},
 	{"sdl_LockSurface",1,sdl_LockSurface},
 	{"sdl_UnlockSurface",1,sdl_UnlockSurface},
-	{"sdl_SetPixel",4,sdl_SetPixel}
+	{"sdl_SetPixel",4,sdl_SetPixel},
+	{"sdl_SetPixels",2,sdl_SetPixels},
+	{"sdl_SetPixelRow",4,sdl_SetPixelRow},
+	{"sdl_SetBlendMode",3,sdl_SetBlendMode},
+	{"sdl_SetDrawBlendMode",3,sdl_SetDrawBlendMode},
+	{"sdl_FillRect",3,sdl_FillRect},
+	{"sdl_HLine",5,sdl_HLine},
+	{"sdl_VLine",5,sdl_VLine},
+	{"sdl_Line",6,sdl_Line},
+	{"sdl_FillCircle",5,sdl_FillCircle},
+	{"sdl_FillEllipse",6,sdl_FillEllipse},
+	{"sdl_FillTriangle",5,sdl_FillTriangle},
+	{"sdl_FillPolygon",3,sdl_FillPolygon},
+	{"sdl_LoadFont",3,sdl_LoadFont,ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"sdl_DrawText",6,sdl_DrawText},
+	{"sdl_DrawTextBatch",3,sdl_DrawTextBatch},
+	{"sdl_TextSize",2,sdl_TextSize},
+	{"sdl_GetPixels",1,sdl_GetPixels},
+	{"sdl_GetPixels",2,sdl_GetPixels},
+	{"sdl_Submit",2,sdl_Submit,ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"sdl_SetRenderThreads",1,sdl_SetRenderThreads,ERL_NIF_DIRTY_JOB_CPU_BOUND}
 };
 
 /**
 *	Variable for initialising the NIFs
 **/
-ERL_NIF_INIT(INSERT_ERLANG_MODULE_NAME, nif_funcs, NULL, NULL, NULL, NULL)
+ERL_NIF_INIT(INSERT_ERLANG_MODULE_NAME, nif_funcs, load, NULL, NULL, unload)